@@ -0,0 +1,517 @@
+/*
+ * Acknowledged data for TX_ACK (indication) and RX_ACK (write) pipes
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Unlike the TX pipe send cache, where only the latest value counts, every
+ * packet written to a TX_ACK pipe is queued and delivered in order. Up to
+ * ACK_WINDOW of the oldest packets are in flight at any time, each one is
+ * matched to the next DataAckEvent or PipeErrorEvent of its pipe, and the
+ * application is told about the outcome with the packet's tag. A packet
+ * that isn't acknowledged within ACK_TIMEOUT_MS is failed as well, so the
+ * window moves on even if its event never shows up.
+ *
+ * A full queue makes ack_send() fail, which is the application's signal
+ * to back off. ack_space() tells in advance how many packets still fit.
+ *
+ * Packets in flight when the connection drops are neither acknowledged nor
+ * failed, they are sent again once the central opens the pipe again. The
+ * central may therefore see a packet twice, but it never misses one.
+ *
+ * In the other direction, a central writing to an RX_ACK characteristic
+ * waits for the write response, which has to be triggered explicitly
+ * with SendDataAck or SendDataNack. The application's handler validates
+ * each packet right away and decides on the response, which is queued and
+ * sent by ack_rx_flush() once the received event is handled. If several
+ * responses are pending, they go out in consecutive transactions. The
+ * time from receiving the packet to sending its response is measured.
+ */
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "ack.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_ack_sent[] PROGMEM     = "Indications: sent ";
+static const char string_ack_acked[] PROGMEM    = ", acked ";
+static const char string_ack_errors[] PROGMEM   = ", errors ";
+static const char string_ack_resent[] PROGMEM   = ", resent ";
+static const char string_ack_timeouts[] PROGMEM = ", timeouts ";
+static const char string_ack_unexp[] PROGMEM    = ", unexpected ";
+static const char string_ack_rtt[] PROGMEM      = "RTT last/min/max/mean: ";
+static const char string_ack_rx[] PROGMEM      = "Writes: acked ";
+static const char string_ack_nacks[] PROGMEM    = ", nacked ";
+static const char string_ack_dropped[] PROGMEM  = ", dropped ";
+static const char string_ack_latency[] PROGMEM  = ", latency last/max/mean ";
+static const char string_ms[] PROGMEM           = " ms\r\n";
+static const char string_us[] PROGMEM           = " us\r\n";
+
+struct ack_packet {
+    uint8_t tag;
+    uint8_t length;
+    uint16_t sent;      /* tick sent, lower 16 bits */
+    uint8_t data[ACI_PIPE_TX_DATA_MAX_LEN];
+};
+
+struct ack_pipe {
+    uint8_t pipe;       /* 0 if unused */
+    uint8_t head;       /* oldest queued packet */
+    uint8_t count;      /* queued packets */
+    uint8_t inflight;   /* oldest packets sent, waiting for acknowledgement */
+    struct ack_packet queue[ACK_QUEUE_LEN];
+};
+
+/* Pending RX_ACK response */
+struct ack_response {
+    uint8_t pipe;
+    uint8_t status;
+    uint32_t received;  /* sched_cycles() at reception */
+};
+
+struct ack_stats ack_stats;
+
+static struct ack_pipe ack_pipes[ACK_PIPES];
+static struct sched_timer ack_timer;
+static ack_callback_t ack_callback;
+static ack_rx_handler_t ack_rx_handler;
+static struct ack_response ack_responses[ACK_RX_QUEUE_LEN];
+static uint8_t ack_responses_head;
+static uint8_t ack_responses_count;
+
+
+/**
+ * Initialize acknowledged transmit.
+ *
+ * Looks up all TX_ACK pipes, up to ACK_PIPES of them.
+ *
+ * @param callback Function called on packet completion, can be NULL
+ * @param rx_handler Function validating RX_ACK packets, can be NULL to
+ *                   acknowledge all of them
+ * @return none
+ */
+void
+ack_init(ack_callback_t callback, ack_rx_handler_t rx_handler)
+{
+    uint8_t pipe;
+    uint8_t i = 0;
+
+    ack_callback = callback;
+    ack_rx_handler = rx_handler;
+
+    for (pipe = 1; pipe <= NUMBER_OF_PIPES && i < ACK_PIPES; pipe++) {
+        if (nrf_pipe_type(pipe) & ACI_TX_ACK) {
+            ack_pipes[i++].pipe = pipe;
+        }
+    }
+}
+
+/**
+ * Find the queue of the given pipe.
+ *
+ * @param pipe TX_ACK pipe number
+ * @return pipe queue, or NULL if the pipe isn't handled
+ */
+static struct ack_pipe *
+ack_find(uint8_t pipe)
+{
+    uint8_t i;
+
+    for (i = 0; i < ACK_PIPES; i++) {
+        if (ack_pipes[i].pipe != 0 && ack_pipes[i].pipe == pipe) {
+            return &ack_pipes[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Queue a packet for acknowledged transmission.
+ *
+ * The packet is sent as soon as the window, data credits and pipe state
+ * allow it. The callback is called with the given tag once it is
+ * acknowledged or failed.
+ *
+ * @param pipe TX_ACK pipe number
+ * @param data Data to send
+ * @param length Data length, up to ACI_PIPE_TX_DATA_MAX_LEN bytes
+ * @param tag Application defined packet identifier
+ * @return 0 on success, -1 if the queue is full or the parameters are invalid
+ */
+int8_t
+ack_send(uint8_t pipe, const uint8_t *data, uint8_t length, uint8_t tag)
+{
+    struct ack_pipe *ap = ack_find(pipe);
+    struct ack_packet *packet;
+
+    if (ap == NULL || length > ACI_PIPE_TX_DATA_MAX_LEN ||
+        ap->count == ACK_QUEUE_LEN)
+    {
+        return -1;
+    }
+
+    packet = &ap->queue[(ap->head + ap->count) % ACK_QUEUE_LEN];
+    packet->tag = tag;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+    ap->count++;
+
+    nrf_flush();
+
+    return 0;
+}
+
+/**
+ * Return the number of packets that can still be queued.
+ *
+ * @param pipe TX_ACK pipe number
+ * @return free queue entries, 0 if the pipe isn't handled
+ */
+uint8_t
+ack_space(uint8_t pipe)
+{
+    struct ack_pipe *ap = ack_find(pipe);
+
+    if (ap == NULL) {
+        return 0;
+    }
+
+    return ACK_QUEUE_LEN - ap->count;
+}
+
+static int8_t ack_complete(uint8_t pipe, uint8_t status);
+
+/**
+ * Acknowledgement timer.
+ *
+ * Fails the oldest packet in flight of each pipe if it has waited for
+ * ACK_TIMEOUT_MS, and is armed again for the next one due, if any.
+ *
+ * @param none
+ * @return none
+ */
+static void
+ack_timeout(void)
+{
+    struct ack_pipe *ap;
+    uint16_t waited;
+    uint16_t left;
+    uint16_t next = 0;
+    uint8_t expired = 0;
+    uint8_t i;
+
+    for (i = 0; i < ACK_PIPES; i++) {
+        ap = &ack_pipes[i];
+        if (ap->pipe == 0 || ap->inflight == 0) {
+            continue;
+        }
+
+        waited = (uint16_t) sched_now() - ap->queue[ap->head].sent;
+        if (waited >= SCHED_MS(ACK_TIMEOUT_MS)) {
+            ack_complete(ap->pipe, ACK_STATUS_TIMEOUT);
+            expired = 1;
+        }
+        if (ap->inflight > 0) {
+            /* the next packet may be due already, check it right away */
+            waited = (uint16_t) sched_now() - ap->queue[ap->head].sent;
+            left = (waited < SCHED_MS(ACK_TIMEOUT_MS)) ?
+                   SCHED_MS(ACK_TIMEOUT_MS) - waited : 1;
+            if (next == 0 || left < next) {
+                next = left;
+            }
+        }
+    }
+
+    if (next > 0) {
+        sched_timer_start(&ack_timer, ack_timeout, next, 0);
+    }
+    if (expired) {
+        nrf_flush();
+    }
+}
+
+/**
+ * Send queued packets as far as window and data credits allow.
+ *
+ * Called from nrf_flush(), whenever credits or pipe states change.
+ *
+ * @param none
+ * @return none
+ */
+void
+ack_flush(void)
+{
+    struct ack_pipe *ap;
+    struct ack_packet *packet;
+    uint8_t i;
+
+    for (i = 0; i < ACK_PIPES; i++) {
+        ap = &ack_pipes[i];
+
+        while (ap->pipe != 0 && ap->inflight < ap->count &&
+               ap->inflight < ACK_WINDOW)
+        {
+            packet = &ap->queue[(ap->head + ap->inflight) % ACK_QUEUE_LEN];
+            if (nrf_send_data(ap->pipe, packet->data, packet->length) < 0) {
+                break;
+            }
+            packet->sent = sched_now();
+            ap->inflight++;
+            ack_stats.sent++;
+
+            if (!sched_timer_armed(&ack_timer)) {
+                sched_timer_start(&ack_timer, ack_timeout,
+                        SCHED_MS(ACK_TIMEOUT_MS), 0);
+            }
+        }
+    }
+}
+
+/**
+ * Complete the oldest packet in flight on the given pipe.
+ *
+ * @param pipe TX_ACK pipe number
+ * @param status ACK_STATUS_SUCCESS or ACI error code
+ * @return 0 on success, -1 if no packet is in flight
+ */
+static int8_t
+ack_complete(uint8_t pipe, uint8_t status)
+{
+    struct ack_pipe *ap = ack_find(pipe);
+    struct ack_packet *packet;
+    uint16_t rtt;
+
+    if (ap == NULL || ap->inflight == 0) {
+        ack_stats.unexpected++;
+        return -1;
+    }
+
+    packet = &ap->queue[ap->head];
+
+    if (status == ACK_STATUS_SUCCESS) {
+        rtt = ((uint16_t) sched_now() - packet->sent) * SCHED_TICK_MS;
+        ack_stats.acked++;
+        ack_stats.rtt_last = rtt;
+        ack_stats.rtt_total += rtt;
+        if (ack_stats.acked == 1 || rtt < ack_stats.rtt_min) {
+            ack_stats.rtt_min = rtt;
+        }
+        if (rtt > ack_stats.rtt_max) {
+            ack_stats.rtt_max = rtt;
+        }
+    } else if (status == ACK_STATUS_TIMEOUT) {
+        ack_stats.timeouts++;
+    } else {
+        ack_stats.errors++;
+    }
+
+    ap->head = (ap->head + 1) % ACK_QUEUE_LEN;
+    ap->count--;
+    ap->inflight--;
+
+    if (ack_callback != NULL) {
+        ack_callback(pipe, packet->tag, status);
+    }
+
+    return 0;
+}
+
+/**
+ * Handle a DataAckEvent.
+ *
+ * @param pipe Pipe the acknowledgement is for
+ * @return none
+ */
+void
+ack_received(uint8_t pipe)
+{
+    if (ack_complete(pipe, ACK_STATUS_SUCCESS) == 0) {
+        nrf_flush();
+    }
+}
+
+/**
+ * Handle a PipeErrorEvent on a TX_ACK pipe.
+ *
+ * The oldest packet in flight is dropped and reported as failed.
+ *
+ * @param pipe Pipe the error is for
+ * @param error ACI error code
+ * @return none
+ */
+void
+ack_error(uint8_t pipe, uint8_t error)
+{
+    ack_complete(pipe, error);
+}
+
+/**
+ * Handle a packet received on an RX_ACK pipe.
+ *
+ * The packet is passed to the RX handler and its response is queued for
+ * ack_rx_flush(). If the queue is full, the pending responses are sent
+ * right away to make room. If that fails as well, the packet is dropped
+ * without being handled, and the central doesn't get a write response.
+ *
+ * @param pipe RX_ACK pipe number
+ * @param data Received data
+ * @param length Data length
+ * @return 0 on success, -1 if the packet was dropped
+ */
+int8_t
+ack_rx_received(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    struct ack_response *response;
+    uint32_t received = sched_cycles();
+    uint8_t status = ACK_STATUS_SUCCESS;
+
+    if (ack_responses_count == ACK_RX_QUEUE_LEN) {
+        ack_rx_flush();
+        if (ack_responses_count == ACK_RX_QUEUE_LEN) {
+            ack_stats.rx_dropped++;
+            return -1;
+        }
+    }
+
+    if (ack_rx_handler != NULL) {
+        status = ack_rx_handler(pipe, data, length);
+    }
+
+    response = &ack_responses[(ack_responses_head + ack_responses_count) %
+                              ACK_RX_QUEUE_LEN];
+    response->pipe = pipe;
+    response->status = status;
+    response->received = received;
+    ack_responses_count++;
+
+    return 0;
+}
+
+/**
+ * Send all pending RX_ACK responses.
+ *
+ * Called by the nRF task after handling a received event. Responses that
+ * fail to be sent stay queued for the next call.
+ *
+ * @param none
+ * @return none
+ */
+void
+ack_rx_flush(void)
+{
+    struct ack_response *response;
+    uint32_t latency;
+    int8_t ret;
+
+    while (ack_responses_count > 0) {
+        response = &ack_responses[ack_responses_head];
+
+        if (response->status == ACK_STATUS_SUCCESS) {
+            ret = nrf_send_data_ack(response->pipe);
+        } else {
+            ret = nrf_send_data_nack(response->pipe, response->status);
+        }
+
+        if (ret < 0) {
+            return;
+        }
+
+        latency = (sched_cycles() - response->received) / (F_CPU / 1000000);
+        if (latency > 0xffff) {
+            latency = 0xffff;
+        }
+        ack_stats.rx_latency_last = latency;
+        ack_stats.rx_latency_total += latency;
+        if (latency > ack_stats.rx_latency_max) {
+            ack_stats.rx_latency_max = latency;
+        }
+
+        if (response->status == ACK_STATUS_SUCCESS) {
+            ack_stats.rx_acks++;
+        } else {
+            ack_stats.rx_nacks++;
+        }
+
+        ack_responses_head = (ack_responses_head + 1) % ACK_RX_QUEUE_LEN;
+        ack_responses_count--;
+    }
+}
+
+/**
+ * Handle a disconnect.
+ *
+ * Packets in flight are sent again after reconnecting, pending RX_ACK
+ * responses are dropped, the central is gone.
+ *
+ * @param none
+ * @return none
+ */
+void
+ack_disconnected(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < ACK_PIPES; i++) {
+        ack_stats.resent += ack_pipes[i].inflight;
+        ack_pipes[i].inflight = 0;
+    }
+
+    ack_stats.rx_dropped += ack_responses_count;
+    ack_responses_count = 0;
+}
+
+/**
+ * Print acknowledged transmit and receive statistics.
+ *
+ * @param none
+ * @return none
+ */
+void
+ack_print_stats(void)
+{
+    uint16_t i;
+
+    uart_print_pgm(string_ack_sent);
+    uart_putint(ack_stats.sent, 1);
+    uart_print_pgm(string_ack_acked);
+    uart_putint(ack_stats.acked, 1);
+    uart_print_pgm(string_ack_errors);
+    uart_putint(ack_stats.errors, 1);
+    uart_print_pgm(string_ack_timeouts);
+    uart_putint(ack_stats.timeouts, 1);
+    uart_print_pgm(string_ack_resent);
+    uart_putint(ack_stats.resent, 1);
+    uart_print_pgm(string_ack_unexp);
+    uart_putint(ack_stats.unexpected, 1);
+    uart_newline();
+
+    uart_print_pgm(string_ack_rtt);
+    uart_putint(ack_stats.rtt_last, 1);
+    uart_putchar('/');
+    uart_putint(ack_stats.rtt_min, 1);
+    uart_putchar('/');
+    uart_putint(ack_stats.rtt_max, 1);
+    uart_putchar('/');
+    uart_putint(ack_stats.acked ? ack_stats.rtt_total / ack_stats.acked : 0, 1);
+    uart_print_pgm(string_ms);
+
+    uart_print_pgm(string_ack_rx);
+    uart_putint(ack_stats.rx_acks, 1);
+    uart_print_pgm(string_ack_nacks);
+    uart_putint(ack_stats.rx_nacks, 1);
+    uart_print_pgm(string_ack_dropped);
+    uart_putint(ack_stats.rx_dropped, 1);
+    uart_print_pgm(string_ack_latency);
+    uart_putint(ack_stats.rx_latency_last, 1);
+    uart_putchar('/');
+    uart_putint(ack_stats.rx_latency_max, 1);
+    uart_putchar('/');
+    i = ack_stats.rx_acks + ack_stats.rx_nacks;
+    uart_putint(i ? ack_stats.rx_latency_total / i : 0, 1);
+    uart_print_pgm(string_us);
+}
@@ -0,0 +1,101 @@
+/*
+ * Acknowledged data for TX_ACK (indication) and RX_ACK (write) pipes
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _ACK_H_
+#define _ACK_H_
+
+#include <stdint.h>
+#include "nrf/services.h"
+
+/* Number of TX_ACK pipes that can be handled */
+#ifndef ACK_PIPES
+#define ACK_PIPES           1
+#endif
+
+/* Packets queued per pipe, including the ones waiting for acknowledgement */
+#ifndef ACK_QUEUE_LEN
+#define ACK_QUEUE_LEN       4
+#endif
+
+/*
+ * Packets sent per pipe without acknowledgement yet. ATT allows only a
+ * single outstanding indication, the nRF8001 rejects more with a
+ * PipeErrorEvent, so anything larger only makes sense for other peers.
+ */
+#ifndef ACK_WINDOW
+#define ACK_WINDOW          1
+#endif
+
+/*
+ * Time to wait for the acknowledgement of a packet in flight. Matches the
+ * ATT transaction timeout, no DataAckEvent can arrive after it.
+ */
+#ifndef ACK_TIMEOUT_MS
+#define ACK_TIMEOUT_MS      30000
+#endif
+
+/* Received RX_ACK packets waiting to be acknowledged */
+#ifndef ACK_RX_QUEUE_LEN
+#define ACK_RX_QUEUE_LEN    4
+#endif
+
+/* Completion status passed to the callback, other values are ACI errors */
+#define ACK_STATUS_SUCCESS  0x00
+#define ACK_STATUS_TIMEOUT  0xff    /* no acknowledgement in ACK_TIMEOUT_MS */
+
+/* First ATT application error code, up to 0x9f, for rejecting writes */
+#define ACK_ERROR_APP       0x80
+
+struct ack_stats {
+    uint16_t sent;          /* packets sent, including resends */
+    uint16_t acked;
+    uint16_t errors;        /* packets dropped after a PipeErrorEvent */
+    uint16_t timeouts;      /* packets dropped after ACK_TIMEOUT_MS */
+    uint16_t resent;        /* in flight during a disconnect, sent again */
+    uint16_t unexpected;    /* DataAckEvents without a packet in flight */
+    uint16_t rtt_last;      /* round-trip times, ms */
+    uint16_t rtt_min;
+    uint16_t rtt_max;
+    uint32_t rtt_total;
+    uint16_t rx_acks;       /* RX_ACK packets acknowledged */
+    uint16_t rx_nacks;      /* RX_ACK packets rejected */
+    uint16_t rx_dropped;    /* not acknowledged, queue full or disconnect */
+    uint16_t rx_latency_last;   /* receive to acknowledgement, us */
+    uint16_t rx_latency_max;
+    uint32_t rx_latency_total;
+};
+
+/*
+ * Completion callback, called once per packet with the tag given to
+ * ack_send() and either ACK_STATUS_SUCCESS, ACK_STATUS_TIMEOUT or the
+ * PipeErrorEvent's error.
+ */
+typedef void (*ack_callback_t)(uint8_t pipe, uint8_t tag, uint8_t status);
+
+/*
+ * RX_ACK data handler, validates and handles a received packet. Returns
+ * ACK_STATUS_SUCCESS to acknowledge it, or an ATT application error code
+ * from ACK_ERROR_APP on to reject it.
+ */
+typedef uint8_t (*ack_rx_handler_t)(uint8_t pipe,
+        const uint8_t *data, uint8_t length);
+
+void ack_init(ack_callback_t callback, ack_rx_handler_t rx_handler);
+int8_t ack_send(uint8_t pipe, const uint8_t *data, uint8_t length, uint8_t tag);
+uint8_t ack_space(uint8_t pipe);
+void ack_flush(void);
+void ack_received(uint8_t pipe);
+void ack_error(uint8_t pipe, uint8_t error);
+int8_t ack_rx_received(uint8_t pipe, const uint8_t *data, uint8_t length);
+void ack_rx_flush(void);
+void ack_disconnected(void);
+void ack_print_stats(void);
+
+extern struct ack_stats ack_stats;
+
+#endif /* _ACK_H_ */
@@ -0,0 +1,472 @@
+/*
+ * Timer triggered ADC sample streaming
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Timer1 compare match B auto triggers the ADC at the sample rate times
+ * the number of channels. The ADC interrupt stores each result in the
+ * current sample block and switches the multiplexer to the next channel,
+ * which takes effect with the next trigger.
+ *
+ * There are two blocks, one is filled while the other one waits to be
+ * sent. Once a block is full, it is handed to the ADC task, which sends
+ * it on the data pipe as soon as there is a data credit, and filling
+ * continues in the other block. If the other block hasn't been sent by
+ * then, the link can't keep up, and the full block is dropped and filled
+ * again, counting an overrun.
+ *
+ * A sweep looks for the highest sample rate for each channel count that
+ * runs without overruns, over the current link. It doubles the rate as
+ * long as a rate runs for ADC_SWEEP_MS without overruns, and then narrows
+ * it down between the last good and the first bad rate.
+ *
+ * Blocks can be sent through the codec, which packs more samples into
+ * each packet, see adc.h.
+ *
+ * Streaming is configured by the central on the config pipe with the
+ * channel mask and the sample rate per channel (16 bit, LSB first), a rate
+ * of 0 stops streaming.
+ */
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "adc.h"
+#include "codec.h"
+#include "input.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+#ifdef ADC_ENABLED
+
+#if ADC_PORTC_MASK & INPUT_PORTC_MASK
+#error "ADC_PORTC_MASK and INPUT_PORTC_MASK overlap"
+#endif
+
+static const char string_adc[] PROGMEM      = "ADC: ";
+static const char string_samples[] PROGMEM  = " samples, ";
+static const char string_blocks[] PROGMEM   = " blocks, ";
+static const char string_overruns[] PROGMEM = " overruns\r\n";
+static const char string_best[] PROGMEM     = "Best rate per channel count: ";
+static const char string_hz[] PROGMEM       = " Hz\r\n";
+static const char string_sweep[] PROGMEM    = "ADC sweep ";
+
+#define ADC_NONE 0xff
+
+static struct adc_block adc_blocks[2];
+static volatile uint8_t adc_fill;       /* block being filled */
+static volatile uint8_t adc_ready = ADC_NONE; /* block waiting to be sent */
+static volatile uint8_t adc_index;      /* next sample in the block */
+static volatile uint8_t adc_pos;        /* position in the channel list */
+static volatile uint8_t adc_seq;
+static volatile uint16_t adc_run_overruns;
+static uint8_t adc_list[ADC_CHANNELS_MAX];
+static uint8_t adc_count;
+/* channel list position of each block's first sample */
+static uint8_t adc_first[2];
+
+#ifdef ADC_CODEC_MODE
+static uint8_t adc_packet[ACI_PIPE_TX_DATA_MAX_LEN];
+static uint8_t adc_packet_len;          /* encoded packet not sent yet */
+static uint8_t adc_packet_count;        /* samples in it */
+static uint8_t adc_sent;                /* samples of the ready block sent */
+#endif
+
+static uint8_t adc_config_pipe;
+static uint8_t adc_data_pipe;
+
+struct adc_sweep {
+    uint8_t channels;   /* channel count being measured */
+    uint8_t mask;       /* channels being measured */
+    uint16_t rate;      /* rate being measured */
+    uint16_t good;      /* highest rate without overruns */
+    uint16_t bad;       /* lowest rate with overruns, 0 if none yet */
+};
+
+static struct adc_sweep sweep;
+static struct sched_timer sweep_timer;
+
+struct adc_stats adc_stats;
+
+static void adc_task(void);
+
+
+/**
+ * Initialize ADC streaming.
+ *
+ * @param config_pipe Pipe receiving the streaming configuration
+ * @param data_pipe TX pipe the sample blocks are sent on
+ * @return none
+ */
+void
+adc_init(uint8_t config_pipe, uint8_t data_pipe)
+{
+    adc_config_pipe = config_pipe;
+    adc_data_pipe = data_pipe;
+    sched_task_register(SCHED_TASK_ADC, adc_task);
+}
+
+/**
+ * Start sampling.
+ *
+ * @param mask Channels to sample, restricted to ADC_PORTC_MASK
+ * @param rate Samples per second per channel
+ * @return 0 on success, -1 if there is no data pipe, no channel is set,
+ *         or the rate is out of range
+ */
+int8_t
+adc_start(uint8_t mask, uint16_t rate)
+{
+    uint32_t conversions;
+    uint8_t i;
+
+    adc_stop();
+
+    if (adc_data_pipe == 0) {
+        return -1;
+    }
+
+    mask &= ADC_PORTC_MASK;
+    adc_count = 0;
+    for (i = 0; i < ADC_CHANNELS_MAX; i++) {
+        if (mask & (1 << i)) {
+            adc_list[adc_count++] = i;
+        }
+    }
+
+    conversions = (uint32_t) rate * adc_count;
+    if (conversions == 0 || conversions > ADC_CONVERSIONS_MAX ||
+            ADC_TIMER_HZ / conversions > 0x10000)
+    {
+        return -1;
+    }
+
+    PRR &= ~((1 << PRTIM1) | (1 << PRADC));
+    PORTC &= ~mask;
+    DIDR0 = mask;
+
+    adc_fill = 0;
+    adc_ready = ADC_NONE;
+    adc_index = 0;
+    adc_pos = 0;
+    adc_run_overruns = 0;
+    adc_blocks[0].seq = adc_seq++;
+    adc_blocks[0].channel = adc_list[0];
+    adc_first[0] = 0;
+#ifdef ADC_CODEC_MODE
+    adc_packet_len = 0;
+    adc_sent = 0;
+#endif
+
+    ADMUX = (1 << REFS0) | adc_list[0];     /* AVCC reference */
+    ADCSRB = (1 << ADTS2) | (1 << ADTS0);   /* Timer1 compare match B */
+    ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) |
+             (1 << ADPS2) | (1 << ADPS1);   /* clk/64 */
+
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = ADC_TIMER_HZ / conversions - 1;
+    OCR1B = OCR1A;
+    TIFR1 = (1 << OCF1B);
+    TCCR1B = (1 << WGM12) | (1 << CS11);    /* CTC, TOP = OCR1A, clk/8 */
+
+    return 0;
+}
+
+/**
+ * Stop sampling and switch off Timer1 and the ADC.
+ *
+ * @param none
+ * @return none
+ */
+void
+adc_stop(void)
+{
+    TCCR1B = 0;
+    ADCSRA = 0;
+    DIDR0 = 0;
+    PRR |= (1 << PRTIM1) | (1 << PRADC);
+}
+
+/**
+ * Check if sampling is running.
+ *
+ * Power-down is not possible then, as it stops Timer1.
+ *
+ * @param none
+ * @return 1 if sampling, 0 otherwise
+ */
+uint8_t
+adc_active(void)
+{
+    return TCCR1B != 0;
+}
+
+#ifdef ADC_CODEC_MODE
+/**
+ * Send the full sample block as codec packets, as far as data credits
+ * allow. A packet that couldn't be sent is kept for the next attempt.
+ *
+ * @param none
+ * @return none
+ */
+void
+adc_flush(void)
+{
+    struct adc_block *block;
+    struct codec codec;
+    uint8_t first;
+
+    if (adc_ready == ADC_NONE) {
+        return;
+    }
+    block = &adc_blocks[adc_ready];
+
+    while (adc_sent < ADC_BLOCK_SAMPLES) {
+        if (adc_packet_len == 0) {
+            first = (adc_first[adc_ready] + adc_sent) % adc_count;
+            adc_packet[0] = block->seq;
+            adc_packet[1] = adc_list[first];
+            codec_begin(&codec, adc_packet + ADC_BLOCK_HEADER_LEN,
+                    sizeof(adc_packet) - ADC_BLOCK_HEADER_LEN,
+                    ADC_CODEC_MODE, ADC_CODEC_BITS);
+            adc_packet_count = codec_encode(&codec, block->samples + adc_sent,
+                    ADC_BLOCK_SAMPLES - adc_sent);
+            adc_packet_len = ADC_BLOCK_HEADER_LEN + codec_end(&codec);
+        }
+
+        if (nrf_send_data(adc_data_pipe, adc_packet, adc_packet_len) != 0) {
+            return;
+        }
+        adc_sent += adc_packet_count;
+        adc_packet_len = 0;
+    }
+
+    adc_sent = 0;
+    adc_stats.blocks++;
+    adc_ready = ADC_NONE;
+}
+#else
+/**
+ * Send the full sample block, if there is one and a data credit is left.
+ *
+ * @param none
+ * @return none
+ */
+void
+adc_flush(void)
+{
+    if (adc_ready == ADC_NONE) {
+        return;
+    }
+
+    if (nrf_send_data(adc_data_pipe, (uint8_t *) &adc_blocks[adc_ready],
+                sizeof(struct adc_block)) == 0)
+    {
+        adc_stats.blocks++;
+        adc_ready = ADC_NONE;
+    }
+}
+#endif
+
+/**
+ * ADC task, posted whenever a sample block is full.
+ */
+static void
+adc_task(void)
+{
+    adc_flush();
+}
+
+/**
+ * Handle data received on a pipe.
+ *
+ * @param pipe Pipe the data was received on
+ * @param data Received data
+ * @param length Data length
+ * @return 0 if the data was handled, -1 if the pipe is not the config pipe
+ */
+int8_t
+adc_received(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    uint16_t rate;
+
+    if (pipe != adc_config_pipe || length < 3) {
+        return -1;
+    }
+
+    rate = data[1] | (data[2] << 8);
+    if (rate == 0) {
+        adc_stop();
+    } else {
+        adc_start(data[0], rate);
+    }
+
+    return 0;
+}
+
+/**
+ * Start measuring the next channel count during a sweep.
+ *
+ * @param none
+ * @return none
+ */
+static void
+adc_sweep_next(void)
+{
+    uint8_t count = 0;
+    uint8_t i;
+
+    sweep.channels++;
+    sweep.mask = 0;
+    for (i = 0; i < ADC_CHANNELS_MAX && count < sweep.channels; i++) {
+        if (ADC_PORTC_MASK & (1 << i)) {
+            sweep.mask |= (1 << i);
+            count++;
+        }
+    }
+
+    if (count < sweep.channels) {
+        adc_stop();
+        sched_timer_stop(&sweep_timer);
+        uart_print_pgm(string_sweep);
+        uart_newline();
+        adc_print_stats();
+        return;
+    }
+
+    sweep.rate = ADC_SWEEP_START_HZ;
+    sweep.good = 0;
+    sweep.bad = 0;
+    adc_start(sweep.mask, sweep.rate);
+}
+
+/**
+ * Sweep timer, evaluate the rate measured during the last period and
+ * pick the next one.
+ */
+static void
+adc_sweep_timeout(void)
+{
+    uint16_t max = ADC_CONVERSIONS_MAX / sweep.channels;
+
+    if (adc_run_overruns == 0) {
+        sweep.good = sweep.rate;
+    } else {
+        sweep.bad = sweep.rate;
+    }
+
+    /* done within 1/16 of the limit, or at the ADC's own limit */
+    if (sweep.good == max ||
+            (sweep.bad && sweep.bad - sweep.good <= sweep.bad / 16))
+    {
+        adc_stats.best[sweep.channels - 1] = sweep.good;
+        adc_sweep_next();
+        return;
+    }
+
+    if (sweep.bad == 0) {
+        sweep.rate = (sweep.rate > max / 2) ? max : sweep.rate * 2;
+    } else {
+        sweep.rate = (sweep.good + sweep.bad) / 2;
+    }
+    adc_start(sweep.mask, sweep.rate);
+}
+
+/**
+ * Start a sweep for the highest sample rate per channel count.
+ *
+ * Each channel count uses the first channels of ADC_PORTC_MASK. Sample
+ * blocks are sent on the data pipe as usual, so a central has to be
+ * connected with notifications enabled, otherwise every rate overruns.
+ *
+ * @param none
+ * @return none
+ */
+void
+adc_sweep(void)
+{
+    uart_print_pgm(string_sweep);
+    uart_newline();
+
+    sweep.channels = 0;
+    adc_sweep_next();
+    if (adc_active()) {
+        sched_timer_start(&sweep_timer, adc_sweep_timeout,
+                SCHED_MS(ADC_SWEEP_MS), SCHED_MS(ADC_SWEEP_MS));
+    }
+}
+
+/**
+ * Print ADC statistics and the sweep results.
+ *
+ * @param none
+ * @return none
+ */
+void
+adc_print_stats(void)
+{
+    uint8_t i;
+
+    uart_print_pgm(string_adc);
+    uart_putint(adc_stats.samples, 1);
+    uart_print_pgm(string_samples);
+    uart_putint(adc_stats.blocks, 1);
+    uart_print_pgm(string_blocks);
+    uart_putint(adc_stats.overruns, 1);
+    uart_print_pgm(string_overruns);
+
+    uart_print_pgm(string_best);
+    for (i = 0; i < ADC_CHANNELS_MAX; i++) {
+        if (i > 0) {
+            uart_putchar('/');
+        }
+        uart_putint(adc_stats.best[i], 1);
+    }
+    uart_print_pgm(string_hz);
+}
+
+/**
+ * ADC conversion complete interrupt handler.
+ * Store the sample, select the next channel and hand over full blocks.
+ */
+SIGNAL(ADC_vect)
+{
+    struct adc_block *block;
+
+    /* the trigger needs a rising edge of the compare match flag */
+    TIFR1 = (1 << OCF1B);
+
+    adc_blocks[adc_fill].samples[adc_index++] = ADC;
+    adc_stats.samples++;
+
+    if (++adc_pos == adc_count) {
+        adc_pos = 0;
+    }
+    ADMUX = (1 << REFS0) | adc_list[adc_pos];
+
+    if (adc_index < ADC_BLOCK_SAMPLES) {
+        return;
+    }
+
+    adc_index = 0;
+    if (adc_ready == ADC_NONE) {
+        adc_ready = adc_fill;
+        adc_fill ^= 1;
+        sched_post(SCHED_TASK_ADC);
+    } else {
+        adc_stats.overruns++;
+        adc_run_overruns++;
+    }
+
+    block = &adc_blocks[adc_fill];
+    block->seq = adc_seq++;
+    block->channel = adc_list[adc_pos];
+    adc_first[adc_fill] = adc_pos;
+}
+
+#endif /* ADC_ENABLED */
@@ -0,0 +1,105 @@
+/*
+ * Timer triggered ADC sample streaming
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _ADC_H_
+#define _ADC_H_
+
+#include <stdint.h>
+#include "nrf/services.h"
+
+/*
+ * Streaming is only built if the ADC pipes exist. Without them, the calls
+ * from the ACI event handling and power management compile to nothing,
+ * and the sample blocks take no RAM.
+ */
+#if defined(PIPE_EXAMPLE_SERVICE_ADC_CONFIG_RX) && \
+    defined(PIPE_EXAMPLE_SERVICE_ADC_DATA_TX)
+#define ADC_ENABLED
+#endif
+
+/* PC0-PC5 (ADC0-ADC5) channels available for sampling, PC0 is bit 0 */
+#ifndef ADC_PORTC_MASK
+#define ADC_PORTC_MASK      0x30
+#endif
+#define ADC_CHANNELS_MAX    6
+
+/*
+ * Timer1 runs at clk/8 in CTC mode and triggers a conversion on each
+ * compare match, the ADC runs at clk/64. An auto triggered conversion
+ * takes 13.5 ADC clocks, plus synchronization, which limits the total
+ * conversion rate across all channels.
+ */
+#define ADC_TIMER_HZ        (F_CPU / 8)
+#define ADC_CONVERSIONS_MAX (F_CPU / 64 / 14)
+
+/* Time each rate is kept up during a sweep */
+#ifndef ADC_SWEEP_MS
+#define ADC_SWEEP_MS        2000
+#endif
+
+/* First rate tried during a sweep, in samples per second per channel */
+#ifndef ADC_SWEEP_START_HZ
+#define ADC_SWEEP_START_HZ  50
+#endif
+
+/*
+ * Sample block, sent as is in a single packet. Samples are interleaved
+ * in channel order, starting with the given channel. The sequence number
+ * also counts blocks dropped due to overruns.
+ *
+ * With ADC_CODEC_MODE set to one of the CODEC_* modes, blocks are larger
+ * and sent as codec packets instead, as many as a block needs. Each one
+ * starts with the block's sequence number and the channel of its first
+ * sample.
+ */
+#define ADC_BLOCK_HEADER_LEN 2
+#ifdef ADC_CODEC_MODE
+#ifndef ADC_CODEC_BITS
+#define ADC_CODEC_BITS      10
+#endif
+#ifndef ADC_BLOCK_SAMPLES
+#define ADC_BLOCK_SAMPLES   32
+#endif
+#else
+#define ADC_BLOCK_SAMPLES \
+    ((ACI_PIPE_TX_DATA_MAX_LEN - ADC_BLOCK_HEADER_LEN) / 2)
+#endif
+
+struct adc_block {
+    uint8_t seq;
+    uint8_t channel;
+    uint16_t samples[ADC_BLOCK_SAMPLES];
+};
+
+struct adc_stats {
+    uint32_t samples;
+    uint16_t blocks;    /* blocks sent */
+    uint16_t overruns;  /* blocks dropped, previous one not sent yet */
+    /* highest rate per channel count without overruns */
+    uint16_t best[ADC_CHANNELS_MAX];
+};
+
+#ifdef ADC_ENABLED
+void adc_init(uint8_t config_pipe, uint8_t data_pipe);
+int8_t adc_start(uint8_t mask, uint16_t rate);
+void adc_stop(void);
+uint8_t adc_active(void);
+void adc_flush(void);
+int8_t adc_received(uint8_t pipe, const uint8_t *data, uint8_t length);
+void adc_sweep(void);
+void adc_print_stats(void);
+
+extern struct adc_stats adc_stats;
+#else
+#define adc_stop()                          do { } while (0)
+#define adc_active()                        0
+#define adc_flush()                         do { } while (0)
+#define adc_received(pipe, data, length)    (-1)
+#endif
+
+#endif /* _ADC_H_ */
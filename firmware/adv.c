@@ -0,0 +1,143 @@
+/*
+ * Advertising policy
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * After boot and after every disconnect, advertising starts with a short
+ * interval to keep reconnect latency low. Each stage is started with the
+ * Connect command's timeout, once it expires the nRF8001 reports it with
+ * a DisconnectedEvent carrying ACI_STATUS_ERROR_ADVT_TIMEOUT and the next,
+ * slower stage is started. By default, the last stage advertises until a
+ * central connects. With ADV_SLOW_TIMEOUT set, advertising stops once it
+ * times out and the device is considered idle, so the nRF8001 can be put
+ * to sleep until an input wakes it up.
+ *
+ * Without a bond, the Bond command is used instead of Connect, so the
+ * first central to connect gets bonded. Bond only supports timeouts of
+ * up to NRF_BOND_TIMEOUT_MAX seconds, so without ADV_SLOW_TIMEOUT the
+ * last stage is restarted over and over in that case.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "adv.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_adv_stage[] PROGMEM    = "Advertising stage ";
+static const char string_adv_stats[] PROGMEM    = "Advertising: ";
+static const char string_connections[] PROGMEM  = " ms, connections ";
+static const char string_timeouts[] PROGMEM     = ", timeouts ";
+static const char string_reconnect[] PROGMEM    = ", reconnect ";
+static const char string_max[] PROGMEM          = " ms, max ";
+static const char string_ms[] PROGMEM           = " ms\r\n";
+
+struct adv_stage {
+    uint16_t interval;  /* 0.625ms units */
+    uint16_t timeout;   /* seconds, 0 for no timeout */
+};
+
+static const struct adv_stage adv_stages[] PROGMEM = {
+    { ADV_FAST_INTERVAL,    ADV_FAST_TIMEOUT },
+    { ADV_MEDIUM_INTERVAL,  ADV_MEDIUM_TIMEOUT },
+    { ADV_SLOW_INTERVAL,    ADV_SLOW_TIMEOUT },
+};
+#define ADV_STAGE_COUNT (sizeof(adv_stages) / sizeof(adv_stages[0]))
+
+struct adv_stats adv_stats;
+
+static uint8_t adv_stage;
+static uint32_t adv_cycle_start;
+static uint32_t adv_stage_start;
+
+
+/**
+ * Start advertising.
+ *
+ * Starts with the fast stage, unless the previous stage timed out, in
+ * which case the next slower stage is started.
+ *
+ * @param timed_out 1 if the previous advertising stage timed out
+ * @return 0 if advertising started, -1 if the last stage timed out
+ */
+int8_t
+adv_start(uint8_t timed_out)
+{
+    struct adv_stage stage;
+    uint32_t now = sched_now();
+
+    if (timed_out) {
+        adv_stats.advertising += (now - adv_stage_start) * SCHED_TICK_MS;
+        adv_stats.timeouts++;
+        if (adv_stage < ADV_STAGE_COUNT - 1) {
+            adv_stage++;
+        } else if (ADV_SLOW_TIMEOUT != 0) {
+            return -1;
+        }
+    } else {
+        adv_stage = 0;
+        adv_cycle_start = now;
+    }
+
+    adv_stage_start = now;
+    memcpy_P(&stage, &adv_stages[adv_stage], sizeof(stage));
+
+    uart_print_pgm(string_adv_stage);
+    uart_putint(adv_stage, 1);
+    uart_newline();
+
+    if (nrf_bonded()) {
+        nrf_advertise(stage.timeout, stage.interval);
+    } else {
+        nrf_bond(stage.timeout, stage.interval);
+    }
+
+    return 0;
+}
+
+/**
+ * Update statistics when a central connected.
+ *
+ * @param none
+ * @return none
+ */
+void
+adv_connected(void)
+{
+    uint32_t now = sched_now();
+    uint32_t reconnect;
+
+    adv_stats.advertising += (now - adv_stage_start) * SCHED_TICK_MS;
+    adv_stats.connections++;
+
+    reconnect = (now - adv_cycle_start) * SCHED_TICK_MS;
+    adv_stats.reconnect_last = reconnect;
+    if (reconnect > adv_stats.reconnect_max) {
+        adv_stats.reconnect_max = reconnect;
+    }
+}
+
+/**
+ * Print advertising statistics.
+ *
+ * @param none
+ * @return none
+ */
+void
+adv_print_stats(void)
+{
+    uart_print_pgm(string_adv_stats);
+    uart_putint(adv_stats.advertising, 1);
+    uart_print_pgm(string_connections);
+    uart_putint(adv_stats.connections, 1);
+    uart_print_pgm(string_timeouts);
+    uart_putint(adv_stats.timeouts, 1);
+    uart_print_pgm(string_reconnect);
+    uart_putint(adv_stats.reconnect_last, 1);
+    uart_print_pgm(string_max);
+    uart_putint(adv_stats.reconnect_max, 1);
+    uart_print_pgm(string_ms);
+}
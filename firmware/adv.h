@@ -0,0 +1,57 @@
+/*
+ * Advertising policy
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _ADV_H_
+#define _ADV_H_
+
+#include <stdint.h>
+
+/*
+ * Advertising stages, each one with an advertising interval in 0.625ms
+ * units and a timeout in seconds. A timeout of 0 advertises forever.
+ */
+#ifndef ADV_FAST_INTERVAL
+#define ADV_FAST_INTERVAL   32      /* 20ms */
+#endif
+#ifndef ADV_FAST_TIMEOUT
+#define ADV_FAST_TIMEOUT    30
+#endif
+#ifndef ADV_MEDIUM_INTERVAL
+#define ADV_MEDIUM_INTERVAL 244     /* 152.5ms */
+#endif
+#ifndef ADV_MEDIUM_TIMEOUT
+#define ADV_MEDIUM_TIMEOUT  60
+#endif
+#ifndef ADV_SLOW_INTERVAL
+#define ADV_SLOW_INTERVAL   1636    /* 1022.5ms */
+#endif
+/*
+ * Seconds to advertise in the slow stage, 0 to advertise until a central
+ * connects. Once advertising stops, the nRF8001 sleeps and the device is
+ * neither discoverable nor connectable until an input wakes it up, so set
+ * this only for devices that are woken up that way.
+ */
+#ifndef ADV_SLOW_TIMEOUT
+#define ADV_SLOW_TIMEOUT    0
+#endif
+
+struct adv_stats {
+    uint32_t advertising;       /* total time spent advertising, ms */
+    uint32_t reconnect_last;    /* last boot/disconnect to connect time, ms */
+    uint32_t reconnect_max;     /* longest of these times, ms */
+    uint16_t connections;
+    uint16_t timeouts;          /* advertising stage timeouts */
+};
+
+int8_t adv_start(uint8_t timed_out);
+void adv_connected(void);
+void adv_print_stats(void);
+
+extern struct adv_stats adv_stats;
+
+#endif /* _ADV_H_ */
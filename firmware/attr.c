@@ -0,0 +1,155 @@
+/*
+ * Local attribute store
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Write-behind cache for characteristics with a set pipe (nRFgo Studio
+ * "Set Pipe" option) or a broadcast pipe. The application sets values at
+ * any time, connected or not, and only values that actually differ from
+ * the cached copy are marked dirty. A short one-shot timer collects all
+ * changes made in the meantime and then writes every dirty attribute with
+ * consecutive SetLocalData commands. Centrals read the new values straight
+ * from the nRF8001 attribute table, no notification is sent. If a write
+ * fails, the timer is armed again with a delay that doubles with every
+ * failure, up to ATTR_RETRY_MAX_MS.
+ */
+#include <string.h>
+#include <avr/io.h>
+#include "attr.h"
+#include "nrf.h"
+#include "sched.h"
+
+struct attr {
+    uint8_t pipe;       /* 0 if unused */
+    uint8_t dirty;
+    uint8_t length;
+    uint8_t data[ATTR_MAX_LEN];
+};
+
+static struct attr attrs[ATTR_COUNT];
+static struct sched_timer attr_timer;
+static uint16_t attr_retry_ms;     /* delay of the next retry */
+
+
+/**
+ * Attribute flush timer.
+ * Write all dirty attributes to the nRF8001.
+ *
+ * @param none
+ * @return none
+ */
+static void
+attr_flush(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < ATTR_COUNT; i++) {
+        if (attrs[i].pipe == 0 || !attrs[i].dirty) {
+            continue;
+        }
+
+        if (nrf_set_local_data(attrs[i].pipe, attrs[i].data,
+                    attrs[i].length) < 0)
+        {
+            /* not taken by the module, keep it dirty and retry later */
+            sched_timer_start(&attr_timer, attr_flush,
+                    SCHED_MS(attr_retry_ms), 0);
+            if (attr_retry_ms < ATTR_RETRY_MAX_MS / 2) {
+                attr_retry_ms *= 2;
+            } else {
+                attr_retry_ms = ATTR_RETRY_MAX_MS;
+            }
+            return;
+        }
+
+        attrs[i].dirty = 0;
+    }
+
+    attr_retry_ms = ATTR_FLUSH_DELAY_MS;
+}
+
+/**
+ * Set the value of a local attribute.
+ *
+ * The value is compared to the cached one and only written to the nRF8001
+ * if it changed. Writing is deferred by ATTR_FLUSH_DELAY_MS to batch it
+ * with other changes made in the meantime.
+ *
+ * @param pipe Set or broadcast pipe number of the attribute
+ * @param data New attribute value
+ * @param length Value length, up to ATTR_MAX_LEN bytes
+ * @return 1 if the value changed, 0 if unchanged, -1 on error
+ */
+int8_t
+attr_set(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    struct attr *attr = NULL;
+    uint8_t i;
+
+    if (!(nrf_pipe_type(pipe) & (ACI_SET | ACI_TX_BROADCAST)) ||
+        length > ATTR_MAX_LEN)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < ATTR_COUNT; i++) {
+        if (attrs[i].pipe == pipe) {
+            attr = &attrs[i];
+            break;
+        }
+        if (attrs[i].pipe == 0 && attr == NULL) {
+            attr = &attrs[i];
+        }
+    }
+
+    if (attr == NULL) {
+        return -1;
+    }
+
+    if (attr->pipe == pipe && attr->length == length &&
+        memcmp(attr->data, data, length) == 0)
+    {
+        return 0;
+    }
+
+    attr->pipe = pipe;
+    attr->length = length;
+    memcpy(attr->data, data, length);
+    attr->dirty = 1;
+
+    if (!sched_timer_armed(&attr_timer)) {
+        attr_retry_ms = ATTR_FLUSH_DELAY_MS;
+        sched_timer_start(&attr_timer, attr_flush,
+                SCHED_MS(ATTR_FLUSH_DELAY_MS), 0);
+    }
+
+    return 1;
+}
+
+/**
+ * Write all cached attributes to the nRF8001 again.
+ *
+ * Local data is lost when the module is reset, so this needs to be called
+ * after every successful nrf_setup() following the initial one.
+ *
+ * @param none
+ * @return none
+ */
+void
+attr_resync(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < ATTR_COUNT; i++) {
+        if (attrs[i].pipe != 0) {
+            attrs[i].dirty = 1;
+        }
+    }
+
+    attr_retry_ms = ATTR_FLUSH_DELAY_MS;
+    sched_timer_start(&attr_timer, attr_flush,
+            SCHED_MS(ATTR_FLUSH_DELAY_MS), 0);
+}
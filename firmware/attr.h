@@ -0,0 +1,36 @@
+/*
+ * Local attribute store
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _ATTR_H_
+#define _ATTR_H_
+
+#include <stdint.h>
+#include "nrf/services.h"
+
+/* Number of attributes that can be cached */
+#ifndef ATTR_COUNT
+#define ATTR_COUNT          2
+#endif
+
+/* Maximum attribute value length */
+#define ATTR_MAX_LEN        ACI_PIPE_TX_DATA_MAX_LEN
+
+/* Delay to collect changes before writing them to the nRF8001 */
+#ifndef ATTR_FLUSH_DELAY_MS
+#define ATTR_FLUSH_DELAY_MS 10
+#endif
+
+/* Longest delay between retries after a failed write, doubling up to it */
+#ifndef ATTR_RETRY_MAX_MS
+#define ATTR_RETRY_MAX_MS   1000
+#endif
+
+int8_t attr_set(uint8_t pipe, const uint8_t *data, uint8_t length);
+void attr_resync(void);
+
+#endif /* _ATTR_H_ */
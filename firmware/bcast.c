@@ -0,0 +1,219 @@
+/*
+ * Connectionless broadcast mode
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * In broadcast mode, the device advertises non-connectable instead of
+ * waiting for a central. The values of all broadcast pipes are part of
+ * the advertising data, so any number of observers can read them without
+ * connecting.
+ *
+ * Each broadcast value is registered with a read function and a refresh
+ * period. A one-shot timer runs the read functions that are due and goes
+ * back to sleep until the next one is. New values go through the
+ * attribute store, so only actual changes end up as SetLocalData
+ * commands, and the nRF8001 advertises them from the next advertising
+ * event on.
+ *
+ * The nRF8001 can't advertise connectable and non-connectable at the same
+ * time. Switching between both modes takes effect once the current
+ * advertising times out or the current connection is closed.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "bcast.h"
+#include "attr.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_bcast[] PROGMEM    = "Broadcast: ";
+static const char string_on[] PROGMEM       = "on";
+static const char string_off[] PROGMEM      = "off";
+static const char string_started[] PROGMEM  = ", started ";
+static const char string_refreshes[] PROGMEM = ", refreshes ";
+static const char string_updates[] PROGMEM  = ", updates ";
+
+struct bcast_value {
+    bcast_read_t read;
+    uint32_t due;       /* tick of the next refresh */
+    uint16_t period;    /* ticks */
+    uint8_t pipe;
+};
+
+static struct bcast_value bcast_values[BCAST_VALUES];
+static uint8_t bcast_count;
+static uint8_t bcast_mode;
+static uint8_t bcast_active;
+static struct sched_timer bcast_timer;
+
+struct bcast_stats bcast_stats;
+
+
+/**
+ * Refresh timer.
+ * Read all values that are due and rearm for the next one.
+ */
+static void
+bcast_refresh(void)
+{
+    struct bcast_value *value;
+    uint8_t data[ATTR_MAX_LEN];
+    uint32_t now = sched_now();
+    uint32_t next = SCHED_DELAY_MAX;
+    uint8_t length;
+    uint8_t i;
+
+    if (!bcast_mode) {
+        return;
+    }
+
+    for (i = 0; i < bcast_count; i++) {
+        value = &bcast_values[i];
+
+        if ((int32_t) (value->due - now) <= 0) {
+            length = value->read(data);
+            bcast_stats.refreshes++;
+            if (attr_set(value->pipe, data, length) > 0) {
+                bcast_stats.updates++;
+            }
+            value->due = now + value->period;
+        }
+
+        if (value->due - now < next) {
+            next = value->due - now;
+        }
+    }
+
+    if (bcast_count > 0) {
+        sched_timer_start(&bcast_timer, bcast_refresh, next, 0);
+    }
+}
+
+/**
+ * Register a broadcast value.
+ *
+ * @param pipe Broadcast pipe of the value
+ * @param period_ms Refresh period in ms
+ * @param read Function reading the current value
+ * @return 0 on success, -1 if the pipe is no broadcast pipe or all value
+ *         slots are used
+ */
+int8_t
+bcast_add(uint8_t pipe, uint16_t period_ms, bcast_read_t read)
+{
+    struct bcast_value *value;
+
+    if (!(nrf_pipe_type(pipe) & ACI_TX_BROADCAST) ||
+            bcast_count == BCAST_VALUES)
+    {
+        return -1;
+    }
+
+    value = &bcast_values[bcast_count++];
+    value->pipe = pipe;
+    value->period = SCHED_MS(period_ms);
+    value->read = read;
+    value->due = sched_now();
+
+    return 0;
+}
+
+/**
+ * Switch broadcast mode on or off.
+ *
+ * All values are refreshed right away when switching it on.
+ *
+ * @param enable 1 to broadcast, 0 for connectable advertising
+ * @return none
+ */
+void
+bcast_enable(uint8_t enable)
+{
+    uint32_t now = sched_now();
+    uint8_t i;
+
+    bcast_mode = enable;
+
+    if (enable) {
+        for (i = 0; i < bcast_count; i++) {
+            bcast_values[i].due = now;
+        }
+        bcast_refresh();
+    } else {
+        sched_timer_stop(&bcast_timer);
+    }
+}
+
+/**
+ * Check if broadcast mode is on.
+ *
+ * @param none
+ * @return 1 if broadcasting instead of connectable advertising, 0 otherwise
+ */
+uint8_t
+bcast_enabled(void)
+{
+    return bcast_mode;
+}
+
+/**
+ * Start broadcasting.
+ *
+ * @param none
+ * @return 0 if broadcasting started, -1 if there is no broadcast pipe
+ */
+int8_t
+bcast_start(void)
+{
+    if (nrf_open_adv_pipes() == 0) {
+        return -1;
+    }
+
+    nrf_broadcast(BCAST_TIMEOUT, BCAST_INTERVAL);
+    bcast_stats.started++;
+    bcast_active = 1;
+
+    return 0;
+}
+
+/**
+ * Check if the advertising that just ended was a broadcast.
+ *
+ * A broadcast timeout must not count as a connectable advertising stage
+ * timeout when switching back.
+ *
+ * @param none
+ * @return 1 if it was a broadcast, 0 otherwise
+ */
+uint8_t
+bcast_ended(void)
+{
+    uint8_t active = bcast_active;
+
+    bcast_active = 0;
+    return active;
+}
+
+/**
+ * Print broadcast statistics.
+ *
+ * @param none
+ * @return none
+ */
+void
+bcast_print_stats(void)
+{
+    uart_print_pgm(string_bcast);
+    uart_print_pgm(bcast_mode ? string_on : string_off);
+    uart_print_pgm(string_started);
+    uart_putint(bcast_stats.started, 1);
+    uart_print_pgm(string_refreshes);
+    uart_putint(bcast_stats.refreshes, 1);
+    uart_print_pgm(string_updates);
+    uart_putint(bcast_stats.updates, 1);
+    uart_newline();
+}
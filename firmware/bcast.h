@@ -0,0 +1,51 @@
+/*
+ * Connectionless broadcast mode
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _BCAST_H_
+#define _BCAST_H_
+
+#include <stdint.h>
+
+/* Broadcast advertising interval in 0.625ms units, at least 160 */
+#ifndef BCAST_INTERVAL
+#define BCAST_INTERVAL      1600    /* 1s */
+#endif
+
+/*
+ * Broadcast timeout in seconds. Broadcasting is restarted right away
+ * after a timeout, so this only limits how long it takes to switch back
+ * to connectable advertising.
+ */
+#ifndef BCAST_TIMEOUT
+#define BCAST_TIMEOUT       60
+#endif
+
+/* Number of broadcast values, each one also needs an attribute slot */
+#ifndef BCAST_VALUES
+#define BCAST_VALUES        2
+#endif
+
+struct bcast_stats {
+    uint16_t started;   /* Broadcast commands sent */
+    uint16_t refreshes; /* values read */
+    uint16_t updates;   /* values changed */
+};
+
+/* Read a broadcast value into data, return its length */
+typedef uint8_t (*bcast_read_t)(uint8_t *data);
+
+int8_t bcast_add(uint8_t pipe, uint16_t period_ms, bcast_read_t read);
+void bcast_enable(uint8_t enable);
+uint8_t bcast_enabled(void);
+int8_t bcast_start(void);
+uint8_t bcast_ended(void);
+void bcast_print_stats(void);
+
+extern struct bcast_stats bcast_stats;
+
+#endif /* _BCAST_H_ */
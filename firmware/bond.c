@@ -0,0 +1,125 @@
+/*
+ * Bond data storage
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Stores the nRF8001 dynamic data in EEPROM. The dynamic data contains
+ * the complete setup plus bond information and GATT client configuration,
+ * so restoring it with WriteDynamicData replaces the regular setup and
+ * lets a bonded central reconnect with notifications still enabled.
+ *
+ * The header (count and magic) is invalidated before new messages are
+ * written and only written back once all messages are stored, so a reset
+ * in the middle of writing leaves no half valid data behind.
+ */
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "bond.h"
+#include "nrf/services.h"
+
+/* Magic value, bound to the setup data so a new setup invalidates bonds */
+#define BOND_MAGIC (0xb0 ^ SETUP_ID)
+
+struct bond_msg {
+    uint8_t length;
+    uint8_t data[BOND_MSG_LEN];
+};
+
+static uint8_t eeprom_bond_magic EEMEM;
+static uint8_t eeprom_bond_count EEMEM;
+static struct bond_msg eeprom_bond_msgs[BOND_MSG_MAX] EEMEM;
+
+
+/**
+ * Return the number of stored dynamic data messages.
+ *
+ * @param none
+ * @return number of messages, 0 if there is no valid bond stored
+ */
+uint8_t
+bond_count(void)
+{
+    uint8_t count;
+
+    if (eeprom_read_byte(&eeprom_bond_magic) != BOND_MAGIC) {
+        return 0;
+    }
+
+    count = eeprom_read_byte(&eeprom_bond_count);
+    if (count > BOND_MSG_MAX) {
+        return 0;
+    }
+
+    return count;
+}
+
+/**
+ * Read a stored dynamic data message.
+ *
+ * @param index Message index
+ * @param data Buffer of at least BOND_MSG_LEN bytes for the message
+ * @return message length
+ */
+uint8_t
+bond_read(uint8_t index, uint8_t *data)
+{
+    uint8_t length;
+
+    length = eeprom_read_byte(&eeprom_bond_msgs[index].length);
+    if (length > BOND_MSG_LEN) {
+        length = BOND_MSG_LEN;
+    }
+    eeprom_read_block(data, eeprom_bond_msgs[index].data, length);
+
+    return length;
+}
+
+/**
+ * Store a dynamic data message.
+ *
+ * Invalidates the stored bond until bond_commit() is called. Only bytes
+ * that actually changed are written to keep EEPROM wear low.
+ *
+ * @param index Message index, less than BOND_MSG_MAX
+ * @param data Message data, sequence number first
+ * @param length Message length, up to BOND_MSG_LEN bytes
+ * @return none
+ */
+void
+bond_write(uint8_t index, const uint8_t *data, uint8_t length)
+{
+    if (index == 0) {
+        eeprom_update_byte(&eeprom_bond_magic, 0xff);
+    }
+
+    eeprom_update_byte(&eeprom_bond_msgs[index].length, length);
+    eeprom_update_block(data, eeprom_bond_msgs[index].data, length);
+}
+
+/**
+ * Mark the stored messages as valid bond.
+ *
+ * @param count Number of messages written
+ * @return none
+ */
+void
+bond_commit(uint8_t count)
+{
+    eeprom_update_byte(&eeprom_bond_count, count);
+    eeprom_update_byte(&eeprom_bond_magic, BOND_MAGIC);
+}
+
+/**
+ * Remove the stored bond.
+ *
+ * @param none
+ * @return none
+ */
+void
+bond_clear(void)
+{
+    eeprom_update_byte(&eeprom_bond_magic, 0xff);
+}
@@ -0,0 +1,27 @@
+/*
+ * Bond data storage
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _BOND_H_
+#define _BOND_H_
+
+#include <stdint.h>
+
+/*
+ * The nRF8001 dynamic data (ACI_DYNAMIC_DATA_SIZE bytes) is read in
+ * several messages, each one stored with its sequence number in front.
+ */
+#define BOND_MSG_MAX        8
+#define BOND_MSG_LEN        27
+
+uint8_t bond_count(void);
+uint8_t bond_read(uint8_t index, uint8_t *data);
+void bond_write(uint8_t index, const uint8_t *data, uint8_t length);
+void bond_commit(uint8_t count);
+void bond_clear(void);
+
+#endif /* _BOND_H_ */
@@ -0,0 +1,202 @@
+/*
+ * Boot section flash programming for firmware updates
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Everything in here is placed in the boot section, the only place SPM
+ * instructions can be executed from. The application stores a new image
+ * in the staging area page by page with bootloader_write_page() while it
+ * keeps running. Once the image is verified, bootloader_apply() copies it
+ * over the application and resets the device.
+ *
+ * The copy is recorded in EEPROM before it starts and cleared after it
+ * finished. With the BOOTRST fuse programmed, every reset starts with
+ * bootloader_entry() at the beginning of the boot section, which finishes
+ * an interrupted copy before jumping to the application, so losing power
+ * in the middle of an update doesn't brick the device.
+ *
+ * Boot section code can't rely on anything outside of it, the application
+ * flash is unreadable during page erase and write, and bootloader_entry()
+ * runs before the C runtime is initialized. It therefore only uses the
+ * inline macros from avr-libc and accesses the EEPROM directly. This file
+ * is built with -fno-toplevel-reorder to keep bootloader_entry() first.
+ */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include "bootloader.h"
+
+void bootloader_entry(void) BOOTLOADER_SECTION __attribute__((naked, used));
+static uint8_t bootloader_eeprom_read(uint16_t address) BOOTLOADER_SECTION;
+static void bootloader_eeprom_write(uint16_t address, uint8_t value)
+    BOOTLOADER_SECTION;
+static void bootloader_copy(uint8_t pages)
+    BOOTLOADER_SECTION __attribute__((noreturn));
+
+
+/**
+ * Reset entry point, at the start of the boot section.
+ *
+ * Finishes a pending image copy, if there is one, and starts the
+ * application. The stack pointer is initialized to RAMEND by hardware,
+ * only the zero register needs to be set up.
+ */
+void
+bootloader_entry(void)
+{
+    asm volatile ("clr __zero_reg__");
+
+    if (bootloader_eeprom_read(BOOTLOADER_EEPROM_MAGIC) == BOOTLOADER_MAGIC) {
+        bootloader_copy(bootloader_eeprom_read(BOOTLOADER_EEPROM_PAGES));
+    }
+
+    asm volatile ("jmp 0");
+}
+
+/**
+ * Read a byte from EEPROM.
+ *
+ * @param address EEPROM address
+ * @return byte read
+ */
+static uint8_t
+bootloader_eeprom_read(uint16_t address)
+{
+    while (EECR & (1 << EEPE)) {
+        /* wait */
+    }
+
+    EEAR = address;
+    EECR |= (1 << EERE);
+    return EEDR;
+}
+
+/**
+ * Write a byte to EEPROM, interrupts have to be disabled.
+ *
+ * @param address EEPROM address
+ * @param value Byte to write
+ * @return none
+ */
+static void
+bootloader_eeprom_write(uint16_t address, uint8_t value)
+{
+    while (EECR & (1 << EEPE)) {
+        /* wait */
+    }
+
+    EEAR = address;
+    EEDR = value;
+    EECR |= (1 << EEMPE);
+    EECR |= (1 << EEPE);
+}
+
+/**
+ * Copy the staged image over the application and reset.
+ *
+ * Interrupts have to be disabled. The watchdog may be running in system
+ * reset mode with its shortest timeout after a watchdog reset, so it is
+ * set to a timeout comfortably longer than a single page takes.
+ *
+ * @param pages Number of pages to copy
+ * @return never
+ */
+static void
+bootloader_copy(uint8_t pages)
+{
+    uint16_t page;
+    uint8_t i;
+
+    wdt_enable(WDTO_2S);
+
+    for (page = 0; page < (uint16_t) pages * SPM_PAGESIZE;
+            page += SPM_PAGESIZE)
+    {
+        wdt_reset();
+
+        boot_page_erase(page);
+        boot_spm_busy_wait();
+        /* the erase locks the whole RWW section, staging area included */
+        boot_rww_enable();
+
+        for (i = 0; i < SPM_PAGESIZE; i += 2) {
+            boot_page_fill(page + i,
+                    pgm_read_word(BOOTLOADER_STAGING + page + i));
+        }
+
+        boot_page_write(page);
+        boot_spm_busy_wait();
+        boot_rww_enable();
+    }
+
+    bootloader_eeprom_write(BOOTLOADER_EEPROM_MAGIC, 0xff);
+
+    /* start over with the new image */
+    wdt_enable(WDTO_15MS);
+    while (1) {
+        /* wait */
+    }
+}
+
+/**
+ * Program a page of flash.
+ *
+ * Called from the application with the address of a page in the staging
+ * area. Interrupts are disabled during programming, as the application
+ * section including the interrupt vectors can't be read in the meantime.
+ *
+ * @param address Byte address of the page, a multiple of SPM_PAGESIZE
+ * @param data SPM_PAGESIZE bytes of page data
+ * @return none
+ */
+void BOOTLOADER_SECTION
+bootloader_write_page(uint16_t address, const uint8_t *data)
+{
+    uint8_t sreg = SREG;
+    uint8_t i;
+
+    cli();
+
+    /* SPM can't be used while the EEPROM is written */
+    while (EECR & (1 << EEPE)) {
+        /* wait */
+    }
+
+    boot_page_erase(address);
+    boot_spm_busy_wait();
+
+    for (i = 0; i < SPM_PAGESIZE; i += 2) {
+        boot_page_fill(address + i, data[i] | (data[i + 1] << 8));
+    }
+
+    boot_page_write(address);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+
+    SREG = sreg;
+}
+
+/**
+ * Apply the staged image.
+ *
+ * Records the pending copy in EEPROM and copies the image over the
+ * application, then resets the device.
+ *
+ * @param pages Number of pages of the staged image
+ * @return never
+ */
+void BOOTLOADER_SECTION
+bootloader_apply(uint8_t pages)
+{
+    cli();
+
+    bootloader_eeprom_write(BOOTLOADER_EEPROM_PAGES, pages);
+    bootloader_eeprom_write(BOOTLOADER_EEPROM_MAGIC, BOOTLOADER_MAGIC);
+
+    bootloader_copy(pages);
+}
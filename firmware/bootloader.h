@@ -0,0 +1,39 @@
+/*
+ * Boot section flash programming for firmware updates
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _BOOTLOADER_H_
+#define _BOOTLOADER_H_
+
+#include <stdint.h>
+
+/*
+ * Boot section start as byte address, has to match BOOT_START in the
+ * Makefile and the BOOTSZ fuses. 0x7c00 is a 512 word boot section.
+ */
+#ifndef BOOTLOADER_START
+#define BOOTLOADER_START    0x7c00
+#endif
+
+/*
+ * The flash below the boot section is split in two halves, the running
+ * application at the bottom and the staging area for a new image above
+ * it. Both the application and new images must fit in one half, the
+ * Makefile checks the application when linking.
+ */
+#define BOOTLOADER_STAGING  (BOOTLOADER_START / 2)
+#define BOOTLOADER_IMAGE_MAX BOOTLOADER_STAGING
+
+/* EEPROM record of a pending image copy, at the very end of the EEPROM */
+#define BOOTLOADER_EEPROM_MAGIC (E2END - 1)
+#define BOOTLOADER_EEPROM_PAGES E2END
+#define BOOTLOADER_MAGIC    0xa5
+
+void bootloader_write_page(uint16_t address, const uint8_t *data);
+void bootloader_apply(uint8_t pages) __attribute__((noreturn));
+
+#endif /* _BOOTLOADER_H_ */
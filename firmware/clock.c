@@ -0,0 +1,269 @@
+/*
+ * CPU clock scaling
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Divides the system clock via CLKPR while the device idles, and switches
+ * back to F_CPU as soon as there is actual work to do. Everything derived
+ * from the system clock is rescaled along with it, so that it keeps its
+ * rate across a switch:
+ *
+ *  - Timer2 prescaler, clk/64 becomes clk/8. The scheduler tick and PWM
+ *    channel 2 keep their period, and sched_cycles() keeps counting in
+ *    F_CPU cycles, with a resolution of 8 cycles at the slow clock.
+ *  - UART, double speed mode with a quarter of the UBRR divider
+ *  - SPI, a divider eight times smaller
+ *
+ * Timer0 runs at clk/256 for PWM channels 0 and 1, and Timer0 has no
+ * clk/32. The ADC sampling does real work on every sample. So either of
+ * them running keeps the full clock. If the UART or SPI setup can't be
+ * matched at the slow clock, scaling stays unavailable altogether.
+ *
+ * clock_slow() is called right before idle sleep, and the scheduler calls
+ * clock_full() before it runs any task. Timer ticks are processed at the
+ * slow clock, as most of them only post tasks. The busy-wait delays of the
+ * ACI transactions assume F_CPU, so nrf_transmit() and nrf_reset_module()
+ * switch to full speed themselves, wherever they are called from.
+ *
+ * Switching the UART divider in the middle of a character garbles it. The
+ * console output is polled, so clock_slow() only switches when the UART
+ * is done, and clock_full() waits for that. Console input arriving right
+ * at a switch would be garbled the same way, so power_sleep() doesn't
+ * slow down while the console is in use.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/power.h>
+#include <util/atomic.h>
+#include "clock.h"
+#include "adc.h"
+#include "pwm.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_clock[] PROGMEM    = "Clock scaling: ";
+static const char string_on[] PROGMEM       = "on";
+static const char string_off[] PROGMEM      = "off";
+static const char string_na[] PROGMEM       = "unavailable";
+static const char string_switches[] PROGMEM = ", switches ";
+static const char string_slow[] PROGMEM     = ", slow ";
+static const char string_ms[] PROGMEM       = " ms\r\n";
+
+/* log2 of the SPI clock divider, indexed by SPR1, SPR0, SPI2X */
+static const uint8_t spi_div_log2[8] PROGMEM = { 2, 1, 4, 3, 6, 5, 7, 6 };
+
+#define CLOCK_SPI_MASK  ((1 << SPR1) | (1 << SPR0))
+#define CLOCK_CS2_MASK  ((1 << CS22) | (1 << CS21) | (1 << CS20))
+
+static struct {
+    uint8_t available;      /* UART and SPI can be rescaled */
+    uint8_t enabled;
+    uint8_t slow;
+    uint16_t ubrr;          /* UART divider at full speed */
+    uint8_t spi_full;       /* SPR1, SPR0 and SPI2X at full speed */
+    uint8_t spi_slow;       /* the same at the slow clock */
+    uint16_t switches;
+    uint32_t slow_since;    /* tick of the last switch to the slow clock */
+    uint32_t slow_ms;
+} clock;
+
+
+/**
+ * Return the SPI divider setting from SPCR and SPSR.
+ *
+ * @param none
+ * @return index into spi_div_log2
+ */
+static uint8_t
+clock_spi_get(void)
+{
+    return ((SPCR & CLOCK_SPI_MASK) << 1) | ((SPSR >> SPI2X) & 1);
+}
+
+/**
+ * Set the SPI divider.
+ *
+ * @param setting Index into spi_div_log2
+ * @return none
+ */
+static void
+clock_spi_set(uint8_t setting)
+{
+    SPCR = (SPCR & ~CLOCK_SPI_MASK) | ((setting >> 1) & CLOCK_SPI_MASK);
+    if (setting & 1) {
+        SPSR |= (1 << SPI2X);
+    } else {
+        SPSR &= ~(1 << SPI2X);
+    }
+}
+
+/**
+ * Initialize clock scaling, once UART, SPI and the scheduler are set up.
+ *
+ * Takes the full speed UART and SPI settings, and checks whether they can
+ * be matched at the slow clock. Scaling is enabled if they can.
+ *
+ * @param none
+ * @return none
+ */
+void
+clock_init(void)
+{
+    uint8_t full;
+    uint8_t i;
+
+    clock.ubrr = ((uint16_t) UBRR0H << 8) | UBRR0L;
+    clock.spi_full = clock_spi_get();
+    clock.spi_slow = 0xff;
+
+    full = pgm_read_byte(&spi_div_log2[clock.spi_full]);
+    for (i = 0; i < sizeof(spi_div_log2); i++) {
+        if (pgm_read_byte(&spi_div_log2[i]) + CLOCK_SLOW_SHIFT == full) {
+            clock.spi_slow = i;
+            break;
+        }
+    }
+
+    /* F_CPU / 16 / (UBRR + 1) equals F_CPU / 8 / 8 / ((UBRR + 1) / 4) */
+    clock.available = !(UCSR0A & (1 << U2X0)) &&
+                      ((clock.ubrr + 1) & 0x03) == 0 &&
+                      clock.spi_slow != 0xff;
+    clock.enabled = clock.available;
+}
+
+/**
+ * Switch to the slow clock, if enabled and nothing needs the full one.
+ *
+ * @param none
+ * @return 1 if running at the slow clock, 0 otherwise
+ */
+uint8_t
+clock_slow(void)
+{
+    uint16_t ubrr;
+
+    if (clock.slow) {
+        return 1;
+    }
+
+    if (!clock.enabled || !uart_tx_idle() || pwm_active() || adc_active()) {
+        return 0;
+    }
+
+    ubrr = ((clock.ubrr + 1) >> 2) - 1;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        clock_prescale_set(clock_div_8);
+        TCCR2B = (TCCR2B & ~CLOCK_CS2_MASK) | (1 << CS21);
+        UBRR0H = ubrr >> 8;
+        UBRR0L = ubrr & 0xff;
+        UCSR0A = (1 << U2X0);
+        clock_spi_set(clock.spi_slow);
+    }
+
+    clock.slow = 1;
+    clock.switches++;
+    clock.slow_since = sched_now();
+    return 1;
+}
+
+/**
+ * Switch back to the full clock, after the UART finished its character.
+ *
+ * @param none
+ * @return none
+ */
+void
+clock_full(void)
+{
+    if (!clock.slow) {
+        return;
+    }
+
+    while (!uart_tx_idle()) {
+        /* wait for the last character to go out */
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        clock_prescale_set(clock_div_1);
+        TCCR2B = (TCCR2B & ~CLOCK_CS2_MASK) | (1 << CS22);
+        UBRR0H = clock.ubrr >> 8;
+        UBRR0L = clock.ubrr & 0xff;
+        /* writing TXC0 as 0 keeps it set, the UART stays idle */
+        UCSR0A = 0;
+        clock_spi_set(clock.spi_full);
+    }
+
+    clock.slow = 0;
+    clock.slow_ms += (sched_now() - clock.slow_since) * SCHED_TICK_MS;
+}
+
+/**
+ * Return whether the CPU runs at the slow clock.
+ *
+ * @param none
+ * @return 1 if slow, 0 if at F_CPU
+ */
+uint8_t
+clock_is_slow(void)
+{
+    return clock.slow;
+}
+
+/**
+ * Enable or disable clock scaling. Disabling switches to full speed.
+ *
+ * @param enable 1 to enable, 0 to disable
+ * @return none
+ */
+void
+clock_enable(uint8_t enable)
+{
+    clock.enabled = enable && clock.available;
+    if (!clock.enabled) {
+        clock_full();
+    }
+}
+
+/**
+ * Return whether clock scaling is enabled.
+ *
+ * @param none
+ * @return 1 if enabled, 0 otherwise
+ */
+uint8_t
+clock_enabled(void)
+{
+    return clock.enabled;
+}
+
+/**
+ * Print the scaling state, number of switches and time at the slow clock.
+ *
+ * @param none
+ * @return none
+ */
+void
+clock_print_stats(void)
+{
+    uint32_t slow_ms = clock.slow_ms;
+
+    if (clock.slow) {
+        slow_ms += (sched_now() - clock.slow_since) * SCHED_TICK_MS;
+    }
+
+    uart_print_pgm(string_clock);
+    if (!clock.available) {
+        uart_print_pgm(string_na);
+    } else {
+        uart_print_pgm(clock.enabled ? string_on : string_off);
+    }
+    uart_print_pgm(string_switches);
+    uart_putint(clock.switches, 1);
+    uart_print_pgm(string_slow);
+    uart_putint(slow_ms, 1);
+    uart_print_pgm(string_ms);
+}
@@ -0,0 +1,28 @@
+/*
+ * CPU clock scaling
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <stdint.h>
+
+/*
+ * System clock prescaler while idle, F_CPU / 8. Fixed, as Timer2 needs a
+ * matching prescaler to keep the scheduler tick, clk/64 becomes clk/8.
+ */
+#define CLOCK_SLOW_SHIFT    3
+
+void clock_init(void);
+uint8_t clock_slow(void);
+void clock_full(void);
+uint8_t clock_is_slow(void);
+void clock_enable(uint8_t enable);
+uint8_t clock_enabled(void);
+void clock_print_stats(void);
+
+#endif /* _CLOCK_H_ */
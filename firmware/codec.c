@@ -0,0 +1,235 @@
+/*
+ * Compact sample payload codec
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Packs as many 16 bit values into a packet as its size allows, in one of
+ * four modes. Raw mode is the baseline. Bit packing suits values of a
+ * known width, such as 10 bit ADC results. Slowly changing signals are
+ * better sent as differences between values. Zig-zag encoding maps small
+ * negative and positive deltas to small unsigned numbers. Those are sent
+ * either as varints, which adapt to the delta size per value, or packed
+ * at a fixed width after an absolute first value. In the fixed width
+ * mode, a delta that doesn't fit closes the packet, and the next packet
+ * starts with that value as its absolute first value.
+ *
+ * The encoder writes into a caller supplied buffer, so the packet can
+ * follow an application header and be sent on any TX pipe.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "codec.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_codec[] PROGMEM    = "Codec: ";
+static const char string_values[] PROGMEM   = " values, ";
+static const char string_bytes[] PROGMEM    = " bytes, ";
+static const char string_cycles[] PROGMEM   = " cycles/value, ratio ";
+static const char string_percent[] PROGMEM  = "%\r\n";
+
+struct codec_stats codec_stats;
+
+
+/**
+ * Start a new packet.
+ *
+ * @param codec Encoder state
+ * @param buf Packet buffer
+ * @param max Buffer size, at most 0xff bytes
+ * @param mode One of the CODEC_* modes
+ * @param bits Value width for CODEC_PACK and CODEC_DELTA_PACK, 1-16
+ * @return none
+ */
+void
+codec_begin(struct codec *codec, uint8_t *buf, uint8_t max,
+        uint8_t mode, uint8_t bits)
+{
+    codec->buf = buf;
+    codec->max = max;
+    codec->len = CODEC_HEADER_LEN;
+    codec->count = 0;
+    codec->mode = mode;
+    codec->bits = (mode == CODEC_RAW) ? 16 : bits;
+    codec->last = 0;
+    codec->acc = 0;
+    codec->acc_bits = 0;
+}
+
+/**
+ * Append a bit field, if it fits.
+ *
+ * @param codec Encoder state
+ * @param value Bit field value
+ * @param bits Bit field width
+ * @return CODEC_OK or CODEC_FULL
+ */
+static int8_t
+codec_put_bits(struct codec *codec, uint16_t value, uint8_t bits)
+{
+    if (codec->len + ((codec->acc_bits + bits + 7) >> 3) > codec->max) {
+        return CODEC_FULL;
+    }
+
+    codec->acc |= (uint32_t) value << codec->acc_bits;
+    codec->acc_bits += bits;
+    while (codec->acc_bits >= 8) {
+        codec->buf[codec->len++] = codec->acc;
+        codec->acc >>= 8;
+        codec->acc_bits -= 8;
+    }
+
+    return CODEC_OK;
+}
+
+/**
+ * Append a varint, if it fits.
+ *
+ * @param codec Encoder state
+ * @param value Value to encode
+ * @return CODEC_OK or CODEC_FULL
+ */
+static int8_t
+codec_put_varint(struct codec *codec, uint16_t value)
+{
+    uint8_t size = (value < 0x80) ? 1 : (value < 0x4000) ? 2 : 3;
+
+    if (codec->len + size > codec->max) {
+        return CODEC_FULL;
+    }
+
+    while (value >= 0x80) {
+        codec->buf[codec->len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    codec->buf[codec->len++] = value;
+
+    return CODEC_OK;
+}
+
+/**
+ * Add a value to the packet.
+ *
+ * @param codec Encoder state
+ * @param value Value to add
+ * @return CODEC_OK if the value was added, CODEC_FULL if the packet is
+ *         full, which includes a CODEC_DELTA_PACK delta being too large,
+ *         CODEC_RANGE if the value is too large for CODEC_PACK
+ */
+int8_t
+codec_put(struct codec *codec, uint16_t value)
+{
+    int16_t delta = value - codec->last;
+    uint16_t zigzag = ((uint16_t) delta << 1) ^ (delta >> 15);
+    int8_t ret;
+
+    switch (codec->mode) {
+        case CODEC_RAW:
+            ret = codec_put_bits(codec, value, 16);
+            break;
+
+        case CODEC_PACK:
+            if (codec->bits < 16 && (value >> codec->bits)) {
+                return CODEC_RANGE;
+            }
+            ret = codec_put_bits(codec, value, codec->bits);
+            break;
+
+        case CODEC_VARINT:
+            ret = codec_put_varint(codec, zigzag);
+            break;
+
+        default:
+            if (codec->count == 0) {
+                ret = codec_put_bits(codec, value, 16);
+            } else if (codec->bits < 16 && (zigzag >> codec->bits)) {
+                ret = CODEC_FULL;
+            } else {
+                ret = codec_put_bits(codec, zigzag, codec->bits);
+            }
+            break;
+    }
+
+    if (ret == CODEC_OK) {
+        codec->last = value;
+        codec->count++;
+    }
+    return ret;
+}
+
+/**
+ * Finish the packet.
+ *
+ * @param codec Encoder state
+ * @return packet length
+ */
+uint8_t
+codec_end(struct codec *codec)
+{
+    if (codec->acc_bits > 0) {
+        codec->buf[codec->len++] = codec->acc;
+        codec->acc = 0;
+        codec->acc_bits = 0;
+    }
+
+    codec->buf[0] = (codec->mode << CODEC_MODE_SHIFT) |
+                    ((codec->bits - 1) & CODEC_BITS_MASK);
+    codec->buf[1] = codec->count;
+    codec_stats.bytes += codec->len;
+
+    return codec->len;
+}
+
+/**
+ * Add values to the packet until it is full, and count the time spent.
+ *
+ * @param codec Encoder state
+ * @param values Values to add
+ * @param count Number of values
+ * @return number of values added
+ */
+uint8_t
+codec_encode(struct codec *codec, const uint16_t *values, uint8_t count)
+{
+    uint32_t start = sched_cycles();
+    uint8_t i;
+
+    for (i = 0; i < count; i++) {
+        if (codec_put(codec, values[i]) != CODEC_OK) {
+            break;
+        }
+    }
+
+    codec_stats.cycles += (sched_cycles() - start) / SCHED_CYCLES_RESOLUTION;
+    codec_stats.values += i;
+
+    return i;
+}
+
+/**
+ * Print encoding statistics.
+ *
+ * The ratio is the encoded size relative to 16 bit raw values.
+ *
+ * @param none
+ * @return none
+ */
+void
+codec_print_stats(void)
+{
+    uint32_t values = codec_stats.values;
+
+    uart_print_pgm(string_codec);
+    uart_putint(values, 1);
+    uart_print_pgm(string_values);
+    uart_putint(codec_stats.bytes, 1);
+    uart_print_pgm(string_bytes);
+    uart_putint(values ?
+            codec_stats.cycles * SCHED_CYCLES_RESOLUTION / values : 0, 1);
+    uart_print_pgm(string_cycles);
+    uart_putint(values ? codec_stats.bytes * 100 / (values * 2) : 0, 1);
+    uart_print_pgm(string_percent);
+}
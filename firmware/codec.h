@@ -0,0 +1,68 @@
+/*
+ * Compact sample payload codec
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdint.h>
+
+/*
+ * Encoded packet layout:
+ *
+ *  byte 0  mode (bits 7-5), value width - 1 (bits 4-0)
+ *  byte 1  number of values
+ *  data    depending on the mode, all multi-byte values LSB first and
+ *          all bit fields packed starting at the least significant bit
+ *
+ * Each packet decodes on its own, deltas start over in every packet.
+ * See tools/codec.py for the matching decoder.
+ */
+#define CODEC_HEADER_LEN    2
+#define CODEC_MODE_SHIFT    5
+#define CODEC_BITS_MASK     0x1f
+
+#define CODEC_RAW           0   /* 16 bit values */
+#define CODEC_PACK          1   /* values of the given width */
+#define CODEC_VARINT        2   /* zig-zag deltas as 7 bit varints */
+#define CODEC_DELTA_PACK    3   /* 16 bit first value, packed zig-zag deltas */
+
+/* codec_put() results */
+#define CODEC_OK            0
+#define CODEC_FULL          -1  /* packet is full, value not added */
+#define CODEC_RANGE         -2  /* value doesn't fit the CODEC_PACK width */
+
+struct codec {
+    uint8_t *buf;
+    uint8_t max;        /* buffer size */
+    uint8_t len;        /* bytes used, including the header */
+    uint8_t count;      /* values added */
+    uint8_t mode;
+    uint8_t bits;
+    uint16_t last;      /* previous value */
+    uint32_t acc;       /* bits not written to the buffer yet */
+    uint8_t acc_bits;
+};
+
+/* Encoding statistics, cycles in SCHED_CYCLES_RESOLUTION units */
+struct codec_stats {
+    uint32_t values;    /* values added with codec_encode() */
+    uint32_t bytes;     /* encoded bytes, including headers */
+    uint32_t cycles;
+};
+
+void codec_begin(struct codec *codec, uint8_t *buf, uint8_t max,
+        uint8_t mode, uint8_t bits);
+int8_t codec_put(struct codec *codec, uint16_t value);
+uint8_t codec_end(struct codec *codec);
+uint8_t codec_encode(struct codec *codec, const uint16_t *values,
+        uint8_t count);
+void codec_print_stats(void);
+
+extern struct codec_stats codec_stats;
+
+#endif /* _CODEC_H_ */
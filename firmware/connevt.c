@@ -0,0 +1,347 @@
+/*
+ * Connection event tracking
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * The nRF8001 sends queued data at the next connection event, and returns
+ * the data credits right after it. A value written just after an event
+ * therefore waits almost a full interval on the module anyway, and every
+ * further write of the same pipe within that interval either uses up
+ * another data credit, or waits in the send cache for the credits of the
+ * next event.
+ *
+ * The connection event timing is learned from the interval reported by the
+ * Connected and Timing events, and from the points in time the credits are
+ * returned, taken at the RDYN edge announcing the DataCreditEvent. Each
+ * observation is fitted into the grid of expected events, the phase and
+ * the interval as measured with the AVR's own clock are corrected by a
+ * fraction of the error, so jitter and the RC oscillator's offset average
+ * out. Once enough observations agree, values written to the send cache
+ * are held back and released CONNEVT_GUARD_MS before the next expected
+ * event, so all writes up to that point go out in a single packet with the
+ * latest value.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "connevt.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_interval[] PROGMEM = "Connection events: interval ";
+static const char string_us[] PROGMEM       = " us";
+static const char string_locked[] PROGMEM   = ", locked";
+static const char string_off[] PROGMEM      = ", off";
+#ifdef CONNEVT_STATS
+static const char string_observations[] PROGMEM = "Observations ";
+static const char string_phase[] PROGMEM    = ", phase error ";
+static const char string_holds[] PROGMEM    = "Holds ";
+static const char string_releases[] PROGMEM = ", releases ";
+static const char string_locks[] PROGMEM    = ", locks ";
+static const char string_unlocks[] PROGMEM  = ", unlocks ";
+#endif
+
+/* CPU cycles per scheduler tick and per microsecond */
+#define CONNEVT_CYCLES_PER_TICK ((F_CPU / 1000UL) * SCHED_TICK_MS)
+#define CONNEVT_CYCLES_PER_US   (F_CPU / 1000000UL)
+#define CONNEVT_GUARD_CYCLES    ((F_CPU / 1000UL) * CONNEVT_GUARD_MS)
+
+static struct {
+    uint32_t anchor;        /* cycle count of the last tracked event */
+    uint32_t period;        /* measured interval in cycles, 0 if idle */
+    uint32_t nominal;       /* reported interval in cycles */
+    uint8_t count;          /* consistent observations, up to lock count */
+    uint8_t enabled;
+    uint8_t releasing;
+} connevt = {
+    .enabled = 1,
+};
+
+#ifdef CONNEVT_STATS
+static struct {
+    uint16_t observations;
+    uint16_t holds;
+    uint16_t releases;
+    uint16_t locks;
+    uint16_t unlocks;
+    uint16_t fitted;
+    uint32_t error_total;   /* absolute phase error of fitted observations */
+    uint32_t error_max;
+} connevt_stats;
+
+#define CONNEVT_COUNT(field)    connevt_stats.field++
+#else
+#define CONNEVT_COUNT(field)    do { } while (0)
+#endif
+
+static struct sched_timer connevt_timer;
+
+
+/**
+ * Start tracking with a new connection interval.
+ *
+ * The event anchor changes with every parameter update, so the tracking
+ * starts over.
+ *
+ * @param interval Connection interval in 1.25ms units
+ * @return none
+ */
+void
+connevt_start(uint16_t interval)
+{
+    connevt.nominal = (uint32_t) interval * CONNEVT_CYCLES_PER_UNIT;
+    connevt.period = connevt.nominal;
+    connevt.count = 0;
+}
+
+/**
+ * Stop tracking, the connection is gone.
+ *
+ * @param none
+ * @return none
+ */
+void
+connevt_stop(void)
+{
+    connevt.period = 0;
+    connevt.count = 0;
+    sched_timer_stop(&connevt_timer);
+}
+
+/**
+ * Fit a data credit return into the expected connection event grid.
+ *
+ * The first observation only sets the anchor. Returns that are far off
+ * the grid start over from there, as do returns after a long time without
+ * any, as the accumulated error can't be told from a phase shift anymore.
+ *
+ * @param cycles sched_cycles() value at the credit return
+ * @return none
+ */
+void
+connevt_observe(uint32_t cycles)
+{
+    uint32_t elapsed;
+    uint32_t events;
+    uint32_t error_abs;
+    int32_t error;
+
+    if (connevt.period == 0) {
+        return;
+    }
+
+    if (connevt.count == 0) {
+        connevt.anchor = cycles;
+        connevt.count = 1;
+        CONNEVT_COUNT(observations);
+        return;
+    }
+
+    elapsed = cycles - connevt.anchor;
+    events = (elapsed + connevt.period / 2) / connevt.period;
+    if (events == 0) {
+        /* another credit return of the same connection event */
+        return;
+    }
+
+    CONNEVT_COUNT(observations);
+
+    error = (int32_t) (elapsed - events * connevt.period);
+    error_abs = (error < 0) ? -error : error;
+
+    if (events > CONNEVT_HOLDOVER || error_abs > connevt.period / 4) {
+        if (connevt.count >= CONNEVT_LOCK_COUNT) {
+            CONNEVT_COUNT(unlocks);
+        }
+        connevt.anchor = cycles;
+        connevt.count = 1;
+        return;
+    }
+
+#ifdef CONNEVT_STATS
+    connevt_stats.fitted++;
+    connevt_stats.error_total += error_abs;
+    if (error_abs > connevt_stats.error_max) {
+        connevt_stats.error_max = error_abs;
+    }
+#endif
+
+    connevt.anchor += events * connevt.period + error / 4;
+    connevt.period += error / (int32_t) (events * 16);
+
+    if (connevt.count < CONNEVT_LOCK_COUNT &&
+            ++connevt.count == CONNEVT_LOCK_COUNT)
+    {
+        CONNEVT_COUNT(locks);
+    }
+}
+
+/**
+ * Check if the event timing is known well enough to hold back values.
+ *
+ * @param now Current sched_cycles() value
+ * @return 1 if locked, 0 otherwise
+ */
+static uint8_t
+connevt_locked(uint32_t now)
+{
+    if (connevt.period == 0 || connevt.count < CONNEVT_LOCK_COUNT) {
+        return 0;
+    }
+
+    if (now - connevt.anchor > CONNEVT_HOLDOVER * connevt.period) {
+        CONNEVT_COUNT(unlocks);
+        connevt.count = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Release timer function, send the held values.
+ *
+ * @param none
+ * @return none
+ */
+static void
+connevt_release(void)
+{
+    CONNEVT_COUNT(releases);
+    connevt.releasing = 1;
+    nrf_flush();
+    connevt.releasing = 0;
+}
+
+/**
+ * Check if the send cache should be held back until the next event.
+ *
+ * Called by nrf_flush() before sending cached values. Within the guard
+ * time before the expected event, or without a lock, values are sent
+ * right away. Otherwise the release timer is armed, if it isn't already.
+ *
+ * @param none
+ * @return 1 to hold the values, 0 to send them now
+ */
+uint8_t
+connevt_hold(void)
+{
+    uint32_t now;
+    uint32_t next;
+
+    if (!connevt.enabled || connevt.releasing) {
+        return 0;
+    }
+
+    if (sched_timer_armed(&connevt_timer)) {
+        return 1;
+    }
+
+    now = sched_cycles();
+    if (!connevt_locked(now)) {
+        return 0;
+    }
+
+    /* time until the next expected connection event */
+    next = connevt.period - (now - connevt.anchor) % connevt.period;
+    if (next <= CONNEVT_GUARD_CYCLES + CONNEVT_CYCLES_PER_TICK) {
+        return 0;
+    }
+
+    CONNEVT_COUNT(holds);
+    sched_timer_start(&connevt_timer, connevt_release,
+            (next - CONNEVT_GUARD_CYCLES) / CONNEVT_CYCLES_PER_TICK, 0);
+
+    return 1;
+}
+
+/**
+ * Check if values are currently held back for the next connection event.
+ *
+ * @param none
+ * @return 1 if the release timer is armed, 0 otherwise
+ */
+uint8_t
+connevt_holding(void)
+{
+    return sched_timer_armed(&connevt_timer);
+}
+
+/**
+ * Enable or disable holding back values until the next connection event.
+ * Held values are sent right away when disabling. The event timing is
+ * tracked either way.
+ *
+ * @param enable 1 to enable, 0 to disable
+ * @return none
+ */
+void
+connevt_enable(uint8_t enable)
+{
+    connevt.enabled = enable;
+    if (!enable && sched_timer_armed(&connevt_timer)) {
+        sched_timer_stop(&connevt_timer);
+        connevt_release();
+    }
+}
+
+/**
+ * Return whether values are held back until the next connection event.
+ *
+ * @param none
+ * @return 1 if enabled, 0 otherwise
+ */
+uint8_t
+connevt_enabled(void)
+{
+    return connevt.enabled;
+}
+
+/**
+ * Print the reported and measured connection interval, the tracking state
+ * and the hold statistics.
+ *
+ * @param none
+ * @return none
+ */
+void
+connevt_print_stats(void)
+{
+    uart_print_pgm(string_interval);
+    uart_putint(connevt.nominal / CONNEVT_CYCLES_PER_US, 1);
+    uart_putchar('/');
+    uart_putint(connevt.period / CONNEVT_CYCLES_PER_US, 1);
+    uart_print_pgm(string_us);
+    if (connevt.count >= CONNEVT_LOCK_COUNT) {
+        uart_print_pgm(string_locked);
+    }
+    if (!connevt.enabled) {
+        uart_print_pgm(string_off);
+    }
+    uart_newline();
+
+#ifdef CONNEVT_STATS
+    uart_print_pgm(string_observations);
+    uart_putint(connevt_stats.observations, 1);
+    uart_print_pgm(string_phase);
+    uart_putint(connevt_stats.fitted ? connevt_stats.error_total /
+            connevt_stats.fitted / CONNEVT_CYCLES_PER_US : 0, 1);
+    uart_putchar('/');
+    uart_putint(connevt_stats.error_max / CONNEVT_CYCLES_PER_US, 1);
+    uart_print_pgm(string_us);
+    uart_newline();
+
+    uart_print_pgm(string_holds);
+    uart_putint(connevt_stats.holds, 1);
+    uart_print_pgm(string_releases);
+    uart_putint(connevt_stats.releases, 1);
+    uart_print_pgm(string_locks);
+    uart_putint(connevt_stats.locks, 1);
+    uart_print_pgm(string_unlocks);
+    uart_putint(connevt_stats.unlocks, 1);
+    uart_newline();
+#endif
+}
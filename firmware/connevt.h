@@ -0,0 +1,50 @@
+/*
+ * Connection event tracking
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _CONNEVT_H_
+#define _CONNEVT_H_
+
+#include <stdint.h>
+
+/* CPU cycles per connection interval unit of 1.25ms */
+#define CONNEVT_CYCLES_PER_UNIT ((F_CPU / 1000UL) * 5 / 4)
+
+/*
+ * Time before the expected connection event to release held values. Covers
+ * the tick granularity, the SPI transactions and the delay of the credit
+ * return behind the actual event anchor.
+ */
+#ifndef CONNEVT_GUARD_MS
+#define CONNEVT_GUARD_MS        3
+#endif
+
+/* Consistent observations needed before values are held back */
+#ifndef CONNEVT_LOCK_COUNT
+#define CONNEVT_LOCK_COUNT      4
+#endif
+
+/* Connection events without observation after which the lock is lost */
+#ifndef CONNEVT_HOLDOVER
+#define CONNEVT_HOLDOVER        64
+#endif
+
+/*
+ * Set CONNEVT_STATS to count observations, holds and lock changes, and to
+ * measure the phase error. Tracking itself doesn't need them.
+ */
+
+void connevt_start(uint16_t interval);
+void connevt_stop(void);
+void connevt_observe(uint32_t cycles);
+uint8_t connevt_hold(void);
+uint8_t connevt_holding(void);
+void connevt_enable(uint8_t enable);
+uint8_t connevt_enabled(void);
+void connevt_print_stats(void);
+
+#endif /* _CONNEVT_H_ */
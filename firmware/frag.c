@@ -0,0 +1,600 @@
+/*
+ * Message fragmentation and reassembly
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Messages of up to FRAG_MSG_MAX bytes are exchanged over a TX and RX
+ * pipe pair, split into segments of FRAG_PAYLOAD bytes. Each segment
+ * starts with a type and 4 bit message id byte and the segment's index
+ * within the message, the last segment of a message has its own type.
+ *
+ * The sender keeps up to FRAG_WINDOW segments in flight beyond the ones
+ * acknowledged. The receiver acknowledges every FRAG_ACK_EVERY segments and
+ * the complete message with the number of segments received in order. As
+ * soon as it sees a gap, it asks for the missing segments with a list of
+ * their indices, and only those are sent again. If no acknowledgement
+ * arrives within FRAG_TIMEOUT_MS, everything unacknowledged is sent again,
+ * after FRAG_RETRIES timeouts in a row the message is given up.
+ *
+ * Acknowledgements and retransmit requests for one direction travel as
+ * segments of their own type on the other direction's pipe. Outgoing
+ * messages are sent from the caller's buffer, incoming ones reassembled
+ * in a static buffer, there is only a single message in each direction
+ * at a time.
+ */
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "frag.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+#ifdef FRAG_ENABLED
+
+static const char string_frag_tx[] PROGMEM      = "Messages out: ";
+static const char string_frag_rx[] PROGMEM      = "Messages in: ";
+static const char string_failed[] PROGMEM       = ", failed ";
+static const char string_segments[] PROGMEM     = ", segments ";
+static const char string_resent[] PROGMEM       = ", resent ";
+static const char string_duplicates[] PROGMEM   = ", duplicates ";
+static const char string_dropped[] PROGMEM      = ", dropped ";
+static const char string_rate[] PROGMEM         = ", last ";
+static const char string_bps[] PROGMEM          = " B/s\r\n";
+
+/* Pending control segments */
+#define FRAG_CTRL_ACK   0x01
+#define FRAG_CTRL_NAK   0x02
+
+/* Last segment index not known yet */
+#define FRAG_LAST_UNKNOWN 0xff
+
+struct frag_tx {
+    const uint8_t *data;
+    uint16_t length;
+    uint32_t resend;    /* segments to send again */
+    uint32_t start;     /* tick of the first segment */
+    uint8_t segments;
+    uint8_t acked;      /* segments acknowledged in order */
+    uint8_t next;       /* next segment sent for the first time */
+    uint8_t retries;
+    uint8_t id;
+    uint8_t active;
+};
+
+struct frag_rx {
+    uint8_t buf[FRAG_MSG_MAX];
+    uint16_t length;
+    uint32_t received;  /* received segments */
+    uint32_t start;     /* tick of the first segment */
+    uint8_t last;       /* index of the last segment */
+    uint8_t highest;    /* highest index received */
+    uint8_t since_ack;
+    uint8_t id;
+    uint8_t active;     /* a message is being reassembled */
+    uint8_t done;       /* message with this id is complete */
+};
+
+struct frag_stats frag_stats;
+
+static uint8_t frag_tx_pipe;
+static uint8_t frag_rx_pipe;
+static frag_handler_t frag_handler;
+static frag_callback_t frag_callback;
+static struct frag_tx frag_tx;
+static struct frag_rx frag_rx;
+static uint8_t frag_ctrl;
+static struct sched_timer frag_timer;
+
+
+/**
+ * Initialize fragmentation on the given pipe pair.
+ *
+ * @param tx_pipe TX pipe to send segments on
+ * @param rx_pipe RX pipe to receive segments on
+ * @param handler Function called with every reassembled message
+ * @param callback Function called when sending a message is done, can be NULL
+ * @return none
+ */
+void
+frag_init(uint8_t tx_pipe, uint8_t rx_pipe,
+        frag_handler_t handler, frag_callback_t callback)
+{
+    frag_tx_pipe = tx_pipe;
+    frag_rx_pipe = rx_pipe;
+    frag_handler = handler;
+    frag_callback = callback;
+}
+
+/**
+ * Calculate the transfer rate of a message.
+ *
+ * @param length Message length
+ * @param start Tick the transfer started
+ * @return bytes per second, limited to 16 bits
+ */
+static uint16_t
+frag_rate(uint16_t length, uint32_t start)
+{
+    uint32_t ms = (sched_now() - start) * SCHED_TICK_MS;
+    uint32_t rate;
+
+    if (ms == 0) {
+        ms = 1;
+    }
+
+    rate = (uint32_t) length * 1000 / ms;
+    return (rate > 0xffff) ? 0xffff : rate;
+}
+
+/**
+ * Finish the outgoing message.
+ *
+ * @param status One of the FRAG_STATUS_* values
+ * @return none
+ */
+static void
+frag_tx_done(uint8_t status)
+{
+    frag_tx.active = 0;
+    sched_timer_stop(&frag_timer);
+
+    if (status == FRAG_STATUS_OK) {
+        frag_stats.tx_messages++;
+        frag_stats.tx_rate = frag_rate(frag_tx.length, frag_tx.start);
+    } else {
+        frag_stats.tx_failed++;
+    }
+
+    if (frag_callback != NULL) {
+        frag_callback(status);
+    }
+}
+
+/**
+ * Acknowledgement timer.
+ * Send all unacknowledged segments again, or give up.
+ *
+ * @param none
+ * @return none
+ */
+static void
+frag_timeout(void)
+{
+    uint8_t i;
+
+    if (!frag_tx.active) {
+        return;
+    }
+
+    if (++frag_tx.retries > FRAG_RETRIES) {
+        frag_tx_done(FRAG_STATUS_TIMEOUT);
+        return;
+    }
+
+    for (i = frag_tx.acked; i < frag_tx.next; i++) {
+        frag_tx.resend |= (uint32_t) 1 << i;
+    }
+
+    sched_timer_start(&frag_timer, frag_timeout, SCHED_MS(FRAG_TIMEOUT_MS), 0);
+    nrf_flush();
+}
+
+/**
+ * Send a message.
+ *
+ * The data is sent straight from the given buffer, which has to stay
+ * unchanged until the callback is called.
+ *
+ * @param data Message data
+ * @param length Message length, up to FRAG_MSG_MAX bytes
+ * @return 0 on success, -1 if a message is in progress or length is invalid
+ */
+int8_t
+frag_send(const uint8_t *data, uint16_t length)
+{
+    if (frag_tx_pipe == 0 || frag_tx.active || length > FRAG_MSG_MAX) {
+        return -1;
+    }
+
+    frag_tx.data = data;
+    frag_tx.length = length;
+    frag_tx.segments = (length > 0) ?
+            (length + FRAG_PAYLOAD - 1) / FRAG_PAYLOAD : 1;
+    frag_tx.acked = 0;
+    frag_tx.next = 0;
+    frag_tx.resend = 0;
+    frag_tx.retries = 0;
+    frag_tx.id = (frag_tx.id + 1) & FRAG_ID_MASK;
+    frag_tx.start = sched_now();
+    frag_tx.active = 1;
+
+    sched_timer_start(&frag_timer, frag_timeout, SCHED_MS(FRAG_TIMEOUT_MS), 0);
+    nrf_flush();
+
+    return 0;
+}
+
+/**
+ * Check if a message is being sent.
+ *
+ * @param none
+ * @return 1 if frag_send() would fail, 0 otherwise
+ */
+uint8_t
+frag_busy(void)
+{
+    return frag_tx.active;
+}
+
+/**
+ * Send a segment of the outgoing message.
+ *
+ * @param index Segment index
+ * @return 0 on success, -1 if it could not be sent
+ */
+static int8_t
+frag_send_segment(uint8_t index)
+{
+    uint8_t buf[ACI_PIPE_TX_DATA_MAX_LEN];
+    uint16_t offset = index * FRAG_PAYLOAD;
+    uint8_t length = FRAG_PAYLOAD;
+
+    if (frag_tx.length - offset < FRAG_PAYLOAD) {
+        length = frag_tx.length - offset;
+    }
+
+    buf[0] = frag_tx.id |
+        ((index == frag_tx.segments - 1) ? FRAG_TYPE_LAST : FRAG_TYPE_DATA);
+    buf[1] = index;
+    memcpy(&buf[FRAG_HEADER_LEN], frag_tx.data + offset, length);
+
+    if (nrf_send_data(frag_tx_pipe, buf, length + FRAG_HEADER_LEN) < 0) {
+        return -1;
+    }
+
+    frag_stats.tx_segments++;
+    return 0;
+}
+
+/**
+ * Return the number of incoming segments received in order.
+ *
+ * @param none
+ * @return index of the first missing segment
+ */
+static uint8_t
+frag_rx_contiguous(void)
+{
+    uint8_t i = 0;
+
+    while (i < FRAG_SEGMENTS_MAX && (frag_rx.received & ((uint32_t) 1 << i))) {
+        i++;
+    }
+
+    return i;
+}
+
+/**
+ * Send pending acknowledgements and retransmit requests.
+ *
+ * @param none
+ * @return 0 if all were sent, -1 otherwise
+ */
+static int8_t
+frag_send_ctrl(void)
+{
+    uint8_t buf[ACI_PIPE_TX_DATA_MAX_LEN];
+    uint8_t length = 1;
+    uint8_t i;
+
+    if (frag_ctrl & FRAG_CTRL_NAK) {
+        buf[0] = FRAG_TYPE_NAK | frag_rx.id;
+        for (i = frag_rx_contiguous(); i < frag_rx.highest &&
+                length < sizeof(buf); i++)
+        {
+            if (!(frag_rx.received & ((uint32_t) 1 << i))) {
+                buf[length++] = i;
+            }
+        }
+        if (nrf_send_data(frag_tx_pipe, buf, length) < 0) {
+            return -1;
+        }
+        frag_ctrl &= ~FRAG_CTRL_NAK;
+    }
+
+    if (frag_ctrl & FRAG_CTRL_ACK) {
+        buf[0] = FRAG_TYPE_ACK | frag_rx.id;
+        buf[1] = frag_rx_contiguous();
+        if (nrf_send_data(frag_tx_pipe, buf, 2) < 0) {
+            return -1;
+        }
+        frag_ctrl &= ~FRAG_CTRL_ACK;
+    }
+
+    return 0;
+}
+
+/**
+ * Send control segments and outgoing message segments as far as data
+ * credits allow. Called from nrf_flush().
+ *
+ * Control segments go first, then requested retransmissions, then new
+ * segments within the window.
+ *
+ * @param none
+ * @return none
+ */
+void
+frag_flush(void)
+{
+    uint8_t i;
+
+    if (frag_ctrl && frag_send_ctrl() < 0) {
+        return;
+    }
+
+    if (!frag_tx.active) {
+        return;
+    }
+
+    for (i = frag_tx.acked; i < frag_tx.next; i++) {
+        if (frag_tx.resend & ((uint32_t) 1 << i)) {
+            if (frag_send_segment(i) < 0) {
+                return;
+            }
+            frag_tx.resend &= ~((uint32_t) 1 << i);
+            frag_stats.tx_resent++;
+        }
+    }
+
+    while (frag_tx.next < frag_tx.segments &&
+           frag_tx.next < frag_tx.acked + FRAG_WINDOW)
+    {
+        if (frag_send_segment(frag_tx.next) < 0) {
+            return;
+        }
+        frag_tx.next++;
+    }
+}
+
+/**
+ * Handle an acknowledgement or retransmit request for the outgoing message.
+ *
+ * @param data Control segment
+ * @param length Segment length
+ * @return none
+ */
+static void
+frag_received_ctrl(const uint8_t *data, uint8_t length)
+{
+    uint8_t count;
+    uint8_t i;
+
+    if (!frag_tx.active || (data[0] & FRAG_ID_MASK) != frag_tx.id ||
+            length < 2)
+    {
+        return;
+    }
+
+    if ((data[0] & FRAG_TYPE_MASK) == FRAG_TYPE_ACK) {
+        count = data[1];
+        if (count <= frag_tx.acked || count > frag_tx.next) {
+            return;
+        }
+
+        frag_tx.acked = count;
+        frag_tx.retries = 0;
+        for (i = 0; i < count; i++) {
+            frag_tx.resend &= ~((uint32_t) 1 << i);
+        }
+
+        if (frag_tx.acked == frag_tx.segments) {
+            frag_tx_done(FRAG_STATUS_OK);
+            return;
+        }
+        sched_timer_start(&frag_timer, frag_timeout,
+                SCHED_MS(FRAG_TIMEOUT_MS), 0);
+
+    } else {
+        for (i = 1; i < length; i++) {
+            if (data[i] >= frag_tx.acked && data[i] < frag_tx.next) {
+                frag_tx.resend |= (uint32_t) 1 << data[i];
+            }
+        }
+    }
+}
+
+/**
+ * Handle a segment of an incoming message.
+ *
+ * @param data Data segment
+ * @param length Segment length
+ * @return none
+ */
+static void
+frag_received_data(const uint8_t *data, uint8_t length)
+{
+    uint8_t id = data[0] & FRAG_ID_MASK;
+    uint8_t last = (data[0] & FRAG_TYPE_MASK) == FRAG_TYPE_LAST;
+    uint8_t index = data[1];
+    uint16_t offset = index * FRAG_PAYLOAD;
+    uint8_t count;
+
+    length -= FRAG_HEADER_LEN;
+
+    if (id == frag_rx.id && frag_rx.done) {
+        /* the final acknowledgement got lost */
+        frag_stats.rx_duplicates++;
+        frag_ctrl |= FRAG_CTRL_ACK;
+        return;
+    }
+
+    if (!frag_rx.active || id != frag_rx.id) {
+        frag_rx.id = id;
+        frag_rx.received = 0;
+        frag_rx.last = FRAG_LAST_UNKNOWN;
+        frag_rx.highest = 0;
+        frag_rx.since_ack = 0;
+        frag_rx.start = sched_now();
+        frag_rx.active = 1;
+        frag_rx.done = 0;
+    }
+
+    if (index >= FRAG_SEGMENTS_MAX || offset + length > FRAG_MSG_MAX ||
+        (!last && length != FRAG_PAYLOAD))
+    {
+        frag_stats.rx_dropped++;
+        return;
+    }
+
+    if (frag_rx.received & ((uint32_t) 1 << index)) {
+        frag_stats.rx_duplicates++;
+        frag_ctrl |= FRAG_CTRL_ACK;
+        return;
+    }
+
+    memcpy(&frag_rx.buf[offset], &data[FRAG_HEADER_LEN], length);
+    frag_rx.received |= (uint32_t) 1 << index;
+    frag_stats.rx_segments++;
+
+    if (last) {
+        frag_rx.last = index;
+        frag_rx.length = offset + length;
+    }
+
+    count = frag_rx_contiguous();
+
+    if (frag_rx.last != FRAG_LAST_UNKNOWN && count > frag_rx.last) {
+        frag_rx.active = 0;
+        frag_rx.done = 1;
+        frag_ctrl |= FRAG_CTRL_ACK;
+        frag_stats.rx_messages++;
+        frag_stats.rx_rate = frag_rate(frag_rx.length, frag_rx.start);
+        if (frag_handler != NULL) {
+            frag_handler(frag_rx.buf, frag_rx.length);
+        }
+        return;
+    }
+
+    if (index > frag_rx.highest) {
+        /* anything skipped on the way up is missing */
+        if (index > count && index > frag_rx.highest + 1) {
+            frag_ctrl |= FRAG_CTRL_NAK;
+        }
+        frag_rx.highest = index;
+    }
+
+    if (++frag_rx.since_ack >= FRAG_ACK_EVERY) {
+        frag_rx.since_ack = 0;
+        frag_ctrl |= FRAG_CTRL_ACK;
+    }
+}
+
+/**
+ * Handle data received on any pipe.
+ *
+ * @param pipe Pipe the data was received on
+ * @param data Received data
+ * @param length Data length
+ * @return 0 if the data was handled, -1 if it isn't for the fragmentation
+ */
+int8_t
+frag_received(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    if (pipe == 0 || pipe != frag_rx_pipe) {
+        return -1;
+    }
+
+    if (length < FRAG_HEADER_LEN) {
+        frag_stats.rx_dropped++;
+        return 0;
+    }
+
+    if (data[0] & FRAG_TYPE_ACK) {
+        frag_received_ctrl(data, length);
+    } else {
+        frag_received_data(data, length);
+    }
+
+    nrf_flush();
+
+    return 0;
+}
+
+/**
+ * Handle a disconnect.
+ *
+ * The outgoing message fails, a partly received one is discarded.
+ *
+ * @param none
+ * @return none
+ */
+void
+frag_disconnected(void)
+{
+    frag_ctrl = 0;
+    frag_rx.active = 0;
+    frag_rx.done = 0;
+
+    if (frag_tx.active) {
+        frag_tx_done(FRAG_STATUS_DISCONNECTED);
+    }
+}
+
+/**
+ * Send the last reassembled message back.
+ *
+ * Meant for throughput measurements together with a central implementing
+ * the same protocol, the full buffer is sent if there was no message yet.
+ * The reassembly buffer is sent as is, so it must not receive anything
+ * in the meantime.
+ *
+ * @param none
+ * @return 0 on success, -1 if a message is in progress
+ */
+int8_t
+frag_echo(void)
+{
+    return frag_send(frag_rx.buf,
+            frag_stats.rx_messages ? frag_rx.length : FRAG_MSG_MAX);
+}
+
+/**
+ * Print fragmentation statistics.
+ *
+ * @param none
+ * @return none
+ */
+void
+frag_print_stats(void)
+{
+    uart_print_pgm(string_frag_tx);
+    uart_putint(frag_stats.tx_messages, 1);
+    uart_print_pgm(string_failed);
+    uart_putint(frag_stats.tx_failed, 1);
+    uart_print_pgm(string_segments);
+    uart_putint(frag_stats.tx_segments, 1);
+    uart_print_pgm(string_resent);
+    uart_putint(frag_stats.tx_resent, 1);
+    uart_print_pgm(string_rate);
+    uart_putint(frag_stats.tx_rate, 1);
+    uart_print_pgm(string_bps);
+
+    uart_print_pgm(string_frag_rx);
+    uart_putint(frag_stats.rx_messages, 1);
+    uart_print_pgm(string_segments);
+    uart_putint(frag_stats.rx_segments, 1);
+    uart_print_pgm(string_duplicates);
+    uart_putint(frag_stats.rx_duplicates, 1);
+    uart_print_pgm(string_dropped);
+    uart_putint(frag_stats.rx_dropped, 1);
+    uart_print_pgm(string_rate);
+    uart_putint(frag_stats.rx_rate, 1);
+    uart_print_pgm(string_bps);
+}
+
+#endif /* FRAG_ENABLED */
@@ -0,0 +1,110 @@
+/*
+ * Message fragmentation and reassembly
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _FRAG_H_
+#define _FRAG_H_
+
+#include <stdint.h>
+#include "nrf/services.h"
+
+/*
+ * The layer is only built if the message pipes exist. Without them, the
+ * calls from the ACI event handling compile to nothing, and the
+ * reassembly buffer takes no RAM.
+ */
+#if defined(PIPE_EXAMPLE_SERVICE_MESSAGE_TX) && \
+    defined(PIPE_EXAMPLE_SERVICE_MESSAGE_RX)
+#define FRAG_ENABLED
+#endif
+
+/* Largest message in either direction, size of the reassembly buffer */
+#ifndef FRAG_MSG_MAX
+#define FRAG_MSG_MAX        512
+#endif
+
+/* Segments sent ahead of the last acknowledged one */
+#ifndef FRAG_WINDOW
+#define FRAG_WINDOW         8
+#endif
+
+/* Received segments between two acknowledgements */
+#ifndef FRAG_ACK_EVERY
+#define FRAG_ACK_EVERY      (FRAG_WINDOW / 2)
+#endif
+
+/* Time without acknowledgement before unacknowledged segments are resent */
+#ifndef FRAG_TIMEOUT_MS
+#define FRAG_TIMEOUT_MS     1000
+#endif
+
+/* Timeouts in a row before a message is given up */
+#ifndef FRAG_RETRIES
+#define FRAG_RETRIES        3
+#endif
+
+/*
+ * Segment layout: type and message id, segment index, payload. All but
+ * the last segment of a message carry a full payload in both directions.
+ */
+#define FRAG_HEADER_LEN     2
+#define FRAG_PAYLOAD        (ACI_PIPE_TX_DATA_MAX_LEN - FRAG_HEADER_LEN)
+#define FRAG_SEGMENTS_MAX   ((FRAG_MSG_MAX + FRAG_PAYLOAD - 1) / FRAG_PAYLOAD)
+
+#if FRAG_SEGMENTS_MAX > 32
+#error "FRAG_MSG_MAX too large, segments are tracked in a 32 bit mask"
+#endif
+
+#define FRAG_TYPE_MASK      0xc0
+#define FRAG_TYPE_DATA      0x00    /* index, payload */
+#define FRAG_TYPE_LAST      0x40    /* index, payload of the last segment */
+#define FRAG_TYPE_ACK       0x80    /* number of segments received in order */
+#define FRAG_TYPE_NAK       0xc0    /* indices of missing segments */
+#define FRAG_ID_MASK        0x0f
+
+/* Send completion status */
+#define FRAG_STATUS_OK              0
+#define FRAG_STATUS_TIMEOUT         1
+#define FRAG_STATUS_DISCONNECTED    2
+
+struct frag_stats {
+    uint16_t tx_messages;   /* messages sent and acknowledged */
+    uint16_t tx_failed;
+    uint16_t tx_segments;   /* segments sent, including resends */
+    uint16_t tx_resent;
+    uint16_t rx_messages;   /* messages reassembled */
+    uint16_t rx_segments;
+    uint16_t rx_duplicates;
+    uint16_t rx_dropped;    /* invalid segments */
+    uint16_t tx_rate;       /* last message, bytes per second */
+    uint16_t rx_rate;
+};
+
+/* Called with each reassembled message, valid until the next one starts */
+typedef void (*frag_handler_t)(const uint8_t *data, uint16_t length);
+/* Called once a message given to frag_send() is done with */
+typedef void (*frag_callback_t)(uint8_t status);
+
+#ifdef FRAG_ENABLED
+void frag_init(uint8_t tx_pipe, uint8_t rx_pipe,
+        frag_handler_t handler, frag_callback_t callback);
+int8_t frag_send(const uint8_t *data, uint16_t length);
+uint8_t frag_busy(void);
+void frag_flush(void);
+int8_t frag_received(uint8_t pipe, const uint8_t *data, uint8_t length);
+void frag_disconnected(void);
+int8_t frag_echo(void);
+void frag_print_stats(void);
+
+extern struct frag_stats frag_stats;
+#else
+#define frag_flush()                        do { } while (0)
+#define frag_received(pipe, data, length)   (-1)
+#define frag_disconnected()                 do { } while (0)
+#endif
+
+#endif /* _FRAG_H_ */
@@ -0,0 +1,269 @@
+/*
+ * Debounced digital input handling
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Pin change interrupts only count raw edges and kick off sampling, the
+ * actual input state is determined by periodically sampling all inputs
+ * from a scheduler timer. Each input has an integrator counting up while
+ * the input is active and down while it is inactive, the state changes
+ * only once the integrator hits either end. After a change, the state is
+ * held for a minimum time, limiting the rate of changes per input while
+ * still reporting the final state. Once all inputs are settled, sampling
+ * stops until the next edge.
+ */
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "input.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_input_stats[] PROGMEM  = "Inputs: ";
+static const char string_edges[] PROGMEM        = " edges, ";
+static const char string_changes[] PROGMEM      = " changes, ";
+static const char string_written[] PROGMEM      = " written, ";
+static const char string_coalesced[] PROGMEM    = " coalesced, ";
+static const char string_sent[] PROGMEM         = " sent, state 0x";
+
+#define INPUT_ENABLE_MASK \
+    ((1 << INPUT_BUTTON) | (INPUT_PORTC_MASK << INPUT_PC0))
+
+struct input_stats input_stats;
+
+static input_handler_t input_handler;
+static struct sched_timer input_timer;
+static uint8_t input_current;
+static uint8_t integrator[INPUT_COUNT];
+static uint8_t hold[INPUT_COUNT];
+/* Last PD2 state seen by the PCINT2 handler */
+static volatile uint8_t input_last_pd2;
+
+
+/**
+ * Read the raw state of all enabled inputs.
+ *
+ * @param none
+ * @return bitmask of currently active inputs
+ */
+static uint8_t
+input_read_raw(void)
+{
+    uint8_t raw;
+
+    raw = (~PINC & INPUT_PORTC_MASK) << INPUT_PC0;
+    if (!(PIND & (1 << PD2))) {
+        raw |= (1 << INPUT_BUTTON);
+    }
+
+    return raw;
+}
+
+/**
+ * Input sample timer.
+ *
+ * Run the integrator of each enabled input and report all settled state
+ * changes to the input handler. Stops itself once all inputs are settled.
+ *
+ * @param none
+ * @return none
+ */
+static void
+input_sample(void)
+{
+    uint8_t raw;
+    uint8_t changed = 0;
+    uint8_t settled = 1;
+    uint8_t i;
+    uint8_t bit;
+
+    raw = input_read_raw();
+
+    for (i = 0, bit = 1; i < INPUT_COUNT; i++, bit <<= 1) {
+        if (!(INPUT_ENABLE_MASK & bit)) {
+            continue;
+        }
+
+        if (raw & bit) {
+            if (integrator[i] < INPUT_DEBOUNCE_SAMPLES) {
+                integrator[i]++;
+            }
+        } else if (integrator[i] > 0) {
+            integrator[i]--;
+        }
+
+        if (hold[i] > 0) {
+            hold[i]--;
+            settled = 0;
+            continue;
+        }
+
+        if (integrator[i] == INPUT_DEBOUNCE_SAMPLES && !(input_current & bit)) {
+            input_current |= bit;
+            changed |= bit;
+            hold[i] = INPUT_HOLD_SAMPLES;
+            settled = 0;
+        } else if (integrator[i] == 0 && (input_current & bit)) {
+            input_current &= ~bit;
+            changed |= bit;
+            hold[i] = INPUT_HOLD_SAMPLES;
+            settled = 0;
+        } else if (integrator[i] != 0 &&
+                   integrator[i] != INPUT_DEBOUNCE_SAMPLES)
+        {
+            settled = 0;
+        }
+    }
+
+    if (changed) {
+        for (bit = changed; bit; bit &= bit - 1) {
+            input_stats.changes++;
+        }
+        if (input_handler != NULL) {
+            input_handler(changed, input_current);
+        }
+    }
+
+    if (settled) {
+        sched_timer_stop(&input_timer);
+    }
+}
+
+/**
+ * Input task, posted on every raw edge.
+ * Start sampling unless it is already running.
+ *
+ * @param none
+ * @return none
+ */
+static void
+input_task(void)
+{
+    if (!sched_timer_armed(&input_timer)) {
+        sched_timer_start(&input_timer, input_sample,
+                SCHED_MS(INPUT_SAMPLE_MS), SCHED_MS(INPUT_SAMPLE_MS));
+    }
+}
+
+/**
+ * Initialize input handling.
+ *
+ * Set up pull-ups and pin change interrupts for all enabled inputs and
+ * register the handler called with settled state changes. The initial
+ * input state is taken as settled without reporting it.
+ *
+ * @param handler Function to call on settled state changes
+ * @return none
+ */
+void
+input_init(input_handler_t handler)
+{
+    uint8_t i;
+
+    input_handler = handler;
+    sched_task_register(SCHED_TASK_INPUT, input_task);
+
+    /* Inputs with pull-ups */
+    DDRD &= ~(1 << PD2);
+    PORTD |= (1 << PD2);
+    DDRC &= ~INPUT_PORTC_MASK;
+    PORTC |= INPUT_PORTC_MASK;
+
+    input_current = input_read_raw();
+    for (i = 0; i < INPUT_COUNT; i++) {
+        integrator[i] = (input_current & (1 << i)) ? INPUT_DEBOUNCE_SAMPLES : 0;
+    }
+
+    /*
+     * PCINT18 for the button. A pin change interrupt is used instead of
+     * INT0, as INT0 edges can't wake up the CPU from power-down.
+     */
+    input_last_pd2 = PIND & (1 << PD2);
+    PCMSK2 |= (1 << PCINT18);
+    PCICR |= (1 << PCIE2);
+
+    /* PCINT8-13 for PC0-PC5 */
+    if (INPUT_PORTC_MASK) {
+        PCMSK1 |= INPUT_PORTC_MASK;
+        PCICR |= (1 << PCIE1);
+    }
+}
+
+/**
+ * Return the current debounced input state.
+ *
+ * @param none
+ * @return bitmask of active inputs
+ */
+uint8_t
+input_state(void)
+{
+    return input_current;
+}
+
+/**
+ * Print input statistics.
+ *
+ * Comparing the number of raw edges with settled changes and the number
+ * of changes actually sent shows how much bouncing was filtered out, and
+ * how many button changes the send cache coalesced.
+ *
+ * @param none
+ * @return none
+ */
+void
+input_print_stats(void)
+{
+    uint16_t edges;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        edges = input_stats.edges;
+    }
+
+    uart_print_pgm(string_input_stats);
+    uart_putint(edges, 1);
+    uart_print_pgm(string_edges);
+    uart_putint(input_stats.changes, 1);
+    uart_print_pgm(string_changes);
+    uart_putint(input_stats.written, 1);
+    uart_print_pgm(string_written);
+    uart_putint(input_stats.coalesced, 1);
+    uart_print_pgm(string_coalesced);
+    uart_putint(input_stats.sent, 1);
+    uart_print_pgm(string_sent);
+    uart_puthex(input_current);
+    uart_newline();
+}
+
+/**
+ * PCINT2 interrupt handler, triggered by PD2 (button) changes.
+ * Count the raw edge and post the input task.
+ *
+ * The power manager also enables PCINT16 (RXD) here to wake up from
+ * power-down, so only actual PD2 changes are handled.
+ */
+SIGNAL(PCINT2_vect)
+{
+    uint8_t pd2 = PIND & (1 << PD2);
+
+    if (pd2 != input_last_pd2) {
+        input_last_pd2 = pd2;
+        input_stats.edges++;
+        sched_post(SCHED_TASK_INPUT);
+    }
+}
+
+/**
+ * PCINT1 interrupt handler, triggered by PC0-PC5 changes.
+ * Count the raw edge and post the input task.
+ */
+SIGNAL(PCINT1_vect)
+{
+    input_stats.edges++;
+    sched_post(SCHED_TASK_INPUT);
+}
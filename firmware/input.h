@@ -0,0 +1,59 @@
+/*
+ * Debounced digital input handling
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+#include <stdint.h>
+
+/*
+ * Input numbers, bit positions in the input state and change masks.
+ * Input 0 is the button on PD2, inputs 1-6 are PC0-PC5.
+ * All inputs are active low with internal pull-ups enabled.
+ */
+#define INPUT_BUTTON        0
+#define INPUT_PC0           1
+#define INPUT_COUNT         7
+
+/* PC0-PC5 inputs to enable, PC0 is bit 0, PC4 and PC5 are used by the ADC */
+#ifndef INPUT_PORTC_MASK
+#define INPUT_PORTC_MASK    0x0f
+#endif
+
+/* Sample period while any input is unsettled */
+#ifndef INPUT_SAMPLE_MS
+#define INPUT_SAMPLE_MS     5
+#endif
+
+/* Number of consecutive samples an input needs to change its state */
+#ifndef INPUT_DEBOUNCE_SAMPLES
+#define INPUT_DEBOUNCE_SAMPLES 4
+#endif
+
+/* Minimum number of samples a new state is kept before it may change again */
+#ifndef INPUT_HOLD_SAMPLES
+#define INPUT_HOLD_SAMPLES  10
+#endif
+
+struct input_stats {
+    uint16_t edges;     /* raw pin change interrupts */
+    uint16_t changes;   /* settled state changes */
+    uint16_t written;   /* button changes written to the BLE send cache */
+    uint16_t coalesced; /* written values replaced before they were sent */
+    uint16_t sent;      /* button notifications sent over the air */
+};
+
+typedef void (*input_handler_t)(uint8_t changed, uint8_t state);
+
+void input_init(input_handler_t handler);
+uint8_t input_state(void);
+void input_print_stats(void);
+
+extern struct input_stats input_stats;
+
+#endif /* _INPUT_H_ */
@@ -0,0 +1,451 @@
+/*
+ * Connection lifecycle tracking
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Follows the primary nRF8001 module through its lifecycle as reported by
+ * its events, and times the phases that matter for judging advertising
+ * and connection parameters:
+ *
+ *  - setup, from the start of nrf_setup() to the final DeviceStartedEvent
+ *  - advertising, from the first advertising start after setup or after a
+ *    disconnect, across all stages and their timeouts, until a central
+ *    connects. Episodes that end with the module put to sleep count as
+ *    given up, and aren't timed.
+ *  - pipes, from the connection until the central opened a TX pipe
+ *  - connection, from the connection until the disconnect
+ *
+ * Each phase keeps its count, min, mean and max duration, and a histogram
+ * with logarithmic buckets. Disconnects are counted by their Bluetooth
+ * reason, and the time spent in each state is summed up.
+ *
+ * The first setup runs before the scheduler tick, so tracking starts with
+ * lifecycle_init() once the tick runs.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "lifecycle.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+#ifdef LIFECYCLE_STATS
+
+static const char string_lifecycle[] PROGMEM    = "Lifecycle: state ";
+static const char string_transitions[] PROGMEM  = ", transitions ";
+static const char string_adv_timeouts[] PROGMEM = ", adv timeouts ";
+static const char string_gave_up[] PROGMEM      = ", gave up ";
+static const char string_setup[] PROGMEM        = "Setup";
+static const char string_advertising[] PROGMEM  = "Advertising";
+static const char string_pipes[] PROGMEM        = "Pipes open";
+static const char string_connection[] PROGMEM   = "Connection";
+static const char string_count[] PROGMEM        = ": count ";
+static const char string_min_mean_max[] PROGMEM = ", min/mean/max ";
+static const char string_ms[] PROGMEM           = " ms\r\n";
+static const char string_below[] PROGMEM        = " <";
+static const char string_above[] PROGMEM        = " >=";
+static const char string_reasons[] PROGMEM      = "Disconnect reasons:";
+static const char string_other[] PROGMEM        = " other ";
+static const char string_residency[] PROGMEM    = "State residency:";
+
+static const char * const life_phase_names[LIFE_PHASES] PROGMEM = {
+    string_setup,
+    string_advertising,
+    string_pipes,
+    string_connection,
+};
+
+#define LIFE_STATES (LIFE_STATE_SLEEP + 1)
+
+static struct {
+    uint8_t running;
+    uint8_t state;
+    uint8_t active;                 /* bitmask of running phases */
+    uint32_t entered;               /* tick of the last transition */
+    uint32_t start[LIFE_PHASES];    /* tick each running phase started */
+    uint16_t transitions;
+    uint16_t adv_timeouts;
+    uint16_t gave_up;
+} life;
+
+static struct life_phase life_phases[LIFE_PHASES];
+static uint32_t life_residency[LIFE_STATES];
+
+static struct {
+    uint8_t reason;
+    uint16_t count;
+} life_reasons[LIFE_REASONS];
+static uint16_t life_reasons_other;
+
+
+/**
+ * Start tracking, the scheduler tick is running from now on.
+ *
+ * Called after the initial setup, so the module is in standby.
+ *
+ * @param none
+ * @return none
+ */
+void
+lifecycle_init(void)
+{
+    life.running = 1;
+    life.state = LIFE_STATE_STANDBY;
+    life.entered = sched_now();
+}
+
+/**
+ * Switch to the given state, adding up the time spent in the old one.
+ *
+ * @param state New state, one of LIFE_STATE_*
+ * @param now Current tick
+ * @return none
+ */
+static void
+lifecycle_enter(uint8_t state, uint32_t now)
+{
+    if (state == life.state) {
+        return;
+    }
+
+    life_residency[life.state] += (now - life.entered) * SCHED_TICK_MS;
+    life.state = state;
+    life.entered = now;
+    life.transitions++;
+}
+
+/**
+ * Start timing the given phase.
+ *
+ * @param phase Phase, one of LIFE_PHASE_*
+ * @param now Current tick
+ * @return none
+ */
+static void
+lifecycle_begin(uint8_t phase, uint32_t now)
+{
+    life.start[phase] = now;
+    life.active |= (1 << phase);
+}
+
+/**
+ * Stop timing the given phase, if it is running, and record its duration.
+ *
+ * @param phase Phase, one of LIFE_PHASE_*
+ * @param now Current tick
+ * @return none
+ */
+static void
+lifecycle_end(uint8_t phase, uint32_t now)
+{
+    struct life_phase *p = &life_phases[phase];
+    uint32_t ms;
+    uint32_t rest;
+    uint8_t bucket = 0;
+
+    if (!(life.active & (1 << phase))) {
+        return;
+    }
+    life.active &= ~(1 << phase);
+
+    ms = (now - life.start[phase]) * SCHED_TICK_MS;
+    if (p->count == 0 || ms < p->min) {
+        p->min = ms;
+    }
+    if (ms > p->max) {
+        p->max = ms;
+    }
+    p->total += ms;
+    p->count++;
+
+    for (rest = ms; rest >= 2 && bucket < LIFE_BUCKETS - 1; rest >>= 2) {
+        bucket++;
+    }
+    p->histogram[bucket]++;
+}
+
+/**
+ * The nRF8001 is reset and set up again.
+ *
+ * Any running phase is abandoned, a connection that gets reset away never
+ * sees its DisconnectedEvent.
+ *
+ * @param none
+ * @return none
+ */
+void
+lifecycle_setup_start(void)
+{
+    uint32_t now = sched_now();
+
+    if (!life.running) {
+        return;
+    }
+
+    life.active = 0;
+    lifecycle_begin(LIFE_PHASE_SETUP, now);
+    lifecycle_enter(LIFE_STATE_RESET, now);
+}
+
+/**
+ * The setup completed, the module is in standby.
+ *
+ * @param none
+ * @return none
+ */
+void
+lifecycle_setup_done(void)
+{
+    uint32_t now = sched_now();
+
+    if (!life.running) {
+        return;
+    }
+
+    lifecycle_end(LIFE_PHASE_SETUP, now);
+    lifecycle_enter(LIFE_STATE_STANDBY, now);
+}
+
+/**
+ * Advertising started, with a Connect or Bond command.
+ *
+ * Restarts after a stage timed out continue the running phase.
+ *
+ * @param none
+ * @return none
+ */
+void
+lifecycle_advertising(void)
+{
+    uint32_t now = sched_now();
+
+    if (!life.running) {
+        return;
+    }
+
+    if (!(life.active & (1 << LIFE_PHASE_ADVERTISING))) {
+        lifecycle_begin(LIFE_PHASE_ADVERTISING, now);
+    }
+    lifecycle_enter(LIFE_STATE_ADVERTISING, now);
+}
+
+/**
+ * A central connected.
+ *
+ * @param none
+ * @return none
+ */
+void
+lifecycle_connected(void)
+{
+    uint32_t now = sched_now();
+
+    if (!life.running) {
+        return;
+    }
+
+    lifecycle_end(LIFE_PHASE_ADVERTISING, now);
+    lifecycle_begin(LIFE_PHASE_PIPES, now);
+    lifecycle_begin(LIFE_PHASE_CONNECTION, now);
+    lifecycle_enter(LIFE_STATE_CONNECTED, now);
+}
+
+/**
+ * The pipe status changed.
+ *
+ * @param tx_open 1 if at least one TX pipe is open, 0 otherwise
+ * @return none
+ */
+void
+lifecycle_pipes(uint8_t tx_open)
+{
+    uint32_t now = sched_now();
+
+    if (!life.running) {
+        return;
+    }
+
+    if (tx_open && life.state == LIFE_STATE_CONNECTED) {
+        lifecycle_end(LIFE_PHASE_PIPES, now);
+        lifecycle_enter(LIFE_STATE_OPEN, now);
+    } else if (!tx_open && life.state == LIFE_STATE_OPEN) {
+        lifecycle_enter(LIFE_STATE_CONNECTED, now);
+    }
+}
+
+/**
+ * Count the given disconnect reason.
+ *
+ * @param reason Bluetooth error code of the disconnect
+ * @return none
+ */
+static void
+lifecycle_count_reason(uint8_t reason)
+{
+    uint8_t i;
+
+    for (i = 0; i < LIFE_REASONS; i++) {
+        if (life_reasons[i].count == 0) {
+            life_reasons[i].reason = reason;
+        }
+        if (life_reasons[i].reason == reason) {
+            life_reasons[i].count++;
+            return;
+        }
+    }
+
+    life_reasons_other++;
+}
+
+/**
+ * A DisconnectedEvent was received.
+ *
+ * An advertising timeout only ends an advertising stage, the phase goes
+ * on with the next stage. Otherwise, the connection is gone, and its
+ * reason is counted.
+ *
+ * @param aci_status ACI status of the event
+ * @param btle_status Bluetooth error code of the event
+ * @return none
+ */
+void
+lifecycle_disconnected(uint8_t aci_status, uint8_t btle_status)
+{
+    uint32_t now = sched_now();
+
+    if (!life.running) {
+        return;
+    }
+
+    if (aci_status == ACI_STATUS_ERROR_ADVT_TIMEOUT) {
+        life.adv_timeouts++;
+    } else if (life.state == LIFE_STATE_CONNECTED ||
+            life.state == LIFE_STATE_OPEN)
+    {
+        life.active &= ~(1 << LIFE_PHASE_PIPES);
+        lifecycle_end(LIFE_PHASE_CONNECTION, now);
+        lifecycle_count_reason(btle_status);
+    }
+
+    lifecycle_enter(LIFE_STATE_STANDBY, now);
+}
+
+/**
+ * The module was put to sleep, advertising gave up.
+ *
+ * @param none
+ * @return none
+ */
+void
+lifecycle_sleep(void)
+{
+    uint32_t now = sched_now();
+
+    if (!life.running) {
+        return;
+    }
+
+    if (life.active & (1 << LIFE_PHASE_ADVERTISING)) {
+        life.active &= ~(1 << LIFE_PHASE_ADVERTISING);
+        life.gave_up++;
+    }
+    lifecycle_enter(LIFE_STATE_SLEEP, now);
+}
+
+/**
+ * Print the statistics of the given phase, and its non-empty histogram
+ * buckets with their upper bound.
+ *
+ * @param phase Phase, one of LIFE_PHASE_*
+ * @return none
+ */
+static void
+lifecycle_print_phase(uint8_t phase)
+{
+    struct life_phase *p = &life_phases[phase];
+    uint8_t i;
+
+    uart_print_pgm(pgm_read_ptr(&life_phase_names[phase]));
+    uart_print_pgm(string_count);
+    uart_putint(p->count, 1);
+    uart_print_pgm(string_min_mean_max);
+    uart_putint(p->min, 1);
+    uart_putchar('/');
+    uart_putint(p->count ? p->total / p->count : 0, 1);
+    uart_putchar('/');
+    uart_putint(p->max, 1);
+    uart_print_pgm(string_ms);
+
+    if (p->count == 0) {
+        return;
+    }
+
+    for (i = 0; i < LIFE_BUCKETS; i++) {
+        if (p->histogram[i] == 0) {
+            continue;
+        }
+        if (i < LIFE_BUCKETS - 1) {
+            uart_print_pgm(string_below);
+            uart_putint(2UL << (2 * i), 1);
+        } else {
+            uart_print_pgm(string_above);
+            uart_putint(2UL << (2 * (i - 1)), 1);
+        }
+        uart_putchar(':');
+        uart_putint(p->histogram[i], 1);
+    }
+    uart_print_pgm(string_ms);
+}
+
+/**
+ * Print the lifecycle state, all phase statistics, the disconnect reasons
+ * and the time spent in each state.
+ *
+ * @param none
+ * @return none
+ */
+void
+lifecycle_print_stats(void)
+{
+    uint32_t now = sched_now();
+    uint8_t i;
+
+    uart_print_pgm(string_lifecycle);
+    uart_putint(life.state, 1);
+    uart_print_pgm(string_transitions);
+    uart_putint(life.transitions, 1);
+    uart_print_pgm(string_adv_timeouts);
+    uart_putint(life.adv_timeouts, 1);
+    uart_print_pgm(string_gave_up);
+    uart_putint(life.gave_up, 1);
+    uart_newline();
+
+    for (i = 0; i < LIFE_PHASES; i++) {
+        lifecycle_print_phase(i);
+    }
+
+    uart_print_pgm(string_reasons);
+    for (i = 0; i < LIFE_REASONS && life_reasons[i].count > 0; i++) {
+        uart_putchar(' ');
+        uart_puthex(life_reasons[i].reason);
+        uart_putchar(':');
+        uart_putint(life_reasons[i].count, 1);
+    }
+    uart_print_pgm(string_other);
+    uart_putint(life_reasons_other, 1);
+    uart_newline();
+
+    uart_print_pgm(string_residency);
+    for (i = 0; i < LIFE_STATES; i++) {
+        uart_putchar(' ');
+        uart_putint(life_residency[i] +
+                ((i == life.state) ?
+                    (now - life.entered) * SCHED_TICK_MS : 0), 1);
+    }
+    uart_print_pgm(string_ms);
+}
+
+#endif /* LIFECYCLE_STATS */
@@ -0,0 +1,73 @@
+/*
+ * Connection lifecycle tracking
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _LIFECYCLE_H_
+#define _LIFECYCLE_H_
+
+#include <stdint.h>
+
+/*
+ * Tracking is opt-in, set LIFECYCLE_STATS to build it. The phase timings
+ * and histograms take about 200 bytes of RAM, without it the hooks in the
+ * ACI event handling compile to nothing.
+ */
+
+/* Lifecycle states, as reported by the nRF8001 events */
+#define LIFE_STATE_RESET        0   /* before or during setup */
+#define LIFE_STATE_STANDBY      1   /* set up, not advertising */
+#define LIFE_STATE_ADVERTISING  2
+#define LIFE_STATE_CONNECTED    3
+#define LIFE_STATE_OPEN         4   /* connected, a TX pipe is open */
+#define LIFE_STATE_SLEEP        5
+
+/* Timed phases */
+#define LIFE_PHASE_SETUP        0   /* setup start to DeviceStartedEvent */
+#define LIFE_PHASE_ADVERTISING  1   /* first advertising start to connection */
+#define LIFE_PHASE_PIPES        2   /* connection to first open TX pipe */
+#define LIFE_PHASE_CONNECTION   3   /* connection to disconnect */
+#define LIFE_PHASES             4
+
+/*
+ * Histogram buckets, each four times as wide as the previous one. Bucket
+ * n holds durations below 2 << (2 * n) ms, the last one everything above.
+ */
+#define LIFE_BUCKETS            10
+
+/* Distinct disconnect reasons counted, further ones count as other */
+#define LIFE_REASONS            6
+
+struct life_phase {
+    uint16_t count;
+    uint32_t min;           /* ms */
+    uint32_t max;           /* ms */
+    uint32_t total;         /* ms */
+    uint16_t histogram[LIFE_BUCKETS];
+};
+
+#ifdef LIFECYCLE_STATS
+void lifecycle_init(void);
+void lifecycle_setup_start(void);
+void lifecycle_setup_done(void);
+void lifecycle_advertising(void);
+void lifecycle_connected(void);
+void lifecycle_pipes(uint8_t tx_open);
+void lifecycle_disconnected(uint8_t aci_status, uint8_t btle_status);
+void lifecycle_sleep(void);
+void lifecycle_print_stats(void);
+#else
+#define lifecycle_init()                        do { } while (0)
+#define lifecycle_setup_start()                 do { } while (0)
+#define lifecycle_setup_done()                  do { } while (0)
+#define lifecycle_advertising()                 do { } while (0)
+#define lifecycle_connected()                   do { } while (0)
+#define lifecycle_pipes(tx_open)                do { } while (0)
+#define lifecycle_disconnected(aci, btle)       do { } while (0)
+#define lifecycle_sleep()                       do { } while (0)
+#endif
+
+#endif /* _LIFECYCLE_H_ */
@@ -9,15 +9,15 @@
  *   1  /Reset
  *   2  PD0 UART RXD
  *   3  PD1 UART TXD
- *   4  PD2 INT0 button
- *   5  PD3 (unused)
+ *   4  PD2 PCINT18 button
+ *   5  PD3 OC2B PWM 2
  *   6  PD4 LED BLE connect
  *   7  VCC
  *   8  GND
- *   9  PB6 (unused)
- *  10  PB7 (unused)
- *  11  PD5 (unused)
- *  12  PD6 OC0A PWM
+ *   9  PB6 (unused, second nRF8001 REQN, see nrf.h)
+ *  10  PB7 (unused, second nRF8001 RDYN, see nrf.h)
+ *  11  PD5 OC0B PWM 1
+ *  12  PD6 OC0A PWM 0
  *  13  PD7 LED BLE setup
  *  14  PB0 BLE reset
  *
@@ -29,12 +29,12 @@
  *  20  AVCC
  *  21  AREF
  *  22  GND
- *  23  PC0 (unused)
- *  24  PC1 (unused)
- *  25  PC2 (unused)
- *  26  PC3 (unused)
- *  27  PC4 (unused)
- *  28  PC5 (unused)
+ *  23  PC0 input 1
+ *  24  PC1 input 2
+ *  25  PC2 input 3
+ *  26  PC3 input 4
+ *  27  PC4 ADC4
+ *  28  PC5 ADC5
  *
  */
 #include <string.h>
@@ -46,6 +46,26 @@
 #include "uart.h"
 #include "nrf.h"
 #include "spi.h"
+#include "sched.h"
+#include "input.h"
+#include "attr.h"
+#include "bcast.h"
+#include "timing.h"
+#include "adv.h"
+#include "bond.h"
+#include "clock.h"
+#include "codec.h"
+#include "connevt.h"
+#include "lifecycle.h"
+#include "replay.h"
+#include "power.h"
+#include "supervisor.h"
+#include "stack.h"
+#include "ack.h"
+#include "adc.h"
+#include "frag.h"
+#include "ota.h"
+#include "pwm.h"
 
 #ifndef BUILD_TIMESTAMP
 #define BUILD_TIMESTAMP "<unavailable>"
@@ -60,8 +80,29 @@ static const char string_ble_banner[] PROGMEM = "\f\r\n"
 
 static const char string_setup_done[] PROGMEM = "Setup done: ";
 static const char string_reset[] PROGMEM      = "\r\nResetting BLE module\r\n";
+static const char string_input[] PROGMEM      = "Input ";
+static const char string_unbond[] PROGMEM     = "\r\nRemoving bond\r\n";
+static const char string_ack_failed[] PROGMEM = "Indication failed: ";
+#ifdef FRAG_ENABLED
+static const char string_message[] PROGMEM    = "Message received: ";
+#endif
+
+#ifdef PIPE_EXAMPLE_SERVICE_SERIAL_NUMBER_SET
+/*
+ * Per-device serial number, published through the Serial Number set pipe.
+ * Unprogrammed (all 0xff) EEPROM keeps the setup default value.
+ */
+static uint8_t
+eeprom_serial[PIPE_EXAMPLE_SERVICE_SERIAL_NUMBER_SET_MAX_SIZE] EEMEM;
+#endif
+
+/* Fallback poll interval for the nRF8001 in case an RDYN edge got lost */
+#define NRF_POLL_INTERVAL_MS 100
 
-static uint8_t button_interrupt;
+/* Refresh period of the broadcast input state */
+#define BCAST_STATE_PERIOD_MS 500
+
+static struct sched_timer nrf_poll_timer;
 
 /**
  * Parse and handle debug interface.
@@ -78,14 +119,486 @@ parse_input(char c)
         case 'r':   /* reset BLE module */
             uart_print_pgm(string_reset);
             nrf_reset_module();
+            attr_resync();
+            sched_post(SCHED_TASK_NRF);
+            break;
+
+        case 'x':   /* remove bond and reset BLE module */
+            uart_print_pgm(string_unbond);
+            bond_clear();
+            nrf_reset_module();
+            attr_resync();
+            sched_post(SCHED_TASK_NRF);
             break;
 
         case 't':   /* get module temperature ..because why not. */
             nrf_print_temperature();
             break;
+
+        case 'c':   /* data credits and send cache statistics */
+            uart_newline();
+            nrf_print_tx_stats();
+            break;
+
+        case 'l':   /* link timing */
+            uart_newline();
+            timing_print();
+            break;
+
+        case 'n':   /* connection event tracking */
+            uart_newline();
+            connevt_print_stats();
+            break;
+
+        case 'j':   /* toggle holding values until the next connection event */
+            uart_newline();
+            connevt_enable(!connevt_enabled());
+            connevt_print_stats();
+            break;
+
+        case 'u':   /* replay recorded ACI events from the UART */
+            uart_newline();
+            replay_start();
+            break;
+
+#ifdef LIFECYCLE_STATS
+        case 'y':   /* connection lifecycle statistics */
+            uart_newline();
+            lifecycle_print_stats();
+            break;
+#endif
+
+        case '0':   /* fixed connection parameter profiles */
+        case '1':
+        case '2':
+            uart_newline();
+            timing_set_profile(c - '0');
+            break;
+
+        case 'a':   /* automatic connection parameter profile */
+            uart_newline();
+            timing_set_auto(1);
+            break;
+
+        case 'v':   /* advertising statistics */
+            uart_newline();
+            adv_print_stats();
+            break;
+
+        case 'w':   /* power state residency */
+            uart_newline();
+            power_print_stats();
+            break;
+
+        case 'q':   /* toggle clock scaling, restarting the power statistics */
+            uart_newline();
+            clock_enable(!clock_enabled());
+            power_reset_stats();
+            clock_print_stats();
+            break;
+
+        case 'i':   /* input statistics */
+            uart_newline();
+            input_print_stats();
+            break;
+
+#ifdef ADC_ENABLED
+        case 'd':   /* ADC statistics */
+            uart_newline();
+            adc_print_stats();
+            break;
+
+        case 's':   /* ADC sample rate sweep */
+            uart_newline();
+            adc_sweep();
+            break;
+#endif
+
+        case 'b':   /* toggle broadcast mode */
+            uart_newline();
+            bcast_enable(!bcast_enabled());
+            bcast_print_stats();
+            /* a sleeping nRF8001 starts over with the new mode */
+            nrf_wakeup();
+            break;
+
+        case 'h':   /* RAM usage and stack high-water mark */
+            uart_newline();
+            stack_print_stats();
+            break;
+
+        case 'z':   /* codec statistics */
+            uart_newline();
+            codec_print_stats();
+            break;
+
+        case 'e':   /* link fault and recovery statistics */
+            uart_newline();
+            supervisor_print_stats();
+            break;
+
+        case 'k':   /* acknowledged transmit statistics */
+            uart_newline();
+            ack_print_stats();
+            break;
+
+#ifdef FRAG_ENABLED
+        case 'g':   /* message fragmentation statistics, echo last message */
+            uart_newline();
+            frag_print_stats();
+            frag_echo();
+            break;
+#endif
+
+        case 'm':   /* PWM statistics */
+            uart_newline();
+            pwm_print_stats();
+            break;
+
+#ifdef OTA_ENABLED
+        case 'o':   /* firmware update statistics */
+            uart_newline();
+            ota_print_stats();
+            break;
+#endif
+
+        case 'p':   /* ACI event statistics */
+            uart_newline();
+            nrf_print_evt_stats();
+            break;
+
+        case 'f':   /* inject a link fault */
+            uart_newline();
+            supervisor_inject();
+            break;
+    }
+}
+
+
+/**
+ * Console task.
+ * Handle the last character received via UART.
+ *
+ * @param none
+ * @return none
+ */
+static void
+console_task(void)
+{
+    char c;
+
+    power_console_activity();
+
+    c = uart_get_inbuf();
+    if (c != 0) {
+        uart_putchar(c);
+        parse_input(c);
+        uart_reset_inbuf();
     }
 }
 
+/**
+ * UART RX callback, runs in interrupt context.
+ * Post the console task.
+ */
+static void
+console_rx(void)
+{
+    sched_post(SCHED_TASK_CONSOLE);
+}
+
+/**
+ * Replay end handler.
+ * Hand the UART back to the console, and reset the nRF8001 to get its
+ * actual state back.
+ *
+ * @param none
+ * @return none
+ */
+static void
+replay_finished(void)
+{
+    uart_set_rx_callback(console_rx);
+    uart_print_pgm(string_reset);
+    nrf_reset_module();
+    attr_resync();
+    sched_post(SCHED_TASK_NRF);
+}
+
+/**
+ * Input change handler.
+ *
+ * Send button state changes to the remote side, all other inputs are
+ * only reported on the console.
+ *
+ * @param changed Bitmask of inputs that changed
+ * @param state Bitmask of currently active inputs
+ * @return none
+ */
+static void
+input_changed(uint8_t changed, uint8_t state)
+{
+    uint8_t i;
+
+    /* any input activity brings a sleeping nRF8001 back */
+    nrf_wakeup();
+
+    if (changed & (1 << INPUT_BUTTON)) {
+        if (nrf_send_button_data(!!(state & (1 << INPUT_BUTTON))) == 0) {
+            input_stats.written++;
+        }
+    }
+
+    for (i = INPUT_PC0; i < INPUT_COUNT; i++) {
+        if (changed & (1 << i)) {
+            uart_print_pgm(string_input);
+            uart_putint(i, 1);
+            uart_putchar(' ');
+            uart_putint(!!(state & (1 << i)), 1);
+            uart_newline();
+        }
+    }
+}
+
+/**
+ * Acknowledged transmit completion handler.
+ *
+ * Report packets that could not be delivered.
+ *
+ * @param pipe TX_ACK pipe number
+ * @param tag Packet tag given to ack_send()
+ * @param status ACK_STATUS_SUCCESS, ACK_STATUS_TIMEOUT or ACI error code
+ * @return none
+ */
+static void
+ack_done(uint8_t pipe, uint8_t tag, uint8_t status)
+{
+    if (status != ACK_STATUS_SUCCESS) {
+        uart_print_pgm(string_ack_failed);
+        uart_putint(pipe, 1);
+        uart_putchar(' ');
+        uart_putint(tag, 1);
+        uart_putchar(' ');
+        uart_puthex(status);
+        uart_newline();
+    }
+}
+
+/**
+ * RX_ACK write handler.
+ *
+ * All example characteristics are single byte values, reject anything
+ * else so the central gets an error response.
+ *
+ * @param pipe RX_ACK pipe number
+ * @param data Received data
+ * @param length Data length
+ * @return ACK_STATUS_SUCCESS, or ACK_ERROR_APP for an invalid length
+ */
+static uint8_t
+ack_write(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    (void) pipe;
+    (void) data;
+
+    return (length == 1) ? ACK_STATUS_SUCCESS : ACK_ERROR_APP;
+}
+
+#ifdef PIPE_EXAMPLE_SERVICE_STATE_BROADCAST
+/**
+ * Broadcast value read function, the current input state.
+ *
+ * @param data Buffer for the value
+ * @return value length
+ */
+static uint8_t
+state_read(uint8_t *data)
+{
+    data[0] = input_state();
+    return 1;
+}
+#endif
+
+#ifdef FRAG_ENABLED
+/**
+ * Reassembled message handler, report the message length.
+ *
+ * @param data Message data
+ * @param length Message length
+ * @return none
+ */
+static void
+message_received(const uint8_t *data, uint16_t length)
+{
+    (void) data;
+
+    uart_print_pgm(string_message);
+    uart_putint(length, 1);
+    uart_newline();
+}
+#endif
+
+/**
+ * nRF8001 fallback poll timer.
+ */
+static void
+nrf_poll(void)
+{
+    sched_post(SCHED_TASK_NRF);
+}
+
+#if NRF_DEVICES > 1
+/**
+ * Serve the currently selected additional nRF8001 module.
+ *
+ * Additional modules have no supervisor, a link fault resets the module
+ * once, and a module failing that stays disabled. At most one pending
+ * event is handled per call, so no module keeps the bus for long, and
+ * advertising is restarted without timeout whenever the connection is gone.
+ *
+ * @param none
+ * @return none
+ */
+static void
+nrf_secondary_task(void)
+{
+    if (nrf_fault == NRF_FAULT_SETUP) {
+        return;
+    }
+
+    if (nrf_fault != NRF_FAULT_NONE) {
+        nrf_fault = NRF_FAULT_NONE;
+        if (nrf_reset_module() < 0) {
+            nrf_fault = NRF_FAULT_SETUP;
+        }
+        return;
+    }
+
+    nrf_parse_queued();
+
+    if (rdyn_is_low()) {
+        nrf_receive(&rx);
+        if (rx.length > 0) {
+            nrf_print_rx(&rx);
+            nrf_parse(&rx);
+            memset(&rx, 0, sizeof(rx));
+        }
+    }
+
+    if (nrf_connect_state == NRF_STATE_DISCONNECT) {
+        nrf_advertise(0, ADV_MEDIUM_INTERVAL);
+        nrf_connect_state = NRF_STATE_CONNECTING;
+    }
+}
+#endif
+
+/**
+ * nRF8001 task.
+ *
+ * Additional modules are served first, one event each, then the primary
+ * module is selected again. For the primary module, let the supervisor
+ * recover it from any link fault first, then receive and handle a pending
+ * event if the module signals one by pulling RDYN low, and restart
+ * advertising whenever the connection is gone. Once advertising gave up,
+ * the module is put to sleep and the fallback poll timer is stopped, so
+ * the AVR can enter power-down.
+ *
+ * @param none
+ * @return none
+ */
+static void
+nrf_task(void)
+{
+    static uint8_t last_state = NRF_STATE_DISCONNECT;
+    uint8_t timed_out;
+#if NRF_DEVICES > 1
+    uint8_t device;
+
+    for (device = 1; device < NRF_DEVICES; device++) {
+        nrf_select(device);
+        nrf_secondary_task();
+    }
+    nrf_select(0);
+#endif
+
+    if (supervisor_check()) {
+        return;
+    }
+
+    /* events read in while sending, before any new one */
+    nrf_parse_queued();
+
+    if (rdyn_is_low()) {
+        nrf_receive(&rx);
+        if (rx.length > 0) {
+            nrf_print_rx(&rx);
+            nrf_parse(&rx);
+            memset(&rx, 0, sizeof(rx));
+        }
+        /* the central waits for write responses, send them right away */
+        ack_rx_flush();
+    }
+
+    if (nrf_connect_state != last_state) {
+        if (nrf_connect_state == NRF_STATE_CONNECTED) {
+            adv_connected();
+            timing_connection(1);
+        } else if (last_state == NRF_STATE_CONNECTED) {
+            timing_connection(0);
+            /* update stored bond, includes the central's notification state */
+            if (nrf_connect_state == NRF_STATE_DISCONNECT) {
+                nrf_save_dynamic_data();
+            }
+        }
+        last_state = nrf_connect_state;
+    }
+
+    if (nrf_connect_state == NRF_STATE_DISCONNECT) {
+        /* a broadcast timeout doesn't advance the advertising stages */
+        timed_out = (nrf_disconnect_status == ACI_STATUS_ERROR_ADVT_TIMEOUT) &&
+                    !bcast_ended();
+
+        if (bcast_enabled() && bcast_start() == 0) {
+            nrf_connect_state = NRF_STATE_CONNECTING;
+        } else if (adv_start(timed_out) == 0) {
+            nrf_connect_state = NRF_STATE_CONNECTING;
+        } else {
+            nrf_sleep();
+        }
+    }
+
+    if (nrf_connect_state == NRF_STATE_SLEEP) {
+        sched_timer_stop(&nrf_poll_timer);
+    } else if (!sched_timer_armed(&nrf_poll_timer)) {
+        sched_timer_start(&nrf_poll_timer, nrf_poll,
+                SCHED_MS(NRF_POLL_INTERVAL_MS), SCHED_MS(NRF_POLL_INTERVAL_MS));
+    }
+}
+
+#ifdef PIPE_EXAMPLE_SERVICE_SERIAL_NUMBER_SET
+/**
+ * Publish the serial number stored in EEPROM, if there is one.
+ *
+ * @param none
+ * @return none
+ */
+static void
+serial_number_init(void)
+{
+    uint8_t serial[PIPE_EXAMPLE_SERVICE_SERIAL_NUMBER_SET_MAX_SIZE];
+    uint8_t i;
+
+    eeprom_read_block(serial, eeprom_serial, sizeof(serial));
+    for (i = 0; i < sizeof(serial); i++) {
+        if (serial[i] != 0xff) {
+            attr_set(PIPE_EXAMPLE_SERVICE_SERIAL_NUMBER_SET,
+                    serial, sizeof(serial));
+            break;
+        }
+    }
+}
+#endif
+
 
 /*
  * Main
@@ -94,15 +607,17 @@ parse_input(char c)
 int
 main(void)
 {
-    volatile char c = 0;
     int8_t ret;
+#if NRF_DEVICES > 1
+    uint8_t device;
+#endif
 
     /* Port setup */
-    /* Set PB0 (nRF reset), PB2 (RDYN), PB3 (MOSI) and PB5 (SCK) as output */
-    DDRB = (1 << PB0) | (1 << PB2) | (1 << PB3) | (1 << PB5);
+    /* Set PB3 (MOSI) and PB5 (SCK) as output, nRF lines follow below */
+    DDRB = (1 << PB3) | (1 << PB5);
     /* Set all outputs high and enable pull-ups on inputs / unused pins */
     PORTB = 0xff;
-    /* Port C is unused, set all pins to input with pull-up */
+    /* Port C is used as inputs, set all pins to input with pull-up */
     DDRC = 0x00;
     PORTC = 0xff;
     /* Set PD4 (setup LED) and PD6 (connect LED) as output */
@@ -113,6 +628,9 @@ main(void)
     /* Make sure pull-up disable (PUD) is not set */
     MCUCR &= ~(1 << PUD);
 
+    /* Set up reset, REQN and RDYN (with pin change interrupt) of all modules */
+    nrf_init_pins();
+
     /* Initialize UART and print banner */
     uart_init(UART_BRATE_9600_8MHZ);
     uart_print_pgm(string_ble_banner);
@@ -126,57 +644,82 @@ main(void)
      * Optionally, use nrf_reset_module() here to be on the safe side
      */
     nrf_tx_map_pipes();
+    ack_init(ack_done, ack_write);
+#ifdef FRAG_ENABLED
+    frag_init(PIPE_EXAMPLE_SERVICE_MESSAGE_TX, PIPE_EXAMPLE_SERVICE_MESSAGE_RX,
+            message_received, NULL);
+#endif
+#ifdef OTA_ENABLED
+    ota_init(PIPE_EXAMPLE_SERVICE_OTA_DATA_RX,
+            PIPE_EXAMPLE_SERVICE_OTA_STATUS_TX);
+#endif
+#ifdef ADC_ENABLED
+    adc_init(PIPE_EXAMPLE_SERVICE_ADC_CONFIG_RX,
+            PIPE_EXAMPLE_SERVICE_ADC_DATA_TX);
+#endif
     ret = nrf_setup();
 
     uart_print_pgm(string_setup_done);
     uart_putint(ret, 1);
     uart_newline();
 
-    /* Enable INT0 interrupt on any logic change */
-    EICRA |= (1 << ISC00);
-    EIMSK |= (1 << INT0);
+    /*
+     * A failed setup is left to the supervisor. This includes a module
+     * that is already set up after the AVR alone got reset.
+     */
+    if (ret < 0 && nrf_fault == NRF_FAULT_NONE) {
+        nrf_fault = NRF_FAULT_SETUP;
+    }
+
+#if NRF_DEVICES > 1
+    /* Additional modules that fail their setup stay disabled */
+    for (device = 1; device < NRF_DEVICES; device++) {
+        nrf_select(device);
+        if (nrf_setup() < 0) {
+            nrf_fault = NRF_FAULT_SETUP;
+        }
+    }
+    nrf_select(0);
+#endif
+
+    /* Set up scheduler tasks and timers */
+    sched_init();
+    lifecycle_init();
+    supervisor_init();
+    sched_task_register(SCHED_TASK_NRF, nrf_task);
+    sched_task_register(SCHED_TASK_CONSOLE, console_task);
+    uart_set_rx_callback(console_rx);
+    replay_init(replay_finished);
+    power_init();
+    clock_init();
+    pwm_init();
+#ifdef PIPE_EXAMPLE_SERVICE_SERIAL_NUMBER_SET
+    serial_number_init();
+#endif
+
+    /* Set up button and Port C inputs, all via pin change interrupts */
+    input_init(input_changed);
+#ifdef PIPE_EXAMPLE_SERVICE_STATE_BROADCAST
+    bcast_add(PIPE_EXAMPLE_SERVICE_STATE_BROADCAST, BCAST_STATE_PERIOD_MS,
+            state_read);
+#endif
 
     /* Enable all interrupts */
     sei();
 
-    while (1) {
-        /* Check button interrupt state */
-        if (button_interrupt) {
-            nrf_send_button_data(!(PIND & (1 << PD2)));
-            button_interrupt = 0;
-        }
-
-        /* Check UART command */
-        c = uart_get_inbuf();
-        if (c != 0) {
-            uart_putchar(c);
-            parse_input(c);
-            uart_reset_inbuf();
-        }
+    /* Start advertising right away */
+    sched_post(SCHED_TASK_NRF);
+    sched_run();
 
-        /* Check nRF */
-        if (nrf_connect_state == NRF_STATE_DISCONNECT) {
-            nrf_advertise();
-            nrf_connect_state = NRF_STATE_CONNECTING;
-        } else {
-            nrf_receive(&rx);
-            if (rx.length > 0) {
-                nrf_print_rx(&rx);
-                nrf_parse(&rx);
-                memset(&rx, 0, sizeof(rx));
-            } else {
-                _delay_ms(20);
-            }
-        }
-    }
+    return 0;
 }
 
 /**
- * INT0 interrupt handler.
- * Set flag that interrupt happened.
+ * PCINT0 interrupt handler, triggered by RDYN changes.
+ * Post the nRF task, it will check if the module has an event pending.
  */
-SIGNAL(INT0_vect)
+SIGNAL(PCINT0_vect)
 {
-    button_interrupt = 1;
+    nrf_rdyn_changed();
+    sched_post(SCHED_TASK_NRF);
 }
-
@@ -10,32 +10,187 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include "uart.h"
 #include "nrf.h"
 #include "spi.h"
+#include "sched.h"
+#include "bond.h"
+#include "clock.h"
+#include "connevt.h"
+#include "ack.h"
+#include "adc.h"
+#include "frag.h"
+#include "input.h"
+#include "lifecycle.h"
+#include "ota.h"
+#include "pwm.h"
 #include "nrf/services.h"
 
 /* String constants stored in PROGMEM */
 static const char string_advertising[] PROGMEM  = "Starting advertising\r\n";
+static const char string_broadcasting[] PROGMEM = "Starting broadcast\r\n";
 static const char string_pipe_closed[] PROGMEM  = "Pipe not open\r\n";
 static const char string_pipes_open[] PROGMEM   = "Open Pipes: ";
 static const char string_connection[] PROGMEM   = "Connection from: ";
 static const char string_received[] PROGMEM     = "Received unhandled data: ";
 static const char string_temperature[] PROGMEM  = "Temperature: ";
 static const char string_celsius[] PROGMEM      = " C\r\n";
+static const char string_credits[] PROGMEM      = "Credits: ";
+static const char string_writes[] PROGMEM       = ", writes ";
+static const char string_packets[] PROGMEM      = ", packets ";
+static const char string_pipe_error[] PROGMEM   = "Pipe error: ";
+static const char string_cmd_error[] PROGMEM    = "Command failed: ";
+static const char string_timing[] PROGMEM       = "Timing: interval ";
+static const char string_latency[] PROGMEM      = " us, latency ";
+static const char string_timeout[] PROGMEM      = ", timeout ";
+static const char string_ms[] PROGMEM           = " ms\r\n";
+static const char string_bond_status[] PROGMEM  = "Bond status: ";
+static const char string_bond_restore[] PROGMEM = "Restoring bond\r\n";
+static const char string_bond_failed[] PROGMEM  = "Bond restore failed\r\n";
+static const char string_bond_saved[] PROGMEM   = "Bond saved: ";
+static const char string_hw_error[] PROGMEM     = "Hardware error: ";
+static const char string_rdyn_timeout[] PROGMEM = "RDYN timeout\r\n";
+static const char string_echo[] PROGMEM         = "Echo:";
+static const char string_passkey[] PROGMEM      = "Passkey: ";
+static const char string_key_request[] PROGMEM  = "Key request: ";
+static const char string_evt_count[] PROGMEM    = ": count ";
+static const char string_evt_mean[] PROGMEM     = ", cycles mean ";
+static const char string_evt_max[] PROGMEM      = ", max ";
+static const char string_evt_malformed[] PROGMEM = "Malformed events: ";
+static const char string_evt_oversized[] PROGMEM = ", oversized packets: ";
+static const char string_evt_lost[] PROGMEM     = ", lost events: ";
+static const char string_state[] PROGMEM        = "state ";
+static const char string_state_credits[] PROGMEM = " credits ";
+static const char string_state_pipes[] PROGMEM  = " pipes ";
+static const char string_state_fault[] PROGMEM  = " fault ";
 
 /* BLE connection state */
 uint8_t nrf_connect_state = NRF_STATE_DISCONNECT;
 /* Global rx data structure */
 struct nrf_rx rx;
+/* Negotiated connection parameters of the current connection */
+struct nrf_timing nrf_timing;
+/* Scheduler tick of the last data sent or received */
+uint32_t nrf_last_activity;
+/* ACI status of the last DisconnectedEvent */
+uint8_t nrf_disconnect_status;
+/* First link fault since the supervisor cleared it, NRF_FAULT_NONE if none */
+uint8_t nrf_fault = NRF_FAULT_NONE;
+/* Data packets sent, for the charge per packet estimate */
+uint32_t nrf_data_sent;
+
+/* sched_cycles() at the last RDYN falling edge of the primary module */
+static volatile uint32_t nrf_rdyn_cycles;
 
 static uint8_t opmode;
-static uint8_t pipes;
+static uint8_t credits;
+static uint8_t credits_total;
 static uint64_t pipes_open;
+static uint8_t bonded;
 static struct nrf_tx tx;
 static const struct service_pipe_mapping service_pipe_map[] = SERVICES_PIPE_TYPE_MAPPING_CONTENT;
 static const struct nrf_setup_data setup_data[NB_SETUP_MESSAGES] PROGMEM = SETUP_MESSAGES_CONTENT;
 
+#if NRF_DEVICES > 1
+/*
+ * Per module state. The selected module's state lives in the globals above,
+ * the others are kept here while deselected. The rx and tx buffers are
+ * shared, only one module uses the bus at a time.
+ */
+struct nrf_context {
+    uint64_t pipes_open;
+    struct nrf_timing timing;
+    uint32_t last_activity;
+    uint8_t connect_state;
+    uint8_t disconnect_status;
+    uint8_t fault;
+    uint8_t opmode;
+    uint8_t credits;
+    uint8_t credits_total;
+    uint8_t bonded;
+};
+
+const struct nrf_pins nrf_pins[NRF_DEVICES] = NRF_DEVICE_PINS;
+uint8_t nrf_cur;
+static struct nrf_context nrf_contexts[NRF_DEVICES];
+
+/**
+ * Select the module all following nrf_* calls refer to.
+ *
+ * Saves the state of the current module and loads the given one's. Must
+ * not be called while a transaction is in progress, and the primary module
+ * should be selected again before returning to the scheduler.
+ *
+ * @param device Module index, 0..NRF_DEVICES-1
+ * @return none
+ */
+void
+nrf_select(uint8_t device)
+{
+    struct nrf_context *ctx;
+
+    if (device == nrf_cur || device >= NRF_DEVICES) {
+        return;
+    }
+
+    ctx = &nrf_contexts[nrf_cur];
+    ctx->pipes_open = pipes_open;
+    ctx->timing = nrf_timing;
+    ctx->last_activity = nrf_last_activity;
+    ctx->connect_state = nrf_connect_state;
+    ctx->disconnect_status = nrf_disconnect_status;
+    ctx->fault = nrf_fault;
+    ctx->opmode = opmode;
+    ctx->credits = credits;
+    ctx->credits_total = credits_total;
+    ctx->bonded = bonded;
+
+    nrf_cur = device;
+
+    ctx = &nrf_contexts[nrf_cur];
+    pipes_open = ctx->pipes_open;
+    nrf_timing = ctx->timing;
+    nrf_last_activity = ctx->last_activity;
+    nrf_connect_state = ctx->connect_state;
+    nrf_disconnect_status = ctx->disconnect_status;
+    nrf_fault = ctx->fault;
+    opmode = ctx->opmode;
+    credits = ctx->credits;
+    credits_total = ctx->credits_total;
+    bonded = ctx->bonded;
+}
+#endif
+
+/**
+ * Set up the control lines of all modules.
+ *
+ * Reset and REQN are outputs, driven high, RDYN is an input with pull-up
+ * and enabled as pin change interrupt.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_init_pins(void)
+{
+    const struct nrf_pins *pins;
+    uint8_t i;
+
+    for (i = 0; i < NRF_DEVICES; i++) {
+        pins = &nrf_pins[i];
+        *pins->reset_port |= pins->reset_mask;
+        *(pins->reset_port - 1) |= pins->reset_mask;
+        *pins->reqn_port |= pins->reqn_mask;
+        *(pins->reqn_port - 1) |= pins->reqn_mask;
+        *(pins->rdyn_port - 1) &= ~pins->rdyn_mask;
+        *pins->rdyn_port |= pins->rdyn_mask;
+        /* RDYN is on port B, pin and PCINT bit numbers are the same */
+        PCMSK0 |= pins->rdyn_mask;
+    }
+    PCICR |= (1 << PCIE0);
+}
+
 
 /**
  * Reset the nRF8001 module.
@@ -54,22 +209,54 @@ nrf_reset_module(void)
     led_setup_off();
     led_connect_off();
 
+    /* the delays here and in nrf_setup() assume F_CPU */
+    clock_full();
+
     ble_reset_low();
     _delay_ms(10);
 
+    /* events queued before the reset refer to the old state */
+    nrf_drop_queued();
+
     nrf_connect_state = NRF_STATE_DISCONNECT;
+    nrf_disconnect_status = ACI_STATUS_SUCCESS;
     return nrf_setup();
 }
 
+/**
+ * Handle a failed setup transaction.
+ *
+ * If restoring bond data failed, the stored bond is most likely invalid.
+ * It is removed and the module is reset again to do a regular setup.
+ *
+ * @param command Setup transaction command
+ * @param ret Error value to return
+ * @return ret, or the nrf_reset_module() return value when retrying
+ */
+static int8_t
+nrf_setup_failed(uint8_t command, int8_t ret)
+{
+    if (command == NRF_CMD_WRITE_DYNAMIC_DATA) {
+        uart_print_pgm(string_bond_failed);
+        bond_clear();
+        return nrf_reset_module();
+    }
+
+    return ret;
+}
+
 /**
  * Setup nRF8001 module.
  *
  * Send all setup data generated from nRFgo Studio in nrf/services.h to the
  * module via SPI and take care that everything is set up properly.
  *
+ * If a bond is stored in EEPROM, its dynamic data is written instead of
+ * the setup data, restoring both the setup and the bond information.
+ *
  * If anything goes wrong during the setup phase, the setup process is
  * aborted and the module will not be functional. A negative return value
- * will indicate an error.
+ * will indicate an error, -6 meaning the module did not respond in time.
  *
  * @param none
  * @return 0 on success, a negative value in case of an error.
@@ -78,7 +265,13 @@ int8_t
 nrf_setup(void)
 {
     uint8_t cnt;
-    
+    uint8_t count;
+    uint8_t command;
+
+    if (nrf_cur == 0) {
+        lifecycle_setup_start();
+    }
+
     ble_reset_high();
     /* 
      * data sheet says RDYN signal is not valid until 62ms after nRF reset
@@ -87,24 +280,47 @@ nrf_setup(void)
     _delay_ms(100);
 
     memset(&rx, 0, sizeof(rx));
-    nrf_receive(&rx);
+    if (nrf_receive(&rx) < 0) {
+        return -6;
+    }
 
-    if (rx.data[0] != NRF_EVT_DEVICE_STARTED || rx.data[2] != NRF_ERR_NO_ERROR) {
+    if (rx.length < NRF_EVT_LEN(device_started) ||
+        rx.data[0] != NRF_EVT_DEVICE_STARTED || rx.data[2] != NRF_ERR_NO_ERROR)
+    {
         return -1;
     }
 
     opmode = rx.data[1];
-    pipes = rx.data[3];
+    credits = credits_total = rx.data[3];
 
     if (opmode != NRF_OPMODE_SETUP) {
         return -2;
     }
 
+    /* the stored bond belongs to the primary module */
+    count = (nrf_cur == 0) ? bond_count() : 0;
+    bonded = (count > 0);
+    if (bonded) {
+        uart_print_pgm(string_bond_restore);
+        command = NRF_CMD_WRITE_DYNAMIC_DATA;
+    } else {
+        count = NB_SETUP_MESSAGES;
+        command = NRF_CMD_SETUP;
+    }
+
     /* Send all setup data to nRF8001 */
-    for (cnt = 0; cnt < NB_SETUP_MESSAGES; cnt++) {
+    for (cnt = 0; cnt < count; cnt++) {
         memset(&rx, 0, sizeof(rx));
-        memcpy_P(&tx, &setup_data[cnt].data, sizeof(struct nrf_tx));
-        nrf_transmit(&tx, &rx);
+        if (command == NRF_CMD_SETUP) {
+            memcpy_P(&tx, &setup_data[cnt].data, sizeof(struct nrf_tx));
+        } else {
+            memset(&tx, 0, sizeof(tx));
+            tx.length = bond_read(cnt, tx.data) + 1;
+            tx.command = NRF_CMD_WRITE_DYNAMIC_DATA;
+        }
+        if (nrf_transmit(&tx, &rx) < 0) {
+            return -6;
+        }
 
         if (rx.length == 0) {
             nrf_print_rx(&rx);
@@ -115,79 +331,298 @@ nrf_setup(void)
 
         /* Make sure transaction continue command response event is received */
         if (rx.data[0] != NRF_EVT_CMD_RESPONSE ||
-            rx.data[1] != NRF_CMD_SETUP ||
+            rx.data[1] != command ||
             rx.data[2] != ACI_STATUS_TRANSACTION_CONTINUE)
         {
-            return -3;
+            return nrf_setup_failed(command, -3);
         }
     }
     
     /* Receive all setup command response events */
     do {
         memset(&rx, 0, sizeof(rx));
-        nrf_receive(&rx);
+        if (nrf_receive(&rx) < 0) {
+            return -6;
+        }
         nrf_print_rx(&rx);
     } while (rx.data[0] == NRF_EVT_CMD_RESPONSE &&
-             rx.data[1] == NRF_CMD_SETUP &&
+             rx.data[1] == command &&
              rx.data[2] == ACI_STATUS_TRANSACTION_CONTINUE);
 
     /* Make sure transaction complete command response event is received */
     if (rx.data[0] != NRF_EVT_CMD_RESPONSE ||
-        rx.data[1] != NRF_CMD_SETUP ||
+        rx.data[1] != command ||
         rx.data[2] != ACI_STATUS_TRANSACTION_COMPLETE)
     {
-        return -4;
+        return nrf_setup_failed(command, -4);
     }
 
     /* One last receive loop to wait for DeviceStartedEvent */
+    cnt = 0;
     do {
         memset(&rx, 0, sizeof(rx));
-        nrf_receive(&rx);
-    } while (rx.data[0] != NRF_EVT_DEVICE_STARTED);
+        if (nrf_receive(&rx) < 0 || ++cnt > NRF_SETUP_EVENTS_MAX) {
+            return -6;
+        }
+    } while (rx.length < NRF_EVT_LEN(device_started) ||
+             rx.data[0] != NRF_EVT_DEVICE_STARTED);
 
     nrf_print_rx(&rx);
 
     if (rx.data[2] != NRF_ERR_NO_ERROR) {
-        return -5;
+        return nrf_setup_failed(command, -5);
     }
 
     opmode = rx.data[1];
-    pipes = rx.data[3];
+    credits = credits_total = rx.data[3];
 
     led_setup_on();
+    if (nrf_cur == 0) {
+        lifecycle_setup_done();
+    }
     
     return 0;
 }
 
+/**
+ * Return whether the module has a bond, restored or established.
+ *
+ * @param none
+ * @return 1 if bonded, 0 otherwise
+ */
+uint8_t
+nrf_bonded(void)
+{
+    return bonded;
+}
 
 /**
- * Start advertising, waiting for remote side to connect.
+ * Save the module's dynamic data as bond in EEPROM.
+ *
+ * Reads the dynamic data with consecutive ReadDynamicData commands and
+ * stores each response message including its sequence number, so it can
+ * be written back as is with WriteDynamicData. Only valid in standby mode
+ * while not connected, i.e. right after a DisconnectedEvent. Nothing is
+ * done if the module is not bonded.
  *
  * @param none
+ * @return 0 on success or if not bonded, -1 on error
+ */
+int8_t
+nrf_save_dynamic_data(void)
+{
+    uint8_t cnt = 0;
+
+    if (!bonded) {
+        return 0;
+    }
+
+    do {
+        memset(&tx, 0, sizeof(tx));
+        tx.length = 1;
+        tx.command = NRF_CMD_READ_DYNAMIC_DATA;
+        nrf_send(&tx);
+
+        /* Wait for the command response, handling other events on the way */
+        do {
+            memset(&rx, 0, sizeof(rx));
+            if (nrf_receive(&rx) < 0) {
+                return -1;
+            }
+            if (rx.length > 0 && rx.data[0] != NRF_EVT_CMD_RESPONSE) {
+                nrf_parse(&rx);
+            }
+        } while (rx.length == 0 || rx.data[0] != NRF_EVT_CMD_RESPONSE);
+
+        if (rx.data[1] != NRF_CMD_READ_DYNAMIC_DATA ||
+            (rx.data[2] != ACI_STATUS_TRANSACTION_CONTINUE &&
+             rx.data[2] != ACI_STATUS_TRANSACTION_COMPLETE) ||
+            rx.length < 4 || rx.length - 3 > BOND_MSG_LEN ||
+            cnt >= BOND_MSG_MAX)
+        {
+            nrf_print_rx(&rx);
+            return -1;
+        }
+
+        /* store sequence number and data */
+        bond_write(cnt++, &rx.data[3], rx.length - 3);
+    } while (rx.data[2] == ACI_STATUS_TRANSACTION_CONTINUE);
+
+    bond_commit(cnt);
+
+    uart_print_pgm(string_bond_saved);
+    uart_putint(cnt, 1);
+    uart_newline();
+
+    return 0;
+}
+
+
+/**
+ * Send a Connect or Bond command.
+ *
+ * Both commands start advertising and share the same parameters.
+ *
+ * @param command NRF_CMD_CONNECT or NRF_CMD_BOND
+ * @param timeout Advertising timeout in seconds
+ * @param interval Advertising interval in 0.625ms units
  * @return none
  */
-void
-nrf_advertise(void)
+static void
+nrf_send_advertise(uint8_t command, uint16_t timeout, uint16_t interval)
 {
-    data16_t timeout;
+    data16_t adv_timeout;
     data16_t advival;
 
     memset(&tx, 0, sizeof(tx));
 
-    timeout.word = 0;
-    advival.word = 128;
+    adv_timeout.word = timeout;
+    advival.word = interval;
 
     tx.length = 5;
-    tx.command = NRF_CMD_CONNECT;
+    tx.command = command;
     /* send LSB first */
-    tx.data[0] = timeout.lsb;
-    tx.data[1] = timeout.msb;
+    tx.data[0] = adv_timeout.lsb;
+    tx.data[1] = adv_timeout.msb;
     tx.data[2] = advival.lsb;
     tx.data[3] = advival.msb;
 
     nrf_send(&tx);
 }
 
+/**
+ * Start advertising, waiting for remote side to connect.
+ *
+ * If the advertising timeout expires without a connection, a
+ * DisconnectedEvent with ACI_STATUS_ERROR_ADVT_TIMEOUT status is sent.
+ *
+ * @param timeout Advertising timeout in seconds, 0 for no timeout
+ * @param interval Advertising interval in 0.625ms units
+ * @return none
+ */
+void
+nrf_advertise(uint16_t timeout, uint16_t interval)
+{
+    nrf_send_advertise(NRF_CMD_CONNECT, timeout, interval);
+}
+
+/**
+ * Start advertising and bond with the central that connects.
+ *
+ * Like nrf_advertise(), but the Bond command only accepts timeouts from 1
+ * to 180 seconds, longer ones are limited accordingly. The result is sent
+ * in a BondStatusEvent.
+ *
+ * @param timeout Advertising timeout in seconds, 0 for the longest timeout
+ * @param interval Advertising interval in 0.625ms units
+ * @return none
+ */
+void
+nrf_bond(uint16_t timeout, uint16_t interval)
+{
+    if (timeout == 0 || timeout > NRF_BOND_TIMEOUT_MAX) {
+        timeout = NRF_BOND_TIMEOUT_MAX;
+    }
+
+    nrf_send_advertise(NRF_CMD_BOND, timeout, interval);
+}
+
+/**
+ * Include all broadcast pipes in the advertising data.
+ *
+ * Sends an OpenAdvPipe command with a bitmap of all ACI_TX_BROADCAST
+ * pipes. Their values, as set with SetLocalData, are advertised from the
+ * next Connect, Bond or Broadcast command on.
+ *
+ * @param none
+ * @return number of broadcast pipes
+ */
+uint8_t
+nrf_open_adv_pipes(void)
+{
+    uint8_t count = 0;
+    uint8_t pipe;
+
+    memset(&tx, 0, sizeof(tx));
+
+    for (pipe = 1; pipe <= NUMBER_OF_PIPES; pipe++) {
+        if (nrf_pipe_type(pipe) & ACI_TX_BROADCAST) {
+            tx.data[pipe >> 3] |= (1 << (pipe & 0x07));
+            count++;
+        }
+    }
+
+    if (count > 0) {
+        tx.length = 9;
+        tx.command = NRF_CMD_OPEN_ADV_PIPE;
+        nrf_send(&tx);
+    }
+
+    return count;
+}
+
+/**
+ * Start non-connectable advertising.
+ *
+ * Any observer can read the broadcast pipe values from the advertising
+ * data, but no central can connect. Once the timeout expires, a
+ * DisconnectedEvent with ACI_STATUS_ERROR_ADVT_TIMEOUT status is sent.
+ *
+ * @param timeout Broadcast timeout in seconds, 0 for no timeout
+ * @param interval Advertising interval in 0.625ms units, at least 160
+ * @return none
+ */
+void
+nrf_broadcast(uint16_t timeout, uint16_t interval)
+{
+    nrf_send_advertise(NRF_CMD_BROADCAST, timeout, interval);
+}
+
+/**
+ * Put the module to sleep.
+ *
+ * Only valid in standby mode, i.e. while neither connected nor
+ * advertising. The module stays asleep until nrf_wakeup() is called.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_sleep(void)
+{
+    memset(&tx, 0, sizeof(tx));
+    tx.length = 1;
+    tx.command = NRF_CMD_SLEEP;
+    nrf_send(&tx);
+
+    nrf_connect_state = NRF_STATE_SLEEP;
+    if (nrf_cur == 0) {
+        lifecycle_sleep();
+    }
+}
+
+/**
+ * Wake up the module from sleep.
+ *
+ * The module answers with a DeviceStartedEvent, which brings the state
+ * back to NRF_STATE_DISCONNECT in nrf_parse().
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_wakeup(void)
+{
+    if (nrf_connect_state != NRF_STATE_SLEEP) {
+        return;
+    }
+
+    memset(&tx, 0, sizeof(tx));
+    tx.length = 1;
+    tx.command = NRF_CMD_WAKEUP;
+    nrf_send(&tx);
+}
+
 
 /*
  * ACI pipe closing handling
@@ -208,7 +643,8 @@ uint64_t nrf_tx_pipe_map;
 /**
  * Set up nrf_tx_pipe_map bitfield.
  *
- * All pipes defined as ACI_STORE_LOCAL and ACI_TX are added to the bitfield.
+ * All pipes defined as ACI_STORE_LOCAL and ACI_TX or ACI_TX_ACK are added
+ * to the bitfield.
  *
  * @param none
  * @return none
@@ -220,9 +656,10 @@ nrf_tx_map_pipes(void)
 
     for (i = 0; i < NUMBER_OF_PIPES; i++) {
         if (service_pipe_map[i].store == ACI_STORE_LOCAL &&
-            service_pipe_map[i].type == ACI_TX)
+            (service_pipe_map[i].type == ACI_TX ||
+             service_pipe_map[i].type == ACI_TX_ACK))
         {
-            nrf_tx_pipe_map |= 1 << (i + 1);
+            nrf_tx_pipe_map |= (uint64_t) 1 << (i + 1);
         }
     }
 }
@@ -244,7 +681,7 @@ nrf_close_tx_pipes(void)
     pipes_open &= ~(nrf_tx_pipe_map);
     uart_print_pgm(string_pipes_open);
     for (i = 1; i <= NUMBER_OF_PIPES; i++) {
-        if (pipes_open & (1 << i)) {
+        if (pipes_open & ((uint64_t) 1 << i)) {
             uart_putint(i, 1);
             uart_putchar(' ');
         }
@@ -253,208 +690,1229 @@ nrf_close_tx_pipes(void)
 }
 
 
+/*
+ * ACI TX pipe send cache
+ *
+ * For state-like characteristics, only the latest value is of interest.
+ * Each TX pipe therefore has a shadow buffer holding the latest value
+ * written to it, flagged dirty until the value is actually sent. A new
+ * write simply overwrites an unsent value, and dirty pipes are flushed
+ * whenever data credits are available and the pipe is open. No matter
+ * how often a value changes, each pipe costs at most one packet per flush.
+ */
 
-/* Dummy tx and rx data structures */
-static struct nrf_tx dummy_tx;
-static struct nrf_rx dummy_rx;
+struct nrf_tx_cache {
+    uint8_t dirty;
+    uint8_t length;
+    uint8_t data[ACI_PIPE_TX_DATA_MAX_LEN];
+};
+
+/* Cached values, indexed by pipe number - 1 */
+static struct nrf_tx_cache tx_cache[NUMBER_OF_PIPES];
+static uint16_t tx_cache_writes;
+static uint16_t tx_cache_packets;
 
 /**
- * nRF8001 transmission function.
- * Send and simultaniously receive data to and from the nRF8001 module.
- * Note, received data is always related to a previous transmission or
- * an otherwise asynchronous event, but will never be the direct result of
- * the call in progress. If data is expected to be sent from the nRF8001
- * module afterwards, a subsequent transmit call has to be made in order to
- * receive the data. But keep in mind that asynchronous data might be sent,
- * so ignoring the received data during a send-only operation is not
- * recommended.
- *
- * In cases where received data really can be safely ignored, or no data
- * has to be trasmitted in the first place, but only received, NULL values
- * can be given for the tx and rx parameter respectively. In addition, two
- * macros exist as a shortcut for these cases:
- *      nrf_send(struct nrf_tx *)       for send-only
- *      nrf_receive(struct nrf_rx *)    for receive-only
- *
- * In addition, a third macro, nrf_txrx(struct nrf_tx *, struct nrf_rx *)
- * exists to have a sequential send and receive operation, i.e calling
- * a send-only nrf_transmit() followed directly by a receive-only one.
+ * Write a new value to the given TX pipe.
  *
- * @param tx nrf_tx structure for sending, make sure the data buffer is
- *           filled with zeroes. Can be NULL
- * @param rx nrf_rx structure for receiving, can be NULL
- * @return 0
+ * The value is stored in the pipe's send cache, replacing any value that
+ * has not been sent yet, and the cache is flushed. If the pipe is not open
+ * or no data credits are available, the value is sent once that changes.
  *
+ * @param pipe TX pipe number
+ * @param data Data to send
+ * @param length Data length, up to ACI_PIPE_TX_DATA_MAX_LEN bytes
+ * @return 0 on success, -1 if the pipe is not a TX pipe or length is invalid
  */
 int8_t
-nrf_transmit(struct nrf_tx *tx, struct nrf_rx *rx)
+nrf_pipe_write(uint8_t pipe, const uint8_t *data, uint8_t length)
 {
-    uint8_t i;
+    struct nrf_tx_cache *cache;
 
-    reqn_set_low();
-    while (rdyn_is_high()) {
-        /* wait */
-    }
-
-    /*
-     * Check if given tx struct is NULL and only rx is of interest.
-     * Use global dummy_tx struct (all fields zero) for sending.
-     */
-    if (tx == NULL) {
-        tx = &dummy_tx;
-    }
-
-    /*
-     * Check if given rx struct is NULL and only tx is of interst.
-     * Receive into global dummy_rx structure and ignore it.
-     */
-    if (rx == NULL) {
-        memset(&dummy_rx, 0, sizeof(dummy_rx));
-        rx = &dummy_rx;
+    if (!(nrf_tx_pipe_map & ((uint64_t) 1 << pipe)) ||
+        !(nrf_pipe_type(pipe) & ACI_TX) ||
+        length > ACI_PIPE_TX_DATA_MAX_LEN)
+    {
+        return -1;
     }
 
-    /*
-     * Each ACI transmission consists of at least two bytes (packet length
-     * and opcode). Each receiving package also has at least two bytes
-     * (debug byte and receiving length, which might be zero if there is
-     * no actual data available).
-     */
-    rx->debug  = spi_transmit(tx->length);
-    rx->length = spi_transmit(tx->command);
-    
-    /* Send and receive data while there is data is to send or receive */
-    for (i = 0; i < tx->length - 1 || i < rx->length; i++) {
-        rx->data[i] = spi_transmit(tx->data[i]);
+    cache = &tx_cache[pipe - 1];
+    if (cache->dirty && pipe == PIPE_EXAMPLE_SERVICE_BUTTON_STATE_TX) {
+        input_stats.coalesced++;
     }
+    memcpy(cache->data, data, length);
+    cache->length = length;
+    cache->dirty = 1;
+    tx_cache_writes++;
 
-    reqn_set_high();
-    while (rdyn_is_low()) {
-        /* wait */
+    if (!(pipes_open & ((uint64_t) 1 << pipe))) {
+        uart_print_pgm(string_pipe_closed);
     }
 
-    /*
-     * Make sure REQN inactive time (Tcwh, nRF datasheet page 26) is given.
-     * Experienced some timing issues, i.e. empty events read after requesting
-     * data (simplest case reading temperature) without a small delay here.
-     */
-    _delay_ms(1);
+    nrf_flush();
 
     return 0;
 }
 
 /**
- * Parse received data from nRF8001 module.
+ * Send a data packet on the given pipe with a SendData command.
  *
- * @param rx Data received from nRF8001 module
- * @return none
+ * Uses up one data credit. Whether the packet is sent as notification or
+ * indication depends on the pipe type.
+ *
+ * @param pipe TX or TX_ACK pipe number
+ * @param data Data to send
+ * @param length Data length, up to ACI_PIPE_TX_DATA_MAX_LEN bytes
+ * @return 0 on success, -1 if the pipe is closed, no credits are left,
+ *         or the transmission failed
  */
-void
-nrf_parse(struct nrf_rx *rx)
+int8_t
+nrf_send_data(uint8_t pipe, const uint8_t *data, uint8_t length)
 {
-    uint8_t i;
-
-    if (rx->length == 0) {
-        return;
+    if (credits == 0 || !(pipes_open & ((uint64_t) 1 << pipe))) {
+        return -1;
     }
 
-    switch (rx->data[0]) {
-        case NRF_EVT_CMD_RESPONSE:
-            if (rx->data[1] == NRF_CMD_CONNECT &&
-                rx->data[2] == NRF_ERR_NO_ERROR)
-            {
-                uart_print_pgm(string_advertising);
-            }
-            break;
-
-        case NRF_EVT_CONNECTED:
-            nrf_connect_state = NRF_STATE_CONNECTED;
-            led_connect_on();
+    memset(&tx, 0, sizeof(tx));
 
-            /* Print MAC address of new connection */
-            uart_print_pgm(string_connection);
-            for (i = 0; i < 5; i++) {
-                uart_puthex(rx->data[7 - i]);
-                uart_putchar(':');
-            }
-            uart_puthex(rx->data[8 - i]);
-            uart_newline();
-            break;
+    tx.length = length + 2;
+    tx.command = NRF_CMD_SEND_DATA;
+    tx.data[0] = pipe;
+    memcpy(&tx.data[1], data, length);
 
-        case NRF_EVT_DISCONNECTED:
-            led_connect_off();
-            nrf_close_tx_pipes();
-            nrf_connect_state = NRF_STATE_DISCONNECT;
-            break;
+    if (nrf_send(&tx) < 0) {
+        return -1;
+    }
 
-        case NRF_EVT_PIPE_STATUS:
-            /* Assemble pipes_open information from received pipe status */
-            for (pipes_open = 0, i = 0; i < 8; i++) {
-                pipes_open |= rx->data[i+1] << (8 * i);
-            }
+    credits--;
+    nrf_last_activity = sched_now();
+    nrf_data_sent++;
 
-            uart_print_pgm(string_pipes_open);
-            for (i = 1; i <= NUMBER_OF_PIPES; i++) {
-                if (pipes_open & (1 << i)) {
-                    uart_putint(i, 1);
-                    uart_putchar(' ');
-                }
-            }
-            uart_newline();
-            break;
+    return 0;
+}
 
-        case NRF_EVT_DATA_RECEIVED:
-            if (rx->data[1] == PIPE_EXAMPLE_SERVICE_PWM_DUTY_CYCLE_RX) {
-                if (rx->data[2] > 0) {
-                    OCR0A = rx->data[2];
-                    TCCR0A = 0x83; // Fast PWM (mode 4), clear on match and set on bottom
-                    TCCR0B = 0x04; // Fast PWM (mode 4), prescaler 256
-                } else {
-                    TCCR0A = 0x00;
-                    TCCR0B = 0x00;
-                    PORTD &= ~(1 << PD6);
-                }
+/**
+ * Acknowledge data received on an RX_ACK pipe with a SendDataAck command.
+ *
+ * @param pipe RX_ACK pipe number
+ * @return 0 on success, -1 if the transmission failed
+ */
+int8_t
+nrf_send_data_ack(uint8_t pipe)
+{
+    memset(&tx, 0, sizeof(tx));
+
+    tx.length = 2;
+    tx.command = NRF_CMD_SEND_DATA_ACK;
+    tx.data[0] = pipe;
+
+    return nrf_send(&tx);
+}
+
+/**
+ * Reject data received on an RX_ACK pipe with a SendDataNack command.
+ *
+ * @param pipe RX_ACK pipe number
+ * @param error ATT application error code sent to the central
+ * @return 0 on success, -1 if the transmission failed
+ */
+int8_t
+nrf_send_data_nack(uint8_t pipe, uint8_t error)
+{
+    memset(&tx, 0, sizeof(tx));
+
+    tx.length = 3;
+    tx.command = NRF_CMD_SEND_DATA_NACK;
+    tx.data[0] = pipe;
+    tx.data[1] = error;
+
+    return nrf_send(&tx);
+}
+
+/**
+ * Send queued data as far as data credits allow.
+ *
+ * Acknowledged packets go first, then message segments and sample
+ * blocks, then all dirty TX pipe values. Values of pipes that are not
+ * open are kept in the cache.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_flush(void)
+{
+    struct nrf_tx_cache *cache;
+    uint8_t pipe;
+
+    /* the send cache and all services are bound to the primary module */
+    if (nrf_cur != 0) {
+        return;
+    }
+
+    ack_flush();
+    frag_flush();
+    ota_flush();
+    adc_flush();
+
+    /* coalesce values until right before the next connection event */
+    if (nrf_tx_pending() == 0 || connevt_hold()) {
+        return;
+    }
+
+    for (pipe = 1; pipe <= NUMBER_OF_PIPES && credits > 0; pipe++) {
+        cache = &tx_cache[pipe - 1];
+
+        if (!cache->dirty) {
+            continue;
+        }
+
+        if (nrf_send_data(pipe, cache->data, cache->length) == 0) {
+            cache->dirty = 0;
+            tx_cache_packets++;
+            if (pipe == PIPE_EXAMPLE_SERVICE_BUTTON_STATE_TX) {
+                input_stats.sent++;
             }
-            break;
+        }
+    }
+}
+
+/**
+ * Return the number of TX pipe values waiting to be sent.
+ *
+ * Values of pipes the central hasn't opened stay in the cache until it
+ * does, they aren't waiting for a connection event and don't count.
+ *
+ * @param none
+ * @return number of dirty send cache entries of open pipes
+ */
+uint8_t
+nrf_tx_pending(void)
+{
+    uint8_t pipe;
+    uint8_t pending = 0;
+
+    for (pipe = 1; pipe <= NUMBER_OF_PIPES; pipe++) {
+        if (tx_cache[pipe - 1].dirty &&
+                (pipes_open & ((uint64_t) 1 << pipe)))
+        {
+            pending++;
+        }
+    }
+
+    return pending;
+}
+
+/**
+ * Print data credit and send cache statistics.
+ *
+ * The difference between writes and packets is the number of values
+ * that were overwritten before they were sent.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_print_tx_stats(void)
+{
+    uart_print_pgm(string_credits);
+    uart_putint(credits, 1);
+    uart_putchar('/');
+    uart_putint(credits_total, 1);
+    uart_print_pgm(string_writes);
+    uart_putint(tx_cache_writes, 1);
+    uart_print_pgm(string_packets);
+    uart_putint(tx_cache_packets, 1);
+    uart_newline();
+}
+
+/**
+ * Return the type of the given pipe.
+ *
+ * @param pipe Pipe number
+ * @return ACI pipe type, or 0 if the pipe does not exist
+ */
+uint16_t
+nrf_pipe_type(uint8_t pipe)
+{
+    if (pipe == 0 || pipe > NUMBER_OF_PIPES) {
+        return 0;
+    }
+
+    return service_pipe_map[pipe - 1].type;
+}
+
+/**
+ * Wait for the response to the command just sent, handling other events
+ * on the way.
+ *
+ * @param none
+ * @return 0 with the CommandResponseEvent in rx, -1 on timeout
+ */
+static int8_t
+nrf_wait_response(void)
+{
+    do {
+        memset(&rx, 0, sizeof(rx));
+        if (nrf_receive(&rx) < 0) {
+            return -1;
+        }
+        if (rx.length > 0 && rx.data[0] != NRF_EVT_CMD_RESPONSE) {
+            nrf_parse(&rx);
+        }
+    } while (rx.length == 0 || rx.data[0] != NRF_EVT_CMD_RESPONSE);
+
+    return 0;
+}
+
+/**
+ * Set the local data of the given pipe.
+ *
+ * Sends a SetLocalData command, updating the value of a characteristic
+ * with a set pipe (or a broadcast pipe) in the nRF8001 attribute table.
+ * Remote clients reading the characteristic get the new value without any
+ * notification being sent. This works whether connected or not, as long
+ * as the module is in standby mode.
+ *
+ * Waits for the command response, so the caller can keep the value and
+ * try again if the module didn't take it.
+ *
+ * @param pipe Set or broadcast pipe number
+ * @param data New characteristic value
+ * @param length Data length, up to ACI_PIPE_TX_DATA_MAX_LEN bytes
+ * @return 0 on success, -1 if the module is not in standby mode, the
+ *         transmission failed, or the module responded with an error
+ */
+int8_t
+nrf_set_local_data(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    if (opmode != NRF_OPMODE_STANDBY) {
+        return -1;
+    }
+
+    memset(&tx, 0, sizeof(tx));
+
+    tx.length = length + 2;
+    tx.command = NRF_CMD_SET_LOCAL_DATA;
+    tx.data[0] = pipe;
+    memcpy(&tx.data[1], data, length);
+
+    if (nrf_send(&tx) < 0 || nrf_wait_response() < 0) {
+        return -1;
+    }
+
+    if (rx.length < 3 || rx.data[1] != NRF_CMD_SET_LOCAL_DATA ||
+        rx.data[2] != NRF_ERR_NO_ERROR)
+    {
+        /* prints the error */
+        nrf_parse(&rx);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Flag a link fault and have the nRF task pass it on to the supervisor.
+ *
+ * Only the first fault is kept until the supervisor clears it.
+ *
+ * @param fault One of the NRF_FAULT_* values
+ * @return none
+ */
+static void
+nrf_set_fault(uint8_t fault)
+{
+    if (nrf_fault == NRF_FAULT_NONE) {
+        nrf_fault = fault;
+    }
+    sched_post(SCHED_TASK_NRF);
+}
+
+/**
+ * Wait for RDYN to reach the given level, at most NRF_RDYN_TIMEOUT_MS.
+ *
+ * The module normally answers REQN within microseconds, and releases RDYN
+ * right after the transaction, so hitting the timeout means the module
+ * is stuck, browned out or held in reset.
+ *
+ * @param high 1 to wait for RDYN high, 0 to wait for RDYN low
+ * @return 0 on success, -1 on timeout
+ */
+static int8_t
+nrf_wait_rdyn(uint8_t high)
+{
+    uint16_t i;
+
+    for (i = 0; i < NRF_RDYN_TIMEOUT_MS * 100; i++) {
+        if (!rdyn_is_high() == !high) {
+            return 0;
+        }
+        _delay_us(10);
+    }
+
+    uart_print_pgm(string_rdyn_timeout);
+    nrf_set_fault(NRF_FAULT_TIMEOUT);
+    return -1;
+}
+
+/**
+ * Handle an RDYN change, called from the pin change interrupt.
+ *
+ * Takes the time the primary module announces an event, which is when
+ * a returned data credit left the connection event, see connevt.c.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_rdyn_changed(void)
+{
+    if (!rdyn_dev_is_high(0)) {
+        nrf_rdyn_cycles = sched_cycles();
+    }
+}
+
+
+/* Dummy tx and rx data structures */
+static struct nrf_tx dummy_tx;
+static struct nrf_rx dummy_rx;
+
+/*
+ * Events received during send-only transfers. Every transfer reads in
+ * whatever event the module has pending, so these can't be ignored, a
+ * lost DataCreditEvent or DataAckEvent would stall the TX paths for good.
+ * They are handled by nrf_parse_queued() from the nRF task.
+ */
+static struct {
+    struct nrf_rx rx[NRF_EVT_QUEUE_LEN];
+    uint8_t device[NRF_EVT_QUEUE_LEN];
+    uint8_t count;
+} nrf_evt_queue;
+/* Events received with a full queue, dropped */
+static uint16_t nrf_evt_lost;
+/* Received packets with a length beyond the buffer, dropped */
+static uint16_t nrf_rx_oversized;
+/* Replaying recorded events, the module is cut off */
+static uint8_t nrf_replay;
+
+/**
+ * Cut off the module while recorded events are replayed, see replay.c.
+ *
+ * @param enable 1 to cut off the module, 0 to talk to it again
+ * @return none
+ */
+void
+nrf_set_replay(uint8_t enable)
+{
+    nrf_replay = enable;
+}
+
+/**
+ * Queue an event received during a send-only transfer, and post the nRF
+ * task to handle it.
+ *
+ * @param rx Received event
+ * @return none
+ */
+static void
+nrf_queue_event(const struct nrf_rx *rx)
+{
+    if (nrf_evt_queue.count == NRF_EVT_QUEUE_LEN) {
+        nrf_evt_lost++;
+        return;
+    }
+
+    nrf_evt_queue.rx[nrf_evt_queue.count] = *rx;
+    nrf_evt_queue.device[nrf_evt_queue.count] = nrf_cur;
+    nrf_evt_queue.count++;
+    sched_post(SCHED_TASK_NRF);
+}
+
+/**
+ * Remove the given entry from the event queue.
+ *
+ * @param index Queue entry
+ * @return none
+ */
+static void
+nrf_dequeue_event(uint8_t index)
+{
+    nrf_evt_queue.count--;
+    memmove(&nrf_evt_queue.rx[index], &nrf_evt_queue.rx[index + 1],
+            (nrf_evt_queue.count - index) * sizeof(nrf_evt_queue.rx[0]));
+    memmove(&nrf_evt_queue.device[index], &nrf_evt_queue.device[index + 1],
+            nrf_evt_queue.count - index);
+}
+
+/**
+ * Handle the queued events of the currently selected module, in the order
+ * they were received. Events queued by the handlers are handled as well.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_parse_queued(void)
+{
+    struct nrf_rx event;
+    uint8_t i = 0;
+
+    while (i < nrf_evt_queue.count) {
+        if (nrf_evt_queue.device[i] != nrf_cur) {
+            i++;
+            continue;
+        }
+
+        event = nrf_evt_queue.rx[i];
+        nrf_dequeue_event(i);
+        nrf_print_rx(&event);
+        nrf_parse(&event);
+    }
+}
+
+/**
+ * Drop the queued events of the currently selected module.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_drop_queued(void)
+{
+    uint8_t i = 0;
+
+    while (i < nrf_evt_queue.count) {
+        if (nrf_evt_queue.device[i] == nrf_cur) {
+            nrf_dequeue_event(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * nRF8001 transmission function.
+ * Send and simultaniously receive data to and from the nRF8001 module.
+ * Note, received data is always related to a previous transmission or
+ * an otherwise asynchronous event, but will never be the direct result of
+ * the call in progress. If data is expected to be sent from the nRF8001
+ * module afterwards, a subsequent transmit call has to be made in order to
+ * receive the data. But keep in mind that asynchronous data might be sent,
+ * so ignoring the received data during a send-only operation is not
+ * recommended.
+ *
+ * In cases where the caller isn't interested in received data, or no data
+ * has to be trasmitted in the first place, but only received, NULL values
+ * can be given for the tx and rx parameter respectively. An event received
+ * without rx structure is queued for nrf_parse_queued(), so it is handled
+ * later on instead of being lost. In addition, two macros exist as a
+ * shortcut for these cases:
+ *      nrf_send(struct nrf_tx *)       for send-only
+ *      nrf_receive(struct nrf_rx *)    for receive-only
+ *
+ * In addition, a third macro, nrf_txrx(struct nrf_tx *, struct nrf_rx *)
+ * exists to have a sequential send and receive operation, i.e calling
+ * a send-only nrf_transmit() followed directly by a receive-only one.
+ *
+ * Waiting for RDYN is bounded by NRF_RDYN_TIMEOUT_MS, if the module does
+ * not respond in time, the transmission is aborted and a link fault is
+ * flagged for the supervisor. Received data is not valid in that case.
+ *
+ * A received length beyond NRF_DATA_MAX is reported as empty packet.
+ *
+ * @param tx nrf_tx structure for sending, make sure the data buffer is
+ *           filled with zeroes. Can be NULL
+ * @param rx nrf_rx structure for receiving, can be NULL
+ * @return 0 on success, -1 on RDYN timeout
+ *
+ */
+int8_t
+nrf_transmit(struct nrf_tx *tx, struct nrf_rx *rx)
+{
+    uint8_t count;
+    uint8_t i;
+
+    if (nrf_replay) {
+        if (rx != NULL) {
+            rx->length = 0;
+        }
+        return 0;
+    }
+
+    /* the RDYN timeout and the delays below assume F_CPU */
+    clock_full();
+
+    reqn_set_low();
+    if (nrf_wait_rdyn(0) < 0) {
+        reqn_set_high();
+        if (rx != NULL) {
+            rx->length = 0;
+        }
+        return -1;
+    }
+
+    /*
+     * Check if given tx struct is NULL and only rx is of interest.
+     * Use global dummy_tx struct (all fields zero) for sending.
+     */
+    if (tx == NULL) {
+        tx = &dummy_tx;
+    }
+
+    /*
+     * Check if given rx struct is NULL and only tx is of interst.
+     * Receive into global dummy_rx structure and queue any event in it.
+     */
+    if (rx == NULL) {
+        memset(&dummy_rx, 0, sizeof(dummy_rx));
+        rx = &dummy_rx;
+    }
+
+    /*
+     * Each ACI transmission consists of at least two bytes (packet length
+     * and opcode). Each receiving package also has at least two bytes
+     * (debug byte and receiving length, which might be zero if there is
+     * no actual data available).
+     */
+    rx->debug  = spi_transmit(tx->length);
+    rx->length = spi_transmit(tx->command);
+
+    /*
+     * Send and receive data while there is data is to send or receive.
+     * The nRF8001 never sends more than the buffer holds, a longer length
+     * can only be line noise. The transfer is cut at the buffer size and
+     * the packet is dropped.
+     */
+    count = (tx->length > 0) ? tx->length - 1 : 0;
+    if (rx->length > count) {
+        count = rx->length;
+    }
+    if (count > NRF_DATA_MAX) {
+        count = NRF_DATA_MAX;
+    }
+
+    for (i = 0; i < count; i++) {
+        rx->data[i] = spi_transmit(tx->data[i]);
+    }
+
+    if (rx->length > NRF_DATA_MAX) {
+        nrf_rx_oversized++;
+        rx->length = 0;
+    }
+
+    if (rx == &dummy_rx && rx->length > 0) {
+        nrf_queue_event(rx);
+    }
+
+    reqn_set_high();
+    if (nrf_wait_rdyn(1) < 0) {
+        return -1;
+    }
+
+    /*
+     * Make sure REQN inactive time (Tcwh, nRF datasheet page 26) is given.
+     * Experienced some timing issues, i.e. empty events read after requesting
+     * data (simplest case reading temperature) without a small delay here.
+     */
+    _delay_ms(1);
+
+    return 0;
+}
+
+/*
+ * ACI event decoding
+ *
+ * Events are dispatched through a flash-resident table indexed by the low
+ * nibble of the opcode, with slot 0 (opcode 0x80, not a valid event)
+ * handling everything outside 0x80-0x8f. Each slot holds the minimum event
+ * length, counting the opcode, and the handler to call. Events that are too
+ * short for their handler are treated like unknown ones, so every event
+ * takes the same path: one table lookup, one length check, one call.
+ *
+ * Handlers get the received data as struct nrf_event, which overlays the
+ * typed payload of each event on the raw data.
+ *
+ * Each call is timed using the scheduler's cycle counter, with its clk/64
+ * resolution, and accumulated per slot.
+ */
+
+/* Events shorter than required for their opcode */
+static uint16_t nrf_evt_malformed;
+static struct nrf_evt_stats nrf_evt_stats[NRF_EVT_SLOTS];
+
+/**
+ * Handle DeviceStartedEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_device_started(const struct nrf_event *evt, uint8_t length)
+{
+    (void) length;
+
+    opmode = evt->device_started.opmode;
+    credits = credits_total = evt->device_started.credits;
+    if (opmode == NRF_OPMODE_STANDBY && nrf_connect_state == NRF_STATE_SLEEP) {
+        /* woken up from sleep, start over */
+        nrf_connect_state = NRF_STATE_DISCONNECT;
+        nrf_disconnect_status = ACI_STATUS_SUCCESS;
+    }
+}
+
+/**
+ * Handle EchoEvent, print the echoed data.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_echo(const struct nrf_event *evt, uint8_t length)
+{
+    uint8_t i;
+
+    uart_print_pgm(string_echo);
+    for (i = 0; i < length - 1; i++) {
+        uart_putchar(' ');
+        uart_puthex(evt->echo.data[i]);
+    }
+    uart_newline();
+}
+
+/**
+ * Handle HwErrorEvent.
+ *
+ * Prints the line number and file name of the module's firmware assert
+ * and flags a link fault, the module needs a reset after it.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_hw_error(const struct nrf_event *evt, uint8_t length)
+{
+    uint8_t i;
+
+    uart_print_pgm(string_hw_error);
+    uart_putint(evt->hw_error.line, 1);
+    uart_putchar(' ');
+    for (i = 0; i < length - 3; i++) {
+        uart_putchar(evt->hw_error.file[i]);
+    }
+    uart_newline();
+    nrf_set_fault(NRF_FAULT_HW_ERROR);
+}
+
+/**
+ * Handle CommandResponseEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_cmd_response(const struct nrf_event *evt, uint8_t length)
+{
+    uint8_t command = evt->cmd_response.command;
+    uint8_t status = evt->cmd_response.status;
+
+    (void) length;
+
+    if ((command == NRF_CMD_CONNECT || command == NRF_CMD_BOND) &&
+        status == NRF_ERR_NO_ERROR)
+    {
+        uart_print_pgm(string_advertising);
+        if (nrf_cur == 0) {
+            lifecycle_advertising();
+        }
+    } else if (command == NRF_CMD_BROADCAST && status == NRF_ERR_NO_ERROR) {
+        uart_print_pgm(string_broadcasting);
+    } else if (status >= ACI_STATUS_ERROR_UNKNOWN) {
+        uart_print_pgm(string_cmd_error);
+        uart_puthex(command);
+        uart_putchar(' ');
+        uart_puthex(status);
+        uart_newline();
+    }
+}
 
-        default:
-            uart_print_pgm(string_received);
-            for (i = 0; i < rx->length; i++) {
-                uart_putchar(' ');
-                uart_puthex(rx->data[i]);
-            }
-            uart_newline();
-            
+/**
+ * Handle ConnectedEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_connected(const struct nrf_event *evt, uint8_t length)
+{
+    uint8_t i;
+
+    (void) length;
+
+    nrf_connect_state = NRF_STATE_CONNECTED;
+    led_connect_on();
+
+    /* Print MAC address of new connection, sent LSB first */
+    uart_print_pgm(string_connection);
+    for (i = 5; i > 0; i--) {
+        uart_puthex(evt->connected.address[i]);
+        uart_putchar(':');
+    }
+    uart_puthex(evt->connected.address[0]);
+    uart_newline();
+
+    nrf_timing.interval = evt->connected.interval;
+    nrf_timing.latency  = evt->connected.latency;
+    nrf_timing.timeout  = evt->connected.timeout;
+    nrf_last_activity = sched_now();
+    if (nrf_cur == 0) {
+        connevt_start(nrf_timing.interval);
+        lifecycle_connected();
     }
+    nrf_print_timing();
 }
 
+/**
+ * Handle DisconnectedEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_disconnected(const struct nrf_event *evt, uint8_t length)
+{
+    (void) length;
+
+    nrf_disconnect_status = evt->disconnected.aci_status;
+    led_connect_off();
+    nrf_close_tx_pipes();
+    nrf_connect_state = NRF_STATE_DISCONNECT;
+    /* all outstanding data credits are returned on disconnect */
+    credits = credits_total;
+    if (nrf_cur == 0) {
+        ack_disconnected();
+        frag_disconnected();
+        ota_disconnected();
+        adc_stop();
+        connevt_stop();
+        lifecycle_disconnected(evt->disconnected.aci_status,
+                evt->disconnected.btle_status);
+    }
+}
 
 /**
- * Send the given button state to the remote side.
+ * Handle BondStatusEvent.
  *
- * If the button state tx pipe is not open (i.e. remote side is not waiting
- * for notifications about the new state), nothing will happen.
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_bond_status(const struct nrf_event *evt, uint8_t length)
+{
+    (void) length;
+
+    uart_print_pgm(string_bond_status);
+    uart_puthex(evt->bond_status.status);
+    uart_newline();
+    if (evt->bond_status.status == ACI_BOND_STATUS_SUCCESS) {
+        bonded = 1;
+    }
+}
+
+/**
+ * Handle PipeStatusEvent.
  *
- * @param button Button state to send
- * @return 0 on success, -1 if tx pipe is closed
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
  */
-int8_t
-nrf_send_button_data(uint8_t button)
+static void
+nrf_evt_pipe_status(const struct nrf_event *evt, uint8_t length)
 {
-    if (!(pipes_open & (1 << PIPE_EXAMPLE_SERVICE_BUTTON_STATE_TX))) {
-        uart_print_pgm(string_pipe_closed);
-        return -1;
+    uint8_t i;
+
+    (void) length;
+
+    /* Assemble pipes_open information from received pipe status */
+    for (pipes_open = 0, i = 0; i < 8; i++) {
+        pipes_open |= (uint64_t) evt->pipe_status.open[i] << (8 * i);
     }
 
-    memset(&tx, 0, sizeof(tx));
+    uart_print_pgm(string_pipes_open);
+    for (i = 1; i <= NUMBER_OF_PIPES; i++) {
+        if (pipes_open & ((uint64_t) 1 << i)) {
+            uart_putint(i, 1);
+            uart_putchar(' ');
+        }
+    }
+    uart_newline();
+    if (nrf_cur == 0) {
+        lifecycle_pipes((pipes_open & nrf_tx_pipe_map) != 0);
+    }
+    nrf_flush();
+}
 
-    tx.length = 3;
-    tx.command = NRF_CMD_SEND_DATA;
-    tx.data[0] = PIPE_EXAMPLE_SERVICE_BUTTON_STATE_TX;
-    tx.data[1] = button;
+/**
+ * Handle TimingEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_timing(const struct nrf_event *evt, uint8_t length)
+{
+    (void) length;
 
-    nrf_send(&tx);
+    nrf_timing.interval = evt->timing.interval;
+    nrf_timing.latency  = evt->timing.latency;
+    nrf_timing.timeout  = evt->timing.timeout;
+    if (nrf_cur == 0) {
+        connevt_start(nrf_timing.interval);
+    }
+    nrf_print_timing();
+}
 
-    return 0;
+/**
+ * Handle DataCreditEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_data_credit(const struct nrf_event *evt, uint8_t length)
+{
+    uint32_t cycles;
+
+    (void) length;
+
+    credits += evt->data_credit.credits;
+    if (nrf_cur == 0) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            cycles = nrf_rdyn_cycles;
+        }
+        connevt_observe(cycles);
+    }
+    nrf_flush();
+}
+
+/**
+ * Handle DataAckEvent, sent for acknowledged TX_ACK pipe packets.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_data_ack(const struct nrf_event *evt, uint8_t length)
+{
+    (void) length;
+
+    if (nrf_cur == 0) {
+        ack_received(evt->data_ack.pipe);
+    }
+}
+
+/**
+ * Handle DataReceivedEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_data_received(const struct nrf_event *evt, uint8_t length)
+{
+    nrf_last_activity = sched_now();
+
+    /* additional modules have no services, just answer write requests */
+    if (nrf_cur != 0) {
+        if (nrf_pipe_type(evt->data_received.pipe) & ACI_RX_ACK) {
+            nrf_send_data_ack(evt->data_received.pipe);
+        }
+        return;
+    }
+
+    if (nrf_pipe_type(evt->data_received.pipe) & ACI_RX_ACK) {
+        ack_rx_received(evt->data_received.pipe,
+                evt->data_received.data, length - 2);
+        return;
+    }
+
+    if (frag_received(evt->data_received.pipe,
+                evt->data_received.data, length - 2) == 0)
+    {
+        return;
+    }
+
+    if (ota_received(evt->data_received.pipe,
+                evt->data_received.data, length - 2) == 0)
+    {
+        return;
+    }
+
+    if (adc_received(evt->data_received.pipe,
+                evt->data_received.data, length - 2) == 0)
+    {
+        return;
+    }
+
+    if (evt->data_received.pipe == PIPE_EXAMPLE_SERVICE_PWM_DUTY_CYCLE_RX) {
+        pwm_command(evt->data_received.data, length - 2);
+    }
+}
+
+/**
+ * Handle PipeErrorEvent.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_pipe_error(const struct nrf_event *evt, uint8_t length)
+{
+    (void) length;
+
+    uart_print_pgm(string_pipe_error);
+    uart_putint(evt->pipe_error.pipe, 1);
+    uart_putchar(' ');
+    uart_puthex(evt->pipe_error.error);
+    uart_newline();
+    /* the packet was not sent, so its data credit is available again */
+    if (evt->pipe_error.error != ACI_STATUS_ERROR_PEER_ATT_ERROR) {
+        credits++;
+    }
+
+    if (nrf_cur == 0 && (nrf_pipe_type(evt->pipe_error.pipe) & ACI_TX_ACK)) {
+        ack_error(evt->pipe_error.pipe, evt->pipe_error.error);
+    }
+}
+
+/**
+ * Handle DisplayKeyEvent, print the passkey to enter on the central.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_display_key(const struct nrf_event *evt, uint8_t length)
+{
+    uint8_t i;
+
+    (void) length;
+
+    uart_print_pgm(string_passkey);
+    for (i = 0; i < sizeof(evt->display_key.passkey); i++) {
+        uart_putchar(evt->display_key.passkey[i]);
+    }
+    uart_newline();
+}
+
+/**
+ * Handle KeyRequestEvent.
+ *
+ * There is no way to enter a key on this device, so just report it. The
+ * bonding procedure fails with a timeout.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_key_request(const struct nrf_event *evt, uint8_t length)
+{
+    (void) length;
+
+    uart_print_pgm(string_key_request);
+    uart_puthex(evt->key_request.key_type);
+    uart_newline();
+}
+
+/**
+ * Handle unknown and malformed events, dump their data.
+ *
+ * @param evt Received event
+ * @param length Event length including opcode
+ * @return none
+ */
+static void
+nrf_evt_unknown(const struct nrf_event *evt, uint8_t length)
+{
+    const uint8_t *data = (const uint8_t *) evt;
+    uint8_t i;
+
+    uart_print_pgm(string_received);
+    for (i = 0; i < length; i++) {
+        uart_putchar(' ');
+        uart_puthex(data[i]);
+    }
+    uart_newline();
+}
+
+struct nrf_evt_entry {
+    uint8_t min_length;     /* including opcode */
+    nrf_evt_handler_t handler;
+};
+
+/* Event handlers, indexed by opcode - NRF_EVT_BASE */
+static const struct nrf_evt_entry nrf_evt_table[NRF_EVT_SLOTS] PROGMEM = {
+    { 0,                                nrf_evt_unknown },
+    { NRF_EVT_LEN(device_started),      nrf_evt_device_started },
+    { 1,                                nrf_evt_echo },
+    { 3,                                nrf_evt_hw_error },
+    { 3,                                nrf_evt_cmd_response },
+    { NRF_EVT_LEN(connected),           nrf_evt_connected },
+    { NRF_EVT_LEN(disconnected),        nrf_evt_disconnected },
+    { NRF_EVT_LEN(bond_status),         nrf_evt_bond_status },
+    { NRF_EVT_LEN(pipe_status),         nrf_evt_pipe_status },
+    { NRF_EVT_LEN(timing),              nrf_evt_timing },
+    { NRF_EVT_LEN(data_credit),         nrf_evt_data_credit },
+    { NRF_EVT_LEN(data_ack),            nrf_evt_data_ack },
+    { 2,                                nrf_evt_data_received },
+    { 3,                                nrf_evt_pipe_error },
+    { NRF_EVT_LEN(display_key),         nrf_evt_display_key },
+    { NRF_EVT_LEN(key_request),         nrf_evt_key_request },
+};
+
+/**
+ * Parse received data from nRF8001 module.
+ *
+ * Validates the event length and calls the event's handler from the
+ * event table, see above.
+ *
+ * @param rx Data received from nRF8001 module
+ * @return none
+ */
+void
+nrf_parse(struct nrf_rx *rx)
+{
+    const struct nrf_event *evt = (const struct nrf_event *) rx->data;
+    struct nrf_evt_stats *stats;
+    nrf_evt_handler_t handler;
+    uint32_t start;
+    uint32_t cycles;
+    uint8_t slot;
+
+    if (rx->length == 0) {
+        return;
+    }
+
+    start = sched_cycles();
+
+    slot = ((evt->opcode & ~NRF_EVT_MASK) == NRF_EVT_BASE) ?
+            (evt->opcode & NRF_EVT_MASK) : 0;
+    if (rx->length < pgm_read_byte(&nrf_evt_table[slot].min_length)) {
+        nrf_evt_malformed++;
+        slot = 0;
+    }
+
+    handler = (nrf_evt_handler_t) pgm_read_ptr(&nrf_evt_table[slot].handler);
+    handler(evt, rx->length);
+
+    cycles = (sched_cycles() - start) / SCHED_CYCLES_RESOLUTION;
+    stats = &nrf_evt_stats[slot];
+    stats->count++;
+    stats->cycles += cycles;
+    if (cycles > stats->cycles_max) {
+        stats->cycles_max = (cycles > 0xffff) ? 0xffff : cycles;
+    }
+}
+
+/**
+ * Print the event statistics.
+ *
+ * For each event type that was received, prints the opcode, the number
+ * of events, and the mean and maximum number of CPU cycles it took to
+ * decode and handle them. Console output done by the handlers is part
+ * of that, so the numbers show the real cost of each event as is.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_print_evt_stats(void)
+{
+    struct nrf_evt_stats *stats;
+    uint8_t slot;
+
+    for (slot = 0; slot < NRF_EVT_SLOTS; slot++) {
+        stats = &nrf_evt_stats[slot];
+        if (stats->count == 0) {
+            continue;
+        }
+
+        uart_puthex(NRF_EVT_BASE | slot);
+        uart_print_pgm(string_evt_count);
+        uart_putint(stats->count, 1);
+        uart_print_pgm(string_evt_mean);
+        uart_putint(stats->cycles / stats->count * SCHED_CYCLES_RESOLUTION, 1);
+        uart_print_pgm(string_evt_max);
+        uart_putint((uint32_t) stats->cycles_max * SCHED_CYCLES_RESOLUTION, 1);
+        uart_newline();
+    }
+
+    uart_print_pgm(string_evt_malformed);
+    uart_putint(nrf_evt_malformed, 1);
+    uart_print_pgm(string_evt_oversized);
+    uart_putint(nrf_rx_oversized, 1);
+    uart_print_pgm(string_evt_lost);
+    uart_putint(nrf_evt_lost, 1);
+    uart_newline();
+}
+
+
+/**
+ * Print the link state in one line: connection state, credits, open pipes
+ * and fault.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_print_state(void)
+{
+    int8_t i;
+
+    uart_print_pgm(string_state);
+    uart_putint(nrf_connect_state, 1);
+    uart_print_pgm(string_state_credits);
+    uart_putint(credits, 1);
+    uart_putchar('/');
+    uart_putint(credits_total, 1);
+    uart_print_pgm(string_state_pipes);
+    for (i = 7; i >= 0; i--) {
+        uart_puthex(pipes_open >> (8 * i));
+    }
+    uart_print_pgm(string_state_fault);
+    uart_putint(nrf_fault, 1);
+    uart_newline();
+}
+
+/**
+ * Send the given button state to the remote side.
+ *
+ * The state is written to the button state pipe's send cache, so if the
+ * tx pipe is not open (i.e. remote side is not waiting for notifications
+ * about the new state) yet, the latest state is sent once it is opened.
+ *
+ * @param button Button state to send
+ * @return 0 on success, -1 on error
+ */
+int8_t
+nrf_send_button_data(uint8_t button)
+{
+    return nrf_pipe_write(PIPE_EXAMPLE_SERVICE_BUTTON_STATE_TX, &button, 1);
 }
 
 /**
@@ -481,6 +1939,63 @@ nrf_print_rx(struct nrf_rx *rx)
     uart_newline();
 }
 
+/**
+ * Request new connection parameters from the remote side.
+ *
+ * Sends a ChangeTimingRequest command. The central decides on the actual
+ * parameters, which are reported with a TimingEvent once in effect.
+ *
+ * @param min_interval Minimum connection interval, 1.25ms units
+ * @param max_interval Maximum connection interval, 1.25ms units
+ * @param latency Slave latency, connection events
+ * @param timeout Supervision timeout, 10ms units
+ * @return 0 on success, -1 if not connected
+ */
+int8_t
+nrf_change_timing(uint16_t min_interval, uint16_t max_interval,
+        uint16_t latency, uint16_t timeout)
+{
+    if (nrf_connect_state != NRF_STATE_CONNECTED) {
+        return -1;
+    }
+
+    memset(&tx, 0, sizeof(tx));
+
+    tx.length = 9;
+    tx.command = NRF_CMD_CHANGE_TIMING;
+    /* send LSB first */
+    tx.data[0] = min_interval & 0xff;
+    tx.data[1] = min_interval >> 8;
+    tx.data[2] = max_interval & 0xff;
+    tx.data[3] = max_interval >> 8;
+    tx.data[4] = latency & 0xff;
+    tx.data[5] = latency >> 8;
+    tx.data[6] = timeout & 0xff;
+    tx.data[7] = timeout >> 8;
+
+    nrf_send(&tx);
+
+    return 0;
+}
+
+/**
+ * Print the negotiated connection parameters.
+ *
+ * @param none
+ * @return none
+ */
+void
+nrf_print_timing(void)
+{
+    uart_print_pgm(string_timing);
+    uart_putint(nrf_timing.interval * 1250UL, 1);
+    uart_print_pgm(string_latency);
+    uart_putint(nrf_timing.latency, 1);
+    uart_print_pgm(string_timeout);
+    uart_putint(nrf_timing.timeout * 10UL, 1);
+    uart_print_pgm(string_ms);
+}
+
 /**
  * Print the nRF8001 module's on-chip temperature.
  *
@@ -500,7 +2015,19 @@ nrf_print_temperature(void)
 
     tx.length = 0x01;
     tx.command = NRF_CMD_GET_TEMPERATURE;
-    nrf_txrx(&tx, &rx);
+    if (nrf_send(&tx) < 0) {
+        return;
+    }
+
+    if (nrf_wait_response() < 0) {
+        return;
+    }
+
+    if (rx.length < 5 || rx.data[1] != NRF_CMD_GET_TEMPERATURE)
+    {
+        nrf_print_rx(&rx);
+        return;
+    }
 
     raw.lsb = rx.data[3];
     raw.msb = rx.data[4];
@@ -9,6 +9,7 @@
 #ifndef _NRF_H_
 #define _NRF_H_
 
+#include <avr/io.h>
 #include "nrf/services.h"
 
 #define NRF_OPMODE_TEST     0x01
@@ -18,18 +19,58 @@
 #define NRF_STATE_DISCONNECT 0x00
 #define NRF_STATE_CONNECTING 0x01
 #define NRF_STATE_CONNECTED  0x02
+#define NRF_STATE_SLEEP      0x03
 
+#define NRF_CMD_SLEEP           0x04
+#define NRF_CMD_WAKEUP          0x05
 #define NRF_CMD_SETUP           0x06
+#define NRF_CMD_READ_DYNAMIC_DATA  0x07
+#define NRF_CMD_WRITE_DYNAMIC_DATA 0x08
 #define NRF_CMD_GET_TEMPERATURE 0x0c
+#define NRF_CMD_SET_LOCAL_DATA  0x0d
 #define NRF_CMD_CONNECT         0x0f
+#define NRF_CMD_BOND            0x10
+#define NRF_CMD_CHANGE_TIMING   0x13
 #define NRF_CMD_SEND_DATA       0x15
+#define NRF_CMD_SEND_DATA_ACK   0x16
+#define NRF_CMD_SEND_DATA_NACK  0x18
+#define NRF_CMD_OPEN_ADV_PIPE   0x1b
+#define NRF_CMD_BROADCAST       0x1c
 #define NRF_ERR_NO_ERROR        0x00
+#define NRF_BOND_TIMEOUT_MAX    180
 #define NRF_EVT_DEVICE_STARTED  0x81
+#define NRF_EVT_ECHO            0x82
+#define NRF_EVT_HW_ERROR        0x83
 #define NRF_EVT_CMD_RESPONSE    0x84
 #define NRF_EVT_CONNECTED       0x85
 #define NRF_EVT_DISCONNECTED    0x86
+#define NRF_EVT_BOND_STATUS     0x87
 #define NRF_EVT_PIPE_STATUS     0x88
+#define NRF_EVT_TIMING          0x89
+#define NRF_EVT_DATA_CREDIT     0x8a
+#define NRF_EVT_DATA_ACK        0x8b
 #define NRF_EVT_DATA_RECEIVED   0x8c
+#define NRF_EVT_PIPE_ERROR      0x8d
+#define NRF_EVT_DISPLAY_KEY     0x8e
+#define NRF_EVT_KEY_REQUEST     0x8f
+
+/* Event opcodes are NRF_EVT_BASE | slot, slot 0 is used for unknown events */
+#define NRF_EVT_BASE            0x80
+#define NRF_EVT_MASK            0x0f
+#define NRF_EVT_SLOTS           16
+
+/* Link faults, handled by the supervisor */
+#define NRF_FAULT_NONE          0
+#define NRF_FAULT_TIMEOUT       1   /* RDYN did not respond in time */
+#define NRF_FAULT_HW_ERROR      2   /* HwErrorEvent received */
+#define NRF_FAULT_SETUP         3   /* setup after reset failed */
+
+/* Longest wait for RDYN to respond to REQN or to be released again */
+#ifndef NRF_RDYN_TIMEOUT_MS
+#define NRF_RDYN_TIMEOUT_MS     50
+#endif
+/* Most events to skip while waiting for the final DeviceStartedEvent */
+#define NRF_SETUP_EVENTS_MAX    8
 
 typedef union {
     uint8_t byte[2]; /* byte[0] = lsb, byte[1] = msb */
@@ -41,52 +82,296 @@ typedef union {
     };
 } data16_t;
 
+/* Connection parameters, as reported by Connected and Timing events */
+struct nrf_timing {
+    uint16_t interval;  /* connection interval, 1.25ms units */
+    uint16_t latency;   /* slave latency, connection events */
+    uint16_t timeout;   /* supervision timeout, 10ms units */
+};
+
+/*
+ * Decoded ACI events, as received after the opcode. Multi-byte values are
+ * sent LSB first, same as the AVR stores them, and all structs are packed.
+ */
+struct nrf_evt_device_started {
+    uint8_t opmode;
+    uint8_t hw_error;
+    uint8_t credits;
+};
+
+struct nrf_evt_echo {
+    uint8_t data[29];
+};
+
+struct nrf_evt_hw_error {
+    uint16_t line;
+    uint8_t file[27];
+};
+
+struct nrf_evt_cmd_response {
+    uint8_t command;
+    uint8_t status;
+    uint8_t data[27];
+};
+
+struct nrf_evt_connected {
+    uint8_t address_type;
+    uint8_t address[6];     /* LSB first */
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t timeout;
+    uint8_t clock_accuracy;
+};
+
+struct nrf_evt_disconnected {
+    uint8_t aci_status;
+    uint8_t btle_status;
+};
+
+struct nrf_evt_bond_status {
+    uint8_t status;
+    uint8_t source;
+    uint8_t secmode1;
+    uint8_t secmode2;
+    uint8_t keys_slave;
+    uint8_t keys_master;
+};
+
+struct nrf_evt_pipe_status {
+    uint8_t open[8];
+    uint8_t closed[8];
+};
+
+struct nrf_evt_timing {
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t timeout;
+};
+
+struct nrf_evt_data_credit {
+    uint8_t credits;
+};
+
+struct nrf_evt_data_ack {
+    uint8_t pipe;
+};
+
+struct nrf_evt_data_received {
+    uint8_t pipe;
+    uint8_t data[28];
+};
+
+struct nrf_evt_pipe_error {
+    uint8_t pipe;
+    uint8_t error;
+    uint8_t data[27];
+};
+
+struct nrf_evt_display_key {
+    uint8_t passkey[6];     /* ASCII digits */
+};
+
+struct nrf_evt_key_request {
+    uint8_t key_type;
+};
+
+/* Received event data, starting with the opcode */
+struct nrf_event {
+    uint8_t opcode;
+    union {
+        struct nrf_evt_device_started device_started;
+        struct nrf_evt_echo echo;
+        struct nrf_evt_hw_error hw_error;
+        struct nrf_evt_cmd_response cmd_response;
+        struct nrf_evt_connected connected;
+        struct nrf_evt_disconnected disconnected;
+        struct nrf_evt_bond_status bond_status;
+        struct nrf_evt_pipe_status pipe_status;
+        struct nrf_evt_timing timing;
+        struct nrf_evt_data_credit data_credit;
+        struct nrf_evt_data_ack data_ack;
+        struct nrf_evt_data_received data_received;
+        struct nrf_evt_pipe_error pipe_error;
+        struct nrf_evt_display_key display_key;
+        struct nrf_evt_key_request key_request;
+    };
+};
+
+/* Minimum length of an event, including the opcode */
+#define NRF_EVT_LEN(member) (1 + sizeof(((struct nrf_event *) 0)->member))
+
+typedef void (*nrf_evt_handler_t)(const struct nrf_event *evt, uint8_t length);
+
+/* Per event type decoding statistics, SCHED_CYCLES_RESOLUTION cycle units */
+struct nrf_evt_stats {
+    uint16_t count;
+    uint16_t cycles_max;
+    uint32_t cycles;
+};
+
 struct nrf_setup_data {
     uint8_t status;
     uint8_t data[32];
 };
 
+/* Data bytes per transfer, following the length and opcode / debug bytes */
+#define NRF_DATA_MAX (ACI_PACKET_MAX_LEN - 2)
+
 struct nrf_tx {
     uint8_t length;
     uint8_t command;
-    uint8_t data[30];
+    uint8_t data[NRF_DATA_MAX];
 };
 
 struct nrf_rx {
     uint8_t debug;
     uint8_t length;
-    uint8_t data[30];
+    uint8_t data[NRF_DATA_MAX];
 };
 
+/*
+ * Events received during send-only transfers that can wait for the nRF
+ * task, a burst of sends reads in at most one event each.
+ */
+#ifndef NRF_EVT_QUEUE_LEN
+#define NRF_EVT_QUEUE_LEN 4
+#endif
+
 
 int8_t nrf_reset_module(void);
 int8_t nrf_setup(void);
-void nrf_advertise(void);
+void nrf_advertise(uint16_t timeout, uint16_t interval);
+void nrf_bond(uint16_t timeout, uint16_t interval);
+uint8_t nrf_open_adv_pipes(void);
+void nrf_broadcast(uint16_t timeout, uint16_t interval);
+uint8_t nrf_bonded(void);
+void nrf_sleep(void);
+void nrf_wakeup(void);
+int8_t nrf_save_dynamic_data(void);
 
 int8_t nrf_transmit(struct nrf_tx *tx, struct nrf_rx *rx);
 #define nrf_send(tx) nrf_transmit(tx, NULL)
 #define nrf_receive(rx) nrf_transmit(NULL, rx)
 #define nrf_txrx(tx, rx) do { nrf_transmit(tx, NULL); nrf_transmit(NULL, rx); } while (0);
 
+int8_t nrf_pipe_write(uint8_t pipe, const uint8_t *data, uint8_t length);
+int8_t nrf_send_data(uint8_t pipe, const uint8_t *data, uint8_t length);
+int8_t nrf_send_data_ack(uint8_t pipe);
+int8_t nrf_send_data_nack(uint8_t pipe, uint8_t error);
+void nrf_flush(void);
+uint8_t nrf_tx_pending(void);
+uint16_t nrf_pipe_type(uint8_t pipe);
+int8_t nrf_set_local_data(uint8_t pipe, const uint8_t *data, uint8_t length);
+void nrf_print_tx_stats(void);
 int8_t nrf_send_button_data(uint8_t button);
 void nrf_parse(struct nrf_rx *rx);
+void nrf_parse_queued(void);
+void nrf_drop_queued(void);
+void nrf_print_evt_stats(void);
 void nrf_print_rx(struct nrf_rx *rx);
 void nrf_print_temperature(void);
+int8_t nrf_change_timing(uint16_t min_interval, uint16_t max_interval,
+        uint16_t latency, uint16_t timeout);
+void nrf_print_timing(void);
+void nrf_rdyn_changed(void);
+void nrf_set_replay(uint8_t enable);
+void nrf_print_state(void);
 
 extern uint8_t nrf_connect_state;
+extern struct nrf_timing nrf_timing;
+extern uint32_t nrf_last_activity;
+extern uint8_t nrf_disconnect_status;
+extern uint8_t nrf_fault;
 extern struct nrf_rx rx;
+extern uint32_t nrf_data_sent;
+
+/*
+ * nRF8001 control lines, as port register and bit mask. The data direction
+ * register is located right below the port register, the input register
+ * right below that. MOSI, MISO and SCK are shared by all modules.
+ */
+struct nrf_pins {
+    volatile uint8_t *reset_port;
+    volatile uint8_t *reqn_port;
+    volatile uint8_t *rdyn_port;
+    uint8_t reset_mask;
+    uint8_t reqn_mask;
+    uint8_t rdyn_mask;
+};
+
+#define NRF_PINS(reset_port, reset, reqn_port, reqn, rdyn_port, rdyn) \
+    { &(reset_port), &(reqn_port), &(rdyn_port), \
+      (1 << (reset)), (1 << (reqn)), (1 << (rdyn)) }
+
+/*
+ * Modules on the SPI bus, the first one is the primary module, which runs
+ * all services. Additional modules only advertise and accept connections.
+ * RDYN of every module has to be on port B, which is covered by the PCINT0
+ * interrupt. For example, a second module with reset on PC3 (remove it from
+ * INPUT_PORTC_MASK), REQN on PB6 and RDYN on PB7:
+ *
+ *   -DNRF_DEVICES=2 -DNRF_DEVICE_PINS="{ \
+ *       NRF_PINS(PORTB, PB0, PORTB, PB2, PORTB, PB1), \
+ *       NRF_PINS(PORTC, PC3, PORTB, PB6, PORTB, PB7) }"
+ *
+ * Note that PB6 and PB7 are the crystal pins, so this needs the internal
+ * RC oscillator, which is the default fuse setting.
+ */
+#ifndef NRF_DEVICES
+#define NRF_DEVICES 1
+#endif
+
+#ifndef NRF_DEVICE_PINS
+#if NRF_DEVICES > 1
+#error "NRF_DEVICE_PINS must list the pins of all NRF_DEVICES modules"
+#endif
+#define NRF_DEVICE_PINS { NRF_PINS(PORTB, PB0, PORTB, PB2, PORTB, PB1) }
+#endif
+
+#if NRF_DEVICES > 1
+/* Defined once in nrf.c, indexed with the currently selected module */
+extern const struct nrf_pins nrf_pins[NRF_DEVICES];
+
+/* Currently selected module */
+extern uint8_t nrf_cur;
+void nrf_select(uint8_t device);
+#else
+/*
+ * Indexed with a constant, all lookups are resolved at compile time and
+ * the table itself is never emitted.
+ */
+static const struct nrf_pins nrf_pins[NRF_DEVICES] __attribute__((unused)) =
+    NRF_DEVICE_PINS;
+
+#define nrf_cur 0
+#define nrf_select(device) do { } while (0)
+#endif
+
+void nrf_init_pins(void);
+
+/* Status LEDs show the primary module only */
+#define led_primary(op)     do { if (nrf_cur == 0) { op; } } while (0)
+#define led_setup_on()      led_primary(PORTD |= 0x80)
+#define led_setup_off()     led_primary(PORTD &= ~(0x80))
+#define led_connect_on()    led_primary(PORTD |= 0x10)
+#define led_connect_off()   led_primary(PORTD &= ~(0x10))
 
-#define led_setup_on()      do { PORTD |= 0x80; } while (0)
-#define led_setup_off()     do { PORTD &= ~(0x80); } while (0)
-#define led_connect_on()    do { PORTD |= 0x10; } while (0)
-#define led_connect_off()   do { PORTD &= ~(0x10); } while (0)
-
-#define ble_reset_high()    do { PORTB |= 0x01; } while(0)
-#define ble_reset_low()     do { PORTB &= ~(0x01); } while (0)
-#define reqn_set_high()     do { PORTB |= 0x04; } while (0)
-#define reqn_set_low()      do { PORTB &= ~(0x04); } while (0)
-#define rdyn_is_high()      (PINB & 0x02)
-#define rdyn_is_low()       (!(PINB & 0x02))
+#define ble_reset_high()    do { \
+        *nrf_pins[nrf_cur].reset_port |= nrf_pins[nrf_cur].reset_mask; \
+    } while (0)
+#define ble_reset_low()     do { \
+        *nrf_pins[nrf_cur].reset_port &= ~nrf_pins[nrf_cur].reset_mask; \
+    } while (0)
+#define reqn_set_high()     do { \
+        *nrf_pins[nrf_cur].reqn_port |= nrf_pins[nrf_cur].reqn_mask; \
+    } while (0)
+#define reqn_set_low()      do { \
+        *nrf_pins[nrf_cur].reqn_port &= ~nrf_pins[nrf_cur].reqn_mask; \
+    } while (0)
+#define rdyn_dev_is_high(dev) \
+    (*(nrf_pins[dev].rdyn_port - 2) & nrf_pins[dev].rdyn_mask)
+#define rdyn_is_high()      rdyn_dev_is_high(nrf_cur)
+#define rdyn_is_low()       (!rdyn_is_high())
 
 struct service_pipe_mapping {
     aci_pipe_store_t store;
@@ -0,0 +1,428 @@
+/*
+ * Firmware update over BLE
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * A new firmware image is written by the central to the update data pipe
+ * while the application keeps running. Image data is collected into a
+ * page buffer, and every full page is programmed into the staging area
+ * above the application by the boot section code, see bootloader.c.
+ *
+ * The data pipe is a write-without-response pipe, so incoming data isn't
+ * limited by data credits, those only apply to the status notifications
+ * sent back. Writing a page takes about 4ms with interrupts disabled,
+ * ACI events meanwhile wait in the nRF8001, so the central should stay a
+ * few pages ahead of the last page status, but not further than the
+ * nRF8001 can buffer.
+ *
+ * Once the whole image is received, its CRC is verified over the staging
+ * area, and the central can apply it. The boot section code then copies
+ * the image over the application and resets into it.
+ */
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include "ota.h"
+#include "bootloader.h"
+#include "nrf.h"
+#include "sched.h"
+#include "uart.h"
+
+#ifdef OTA_ENABLED
+
+static const char string_ota[] PROGMEM      = "Updates: ";
+static const char string_errors[] PROGMEM   = ", errors ";
+static const char string_dropped[] PROGMEM  = ", dropped ";
+static const char string_bytes[] PROGMEM    = ", last ";
+static const char string_in[] PROGMEM       = " bytes in ";
+static const char string_ms[] PROGMEM       = " ms, ";
+static const char string_bps[] PROGMEM      = " B/s\r\n";
+
+#define OTA_STATE_IDLE      0
+#define OTA_STATE_RECEIVE   1
+#define OTA_STATE_VERIFIED  2
+
+struct ota {
+    uint8_t page[SPM_PAGESIZE];
+    uint8_t status[OTA_STATUS_QUEUE_LEN][OTA_STATUS_LEN];
+    uint8_t status_count;
+    uint16_t length;    /* image length */
+    uint16_t crc;       /* expected image CRC */
+    uint16_t offset;    /* next image offset expected */
+    uint32_t start;     /* tick of the START command */
+    uint8_t rx_pipe;
+    uint8_t tx_pipe;
+    uint8_t state;
+};
+
+static struct ota ota;
+struct ota_stats ota_stats;
+
+/* End of the running image in flash, including the .data initializers */
+extern char __data_load_end[];
+
+
+/**
+ * Initialize firmware update handling.
+ *
+ * @param rx_pipe Pipe receiving update commands
+ * @param tx_pipe Pipe to send status notifications on
+ * @return none
+ */
+void
+ota_init(uint8_t rx_pipe, uint8_t tx_pipe)
+{
+    ota.rx_pipe = rx_pipe;
+    ota.tx_pipe = tx_pipe;
+    ota.state = OTA_STATE_IDLE;
+}
+
+/**
+ * Send queued status notifications, as long as data credits last.
+ *
+ * Called from nrf_flush() whenever credits or pipes may have changed.
+ *
+ * @param none
+ * @return none
+ */
+void
+ota_flush(void)
+{
+    while (ota.status_count > 0) {
+        if (nrf_send_data(ota.tx_pipe, ota.status[0], OTA_STATUS_LEN) != 0) {
+            return;
+        }
+        ota.status_count--;
+        memmove(ota.status[0], ota.status[1],
+                ota.status_count * OTA_STATUS_LEN);
+    }
+}
+
+/**
+ * Queue a status notification with the next offset expected, and send
+ * it right away if possible.
+ *
+ * Unlike the pipe's send cache, the queue keeps every status, so an error
+ * isn't overwritten by the next status before the central saw it. Only if
+ * the queue is full, the newest entry is replaced, its offset is outdated
+ * by the new one anyway.
+ *
+ * @param status OTA_STATUS_* value
+ * @return none
+ */
+static void
+ota_status(uint8_t status)
+{
+    uint8_t *data;
+
+    if (status > OTA_STATUS_PAGE) {
+        ota_stats.errors++;
+    }
+
+    if (ota.status_count == OTA_STATUS_QUEUE_LEN) {
+        ota_stats.dropped++;
+        ota.status_count--;
+    }
+
+    data = ota.status[ota.status_count++];
+    data[0] = status;
+    data[1] = ota.offset & 0xff;
+    data[2] = ota.offset >> 8;
+
+    ota_flush();
+}
+
+/**
+ * Drop queued status notifications when the connection is gone, the
+ * next central starts over with a new command.
+ *
+ * @param none
+ * @return none
+ */
+void
+ota_disconnected(void)
+{
+    ota.status_count = 0;
+}
+
+/**
+ * Program the page buffer into the staging area.
+ *
+ * The unused part of a last partial page is left at the erased value.
+ *
+ * @param none
+ * @return none
+ */
+static void
+ota_write_page(void)
+{
+    uint16_t page = (ota.offset - 1) & ~(SPM_PAGESIZE - 1);
+
+    bootloader_write_page(BOOTLOADER_STAGING + page, ota.page);
+    memset(ota.page, 0xff, SPM_PAGESIZE);
+}
+
+/**
+ * Verify the CRC of the staged image.
+ *
+ * @param none
+ * @return 1 if the CRC matches, 0 otherwise
+ */
+static uint8_t
+ota_verify(void)
+{
+    uint16_t crc = 0xffff;
+    uint16_t i;
+
+    for (i = 0; i < ota.length; i++) {
+        crc = _crc_xmodem_update(crc, pgm_read_byte(BOOTLOADER_STAGING + i));
+    }
+
+    return crc == ota.crc;
+}
+
+/**
+ * Return the flash space free for a new image.
+ *
+ * The Makefile refuses images reaching into the staging area, this guards
+ * against builds that bypassed the check: staging a new image would then
+ * erase the code that is running.
+ *
+ * @param none
+ * @return free bytes in the staging area, 0 if it overlaps the application
+ */
+static uint16_t
+ota_space(void)
+{
+    if ((uint16_t) __data_load_end >= BOOTLOADER_STAGING) {
+        return 0;
+    }
+    return BOOTLOADER_IMAGE_MAX;
+}
+
+/**
+ * Handle START command.
+ *
+ * @param data Command parameters
+ * @param length Parameter length
+ * @return none
+ */
+static void
+ota_start(const uint8_t *data, uint8_t length)
+{
+    uint16_t image_length;
+
+    ota.offset = 0;
+
+    if (length < 4) {
+        ota.state = OTA_STATE_IDLE;
+        ota_status(OTA_STATUS_LENGTH);
+        return;
+    }
+
+    image_length = data[0] | (data[1] << 8);
+    if (image_length == 0 || image_length > ota_space()) {
+        ota.state = OTA_STATE_IDLE;
+        ota_status(OTA_STATUS_LENGTH);
+        return;
+    }
+
+    ota.length = image_length;
+    ota.crc = data[2] | (data[3] << 8);
+    ota.start = sched_now();
+    ota.state = OTA_STATE_RECEIVE;
+    memset(ota.page, 0xff, SPM_PAGESIZE);
+
+    ota_status(OTA_STATUS_OK);
+}
+
+/**
+ * Handle DATA command.
+ *
+ * Data has to arrive in order. Anything else is dropped with a status
+ * telling the central where to continue, subsequent data already in
+ * flight is dropped silently until the expected offset shows up again.
+ *
+ * @param data Command parameters
+ * @param length Parameter length
+ * @return none
+ */
+static void
+ota_data(const uint8_t *data, uint8_t length)
+{
+    static uint16_t reported = 0xffff;
+    uint16_t offset;
+    uint8_t i;
+
+    if (ota.state != OTA_STATE_RECEIVE) {
+        ota_status(OTA_STATUS_STATE);
+        return;
+    }
+
+    if (length < 2) {
+        ota_status(OTA_STATUS_LENGTH);
+        return;
+    }
+
+    offset = data[0] | (data[1] << 8);
+    if (offset != ota.offset) {
+        /* one error status per gap is enough */
+        if (reported != ota.offset) {
+            reported = ota.offset;
+            ota_status(OTA_STATUS_OFFSET);
+        }
+        return;
+    }
+    reported = 0xffff;
+
+    data += 2;
+    length -= 2;
+    if (length > ota.length - ota.offset) {
+        ota_status(OTA_STATUS_LENGTH);
+        return;
+    }
+
+    for (i = 0; i < length; i++) {
+        ota.page[ota.offset % SPM_PAGESIZE] = data[i];
+        ota.offset++;
+
+        if (ota.offset % SPM_PAGESIZE == 0 || ota.offset == ota.length) {
+            ota_write_page();
+            ota_status(OTA_STATUS_PAGE);
+        }
+    }
+}
+
+/**
+ * Handle END command.
+ *
+ * @param none
+ * @return none
+ */
+static void
+ota_end(void)
+{
+    uint32_t ms;
+
+    if (ota.state != OTA_STATE_RECEIVE || ota.offset != ota.length) {
+        ota_status(OTA_STATUS_STATE);
+        return;
+    }
+
+    if (!ota_verify()) {
+        ota.state = OTA_STATE_IDLE;
+        ota_status(OTA_STATUS_CRC);
+        return;
+    }
+
+    ms = (sched_now() - ota.start) * SCHED_TICK_MS;
+    ota_stats.updates++;
+    ota_stats.bytes = ota.length;
+    ota_stats.ms = ms;
+    ota_stats.rate = (ms > 0) ? (uint32_t) ota.length * 1000 / ms : 0;
+
+    ota.state = OTA_STATE_VERIFIED;
+    ota_status(OTA_STATUS_OK);
+}
+
+/**
+ * Handle APPLY command.
+ *
+ * Returns only if there is no verified image, the staged image is
+ * verified once more in case anything overwrote it in the meantime.
+ *
+ * @param none
+ * @return none
+ */
+static void
+ota_apply(void)
+{
+    if (ota.state != OTA_STATE_VERIFIED || !ota_verify()) {
+        ota.state = OTA_STATE_IDLE;
+        ota_status(OTA_STATUS_STATE);
+        return;
+    }
+
+    ota_print_stats();
+    while (!uart_tx_idle()) {
+        /* wait */
+    }
+
+    bootloader_apply((ota.length + SPM_PAGESIZE - 1) / SPM_PAGESIZE);
+}
+
+/**
+ * Handle data received on a pipe.
+ *
+ * @param pipe Pipe the data was received on
+ * @param data Received data
+ * @param length Data length
+ * @return 0 if the data was handled, -1 if the pipe is not the update pipe
+ */
+int8_t
+ota_received(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    if (pipe != ota.rx_pipe || length == 0) {
+        return -1;
+    }
+
+    switch (data[0]) {
+        case OTA_CMD_START:
+            ota_start(data + 1, length - 1);
+            break;
+
+        case OTA_CMD_DATA:
+            ota_data(data + 1, length - 1);
+            break;
+
+        case OTA_CMD_END:
+            ota_end();
+            break;
+
+        case OTA_CMD_APPLY:
+            ota_apply();
+            break;
+
+        case OTA_CMD_ABORT:
+            ota.state = OTA_STATE_IDLE;
+            ota.offset = 0;
+            ota_status(OTA_STATUS_OK);
+            break;
+
+        default:
+            ota_status(OTA_STATUS_STATE);
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Print firmware update statistics.
+ *
+ * @param none
+ * @return none
+ */
+void
+ota_print_stats(void)
+{
+    uart_print_pgm(string_ota);
+    uart_putint(ota_stats.updates, 1);
+    uart_print_pgm(string_errors);
+    uart_putint(ota_stats.errors, 1);
+    uart_print_pgm(string_dropped);
+    uart_putint(ota_stats.dropped, 1);
+    uart_print_pgm(string_bytes);
+    uart_putint(ota_stats.bytes, 1);
+    uart_print_pgm(string_in);
+    uart_putint(ota_stats.ms, 1);
+    uart_print_pgm(string_ms);
+    uart_putint(ota_stats.rate, 1);
+    uart_print_pgm(string_bps);
+}
+
+#endif /* OTA_ENABLED */
@@ -0,0 +1,88 @@
+/*
+ * Firmware update over BLE
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _OTA_H_
+#define _OTA_H_
+
+#include <stdint.h>
+#include "nrf/services.h"
+
+/*
+ * Updates are only built if the update pipes exist. Without them, the
+ * call from the ACI event handling compiles to nothing, and the page
+ * buffer takes no RAM.
+ */
+#if defined(PIPE_EXAMPLE_SERVICE_OTA_DATA_RX) && \
+    defined(PIPE_EXAMPLE_SERVICE_OTA_STATUS_TX)
+#define OTA_ENABLED
+#endif
+
+/*
+ * Commands written by the central to the update data pipe, multi-byte
+ * values LSB first:
+ *
+ *  START   image length (16 bit), image CRC (16 bit)
+ *  DATA    image offset (16 bit), up to 17 bytes of image data
+ *  END     none, verifies the CRC of the staged image
+ *  APPLY   none, copies the verified image over the application
+ *  ABORT   none
+ *
+ * The image CRC is CRC-16/CCITT-FALSE, polynomial 0x1021 and initial
+ * value 0xffff, as calculated by Python's binascii.crc_hqx(data, 0xffff).
+ */
+#define OTA_CMD_START       0x01
+#define OTA_CMD_DATA        0x02
+#define OTA_CMD_END         0x03
+#define OTA_CMD_APPLY       0x04
+#define OTA_CMD_ABORT       0x05
+
+/*
+ * Status notifications on the update status pipe: status, followed by
+ * the next image offset expected (16 bit). A status is sent after each
+ * command other than DATA and whenever a page was written, so the central
+ * can keep a window of pages in flight and resend from the given offset
+ * after an error. Statuses are queued until data credits are available,
+ * so none of them is replaced by a later one.
+ */
+#define OTA_STATUS_OK       0x00
+#define OTA_STATUS_PAGE     0x01    /* page written */
+#define OTA_STATUS_OFFSET   0x02    /* unexpected offset, resend from there */
+#define OTA_STATUS_LENGTH   0x03    /* image too large or command too short */
+#define OTA_STATUS_CRC      0x04    /* staged image CRC mismatch */
+#define OTA_STATUS_STATE    0x05    /* command not valid in current state */
+
+/* Status notifications waiting for data credits */
+#ifndef OTA_STATUS_QUEUE_LEN
+#define OTA_STATUS_QUEUE_LEN 4
+#endif
+#define OTA_STATUS_LEN      3
+
+struct ota_stats {
+    uint16_t updates;   /* images received and verified */
+    uint16_t errors;    /* error status sent */
+    uint16_t dropped;   /* status replaced in a full queue */
+    uint16_t bytes;     /* bytes of the last image */
+    uint32_t ms;        /* last image transfer time */
+    uint16_t rate;      /* last image, bytes per second */
+};
+
+#ifdef OTA_ENABLED
+void ota_init(uint8_t rx_pipe, uint8_t tx_pipe);
+int8_t ota_received(uint8_t pipe, const uint8_t *data, uint8_t length);
+void ota_flush(void);
+void ota_disconnected(void);
+void ota_print_stats(void);
+
+extern struct ota_stats ota_stats;
+#else
+#define ota_received(pipe, data, length)    (-1)
+#define ota_flush()                         do { } while (0)
+#define ota_disconnected()                  do { } while (0)
+#endif
+
+#endif /* _OTA_H_ */
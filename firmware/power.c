@@ -0,0 +1,352 @@
+/*
+ * Power management
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Unused peripherals are switched off via PRR. Whenever the scheduler has
+ * nothing to do, power_sleep() picks the deepest sleep mode that still
+ * wakes up on all relevant events:
+ *
+ *  - idle as long as any software timer is armed (Timer2 needs the I/O
+ *    clock), PWM or ADC sampling is running, or the UART is still
+ *    shifting out data. Outside of console use, the CPU clock is scaled
+ *    down for idle, see clock.c.
+ *  - power-down otherwise. The button and RDYN use pin change interrupts,
+ *    which work without clock, and RXD gets a pin change interrupt while
+ *    powered down, so incoming console data wakes up the device. The first
+ *    character is lost that way, after it the console stays in idle mode
+ *    for POWER_CONSOLE_AWAKE_MS.
+ *
+ * As Timer2 stops in power-down, the watchdog timer runs in interrupt
+ * mode during power-down to keep track of the time spent there, with its
+ * usual +-10% accuracy. Afterwards it goes back to the supervisor's
+ * system reset mode. The time is handed to the scheduler as well, so
+ * sched_now() doesn't fall behind.
+ *
+ * The watchdog counter can't be read, so a wake-up by any other interrupt
+ * before the period ends is counted as half a period. Each such wake-up
+ * is off by up to +-POWER_WDT_MS / 2, which averages out over many of
+ * them, but a single power-down measurement is only that accurate.
+ *
+ * The time spent in each AVR and nRF8001 state is accumulated, which,
+ * together with the typical supply currents from power.h, gives an
+ * estimate of the average current consumption. Divided by the number of
+ * data packets sent, that's the charge spent per notification.
+ */
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include "power.h"
+#include "sched.h"
+#include "supervisor.h"
+#include "adc.h"
+#include "clock.h"
+#include "nrf.h"
+#include "pwm.h"
+#include "uart.h"
+
+static const char string_avr[] PROGMEM      =
+    "AVR active/idle/slow idle/down: ";
+static const char string_nrf[] PROGMEM      = "nRF standby/adv/conn/sleep: ";
+static const char string_average[] PROGMEM  = "Average: ";
+static const char string_ua[] PROGMEM       = " uA\r\n";
+static const char string_packets[] PROGMEM  = "Packets sent: ";
+static const char string_charge[] PROGMEM   = ", charge per packet: ";
+static const char string_uc[] PROGMEM       = " uC\r\n";
+
+static const uint16_t avr_ua[POWER_AVR_STATES] PROGMEM = {
+    POWER_UA_AVR_ACTIVE, POWER_UA_AVR_IDLE, POWER_UA_AVR_IDLE_SLOW,
+    POWER_UA_AVR_DOWN
+};
+static const uint16_t nrf_ua[POWER_NRF_STATES] PROGMEM = {
+    POWER_UA_NRF_STANDBY, POWER_UA_NRF_ADVERTISING,
+    POWER_UA_NRF_CONNECTED, POWER_UA_NRF_SLEEP
+};
+
+/* Watchdog period used during power-down, must match WDTO_1S */
+#define POWER_WDT_MS 1000
+
+struct power_stats power_stats;
+
+static struct sched_timer console_timer;
+static uint32_t power_last;
+static uint32_t power_packets_base;     /* nrf_data_sent at the last reset */
+static volatile uint16_t power_down_periods;
+
+
+/**
+ * Initialize power management.
+ *
+ * Switches off TWI, Timer1, ADC and the analog comparator, which are not
+ * used by default. Modules using any of them need to clear the
+ * corresponding PRR bit themselves.
+ *
+ * @param none
+ * @return none
+ */
+void
+power_init(void)
+{
+    PRR |= (1 << PRTWI) | (1 << PRTIM1) | (1 << PRADC);
+    ACSR |= (1 << ACD);
+    power_last = sched_now();
+}
+
+/**
+ * Return the current nRF8001 power state.
+ *
+ * @param none
+ * @return one of the POWER_NRF_* values
+ */
+static uint8_t
+power_nrf_state(void)
+{
+    switch (nrf_connect_state) {
+        case NRF_STATE_CONNECTING:
+            return POWER_NRF_ADVERTISING;
+        case NRF_STATE_CONNECTED:
+            return POWER_NRF_CONNECTED;
+        case NRF_STATE_SLEEP:
+            return POWER_NRF_SLEEP;
+    }
+    return POWER_NRF_STANDBY;
+}
+
+/**
+ * Add time to the residency counters.
+ *
+ * @param avr_state AVR state the time was spent in
+ * @param ms Time in milliseconds
+ * @return none
+ */
+static void
+power_account(uint8_t avr_state, uint32_t ms)
+{
+    power_stats.avr[avr_state] += ms;
+    power_stats.nrf[power_nrf_state()] += ms;
+}
+
+/**
+ * Check if it is safe to enter power-down.
+ *
+ * @param none
+ * @return 1 if power-down is possible, 0 if idle has to be used
+ */
+static uint8_t
+power_down_allowed(void)
+{
+    return sched_timers_idle() &&
+           uart_tx_idle() &&
+           !pwm_active() &&
+           !adc_active();
+}
+
+/**
+ * Put the CPU to sleep until the next interrupt.
+ *
+ * Must be called with interrupts disabled, after checking there is
+ * nothing left to do. Interrupts are enabled when returning.
+ *
+ * @param none
+ * @return none
+ */
+void
+power_sleep(void)
+{
+    uint32_t now;
+    uint16_t periods;
+    uint16_t ms;
+    uint8_t slow;
+
+    now = sched_now();
+    power_account(POWER_AVR_ACTIVE, (now - power_last) * SCHED_TICK_MS);
+    power_last = now;
+
+    if (power_down_allowed()) {
+        /* wake up on RXD and count time with the watchdog interrupt */
+        PCMSK2 |= (1 << PCINT16);
+        PCICR |= (1 << PCIE2);
+        wdt_reset();
+        WDTCSR = (1 << WDCE) | (1 << WDE);
+        WDTCSR = (1 << WDIE) | (1 << WDP2) | (1 << WDP1);
+        power_down_periods = 0;
+
+        set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+        sleep_enable();
+        sleep_bod_disable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+
+        cli();
+        PCMSK2 &= ~(1 << PCINT16);
+        supervisor_wdt_enable();
+        periods = power_down_periods;
+        sei();
+
+        /* woken up by something else in the middle of the first period */
+        ms = periods ? periods * POWER_WDT_MS : POWER_WDT_MS / 2;
+        power_account(POWER_AVR_DOWN, ms);
+        sched_advance(SCHED_MS(ms));
+        power_last = sched_now();
+
+    } else {
+        /* the scheduler switches back to full speed once there's work */
+        slow = !sched_timer_armed(&console_timer) && clock_slow();
+
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+
+        now = sched_now();
+        power_account(slow ? POWER_AVR_IDLE_SLOW : POWER_AVR_IDLE,
+                (now - power_last) * SCHED_TICK_MS);
+        power_last = now;
+    }
+}
+
+/**
+ * Console inactivity timer, nothing to do but to expire.
+ */
+static void
+console_timeout(void)
+{
+}
+
+/**
+ * Keep the device out of power-down for a while after console input.
+ *
+ * @param none
+ * @return none
+ */
+void
+power_console_activity(void)
+{
+    sched_timer_start(&console_timer, console_timeout,
+            SCHED_MS(POWER_CONSOLE_AWAKE_MS), 0);
+}
+
+/**
+ * Clear the residency counters and the packet count, to start a new
+ * measurement.
+ *
+ * @param none
+ * @return none
+ */
+void
+power_reset_stats(void)
+{
+    memset(&power_stats, 0, sizeof(power_stats));
+    power_packets_base = nrf_data_sent;
+    power_last = sched_now();
+}
+
+/**
+ * Print a list of residency counters, in ms.
+ *
+ * @param counters Counters to print
+ * @param count Number of counters
+ * @return none
+ */
+static void
+power_print_list(const uint32_t *counters, uint8_t count)
+{
+    uint8_t i;
+
+    for (i = 0; i < count; i++) {
+        if (i > 0) {
+            uart_putchar('/');
+        }
+        uart_putint(counters[i], 1);
+    }
+    uart_newline();
+}
+
+/**
+ * Estimate the average current of a set of states.
+ *
+ * @param counters Residency counters
+ * @param currents PROGMEM table of currents per state in uA
+ * @param count Number of states
+ * @return average current in uA
+ */
+static uint32_t
+power_average(const uint32_t *counters, const uint16_t *currents, uint8_t count)
+{
+    uint32_t total = 0;
+    uint32_t average = 0;
+    uint8_t i;
+
+    for (i = 0; i < count; i++) {
+        total += counters[i];
+    }
+
+    /* permille resolution keeps the products within 32 bits */
+    total /= 1000;
+    if (total == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        average += (counters[i] / total) * pgm_read_word(&currents[i]);
+    }
+
+    return average / 1000;
+}
+
+/**
+ * Print residency counters and the estimated average current.
+ *
+ * The power-down residency is accurate to the watchdog's +-10% plus up to
+ * +-POWER_WDT_MS / 2 per wake-up, see the power-down notes at the top.
+ *
+ * @param none
+ * @return none
+ */
+void
+power_print_stats(void)
+{
+    uint32_t average;
+    uint32_t total = 0;
+    uint32_t packets;
+    uint8_t i;
+
+    average = power_average(power_stats.avr, avr_ua, POWER_AVR_STATES) +
+              power_average(power_stats.nrf, nrf_ua, POWER_NRF_STATES);
+    for (i = 0; i < POWER_AVR_STATES; i++) {
+        total += power_stats.avr[i];
+    }
+    packets = nrf_data_sent - power_packets_base;
+
+    uart_print_pgm(string_avr);
+    power_print_list(power_stats.avr, POWER_AVR_STATES);
+    uart_print_pgm(string_nrf);
+    power_print_list(power_stats.nrf, POWER_NRF_STATES);
+    uart_print_pgm(string_average);
+    uart_putint(average, 1);
+    uart_print_pgm(string_ua);
+    uart_print_pgm(string_packets);
+    uart_putint(packets, 1);
+    uart_print_pgm(string_charge);
+    /* uA * s gives uC, the whole system's charge over all packets sent */
+    uart_putint(packets ? average * (total / 1000) / packets : 0, 1);
+    uart_print_pgm(string_uc);
+    clock_print_stats();
+}
+
+/**
+ * Watchdog interrupt handler, only enabled during power-down.
+ * Count the time spent in power-down.
+ */
+SIGNAL(WDT_vect)
+{
+    power_down_periods++;
+}
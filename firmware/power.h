@@ -0,0 +1,75 @@
+/*
+ * Power management
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _POWER_H_
+#define _POWER_H_
+
+#include <stdint.h>
+
+/* AVR power states */
+#define POWER_AVR_ACTIVE        0
+#define POWER_AVR_IDLE          1
+#define POWER_AVR_IDLE_SLOW     2   /* idle at the scaled down clock */
+#define POWER_AVR_DOWN          3
+#define POWER_AVR_STATES        4
+
+/* nRF8001 power states */
+#define POWER_NRF_STANDBY       0   /* disconnected, not advertising */
+#define POWER_NRF_ADVERTISING   1
+#define POWER_NRF_CONNECTED     2
+#define POWER_NRF_SLEEP         3
+#define POWER_NRF_STATES        4
+
+/*
+ * Typical supply current per state in uA, used to estimate the average
+ * current from the residency counters. Adjust to the actual hardware.
+ */
+#ifndef POWER_UA_AVR_ACTIVE
+#define POWER_UA_AVR_ACTIVE     3000
+#endif
+#ifndef POWER_UA_AVR_IDLE
+#define POWER_UA_AVR_IDLE       900
+#endif
+#ifndef POWER_UA_AVR_IDLE_SLOW
+#define POWER_UA_AVR_IDLE_SLOW  200
+#endif
+#ifndef POWER_UA_AVR_DOWN
+#define POWER_UA_AVR_DOWN       5   /* watchdog running */
+#endif
+#ifndef POWER_UA_NRF_STANDBY
+#define POWER_UA_NRF_STANDBY    2
+#endif
+#ifndef POWER_UA_NRF_ADVERTISING
+#define POWER_UA_NRF_ADVERTISING 500
+#endif
+#ifndef POWER_UA_NRF_CONNECTED
+#define POWER_UA_NRF_CONNECTED  1200
+#endif
+#ifndef POWER_UA_NRF_SLEEP
+#define POWER_UA_NRF_SLEEP      1
+#endif
+
+/* Time to stay out of power-down after console input */
+#ifndef POWER_CONSOLE_AWAKE_MS
+#define POWER_CONSOLE_AWAKE_MS  10000
+#endif
+
+struct power_stats {
+    uint32_t avr[POWER_AVR_STATES];     /* residency per AVR state, ms */
+    uint32_t nrf[POWER_NRF_STATES];     /* residency per nRF state, ms */
+};
+
+void power_init(void);
+void power_sleep(void);
+void power_console_activity(void);
+void power_reset_stats(void);
+void power_print_stats(void);
+
+extern struct power_stats power_stats;
+
+#endif /* _POWER_H_ */
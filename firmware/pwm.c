@@ -0,0 +1,300 @@
+/*
+ * Multi-channel PWM with ramps
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Each channel has a duty cycle in 8.8 fixed point, a per step increment
+ * and a number of steps left. A ramp is split into steps at the Timer0
+ * overflow rate, and the overflow interrupt adds the increment to every
+ * ramping channel and writes the result to its output compare register.
+ * The last step sets the exact target value. Output compare registers are
+ * double buffered in fast PWM mode, so new values take effect at the start
+ * of the next PWM period without glitches.
+ *
+ * A single command sets any number of channels with a common ramp, all of
+ * them are updated within the same interrupt-free section and start
+ * ramping on the same overflow.
+ *
+ * Timer0 runs as long as any channel has a non-zero duty cycle or is
+ * ramping, and is stopped otherwise so the CPU can enter power-down.
+ * Channels at zero are disconnected from their pin and driven low, as
+ * fast PWM still outputs a short spike each period with a compare value
+ * of zero.
+ */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "pwm.h"
+#include "uart.h"
+
+static const char string_pwm[] PROGMEM      = "PWM: ";
+static const char string_commands[] PROGMEM = " commands, ";
+static const char string_updates[] PROGMEM  = " updates, ";
+static const char string_ramps[] PROGMEM    = " ramps, ";
+static const char string_invalid[] PROGMEM  = " invalid, duty ";
+
+struct pwm_channel {
+    uint16_t duty;      /* current duty cycle, 8.8 fixed point */
+    int16_t step;       /* increment per overflow */
+    uint16_t steps;     /* steps left in the current ramp */
+    uint8_t target;
+};
+
+static volatile struct pwm_channel pwm_channels[PWM_CHANNELS];
+struct pwm_stats pwm_stats;
+
+
+/**
+ * Initialize the PWM outputs.
+ *
+ * Timer0 is set up in fast PWM mode, but only started once a channel is
+ * set. Timer2 is set up by the scheduler in its own fast PWM mode.
+ *
+ * @param none
+ * @return none
+ */
+void
+pwm_init(void)
+{
+    TCCR0A = (1 << WGM01) | (1 << WGM00);   /* fast PWM, TOP = 0xff */
+    TCCR0B = 0;
+
+    if (PWM_CHANNEL_MASK & 0x01) {
+        DDRD |= (1 << PD6);
+        PORTD &= ~(1 << PD6);
+    }
+    if (PWM_CHANNEL_MASK & 0x02) {
+        DDRD |= (1 << PD5);
+        PORTD &= ~(1 << PD5);
+    }
+    if (PWM_CHANNEL_MASK & 0x04) {
+        DDRD |= (1 << PD3);
+        PORTD &= ~(1 << PD3);
+    }
+}
+
+/**
+ * Write a duty cycle to a channel's output compare unit.
+ *
+ * @param channel Channel number
+ * @param duty Duty cycle, 0-255
+ * @return none
+ */
+static void
+pwm_output(uint8_t channel, uint8_t duty)
+{
+    switch (channel) {
+        case 0:
+            OCR0A = duty;
+            if (duty) {
+                TCCR0A |= (1 << COM0A1);
+            } else {
+                TCCR0A &= ~(1 << COM0A1);
+            }
+            break;
+
+        case 1:
+            OCR0B = duty;
+            if (duty) {
+                TCCR0A |= (1 << COM0B1);
+            } else {
+                TCCR0A &= ~(1 << COM0B1);
+            }
+            break;
+
+        case 2:
+            /* scale to the scheduler tick's TOP, 255 keeps the pin high */
+            OCR2B = ((uint16_t) duty * (OCR2A + 1)) >> 8;
+            if (duty) {
+                TCCR2A |= (1 << COM2B1);
+            } else {
+                TCCR2A &= ~(1 << COM2B1);
+            }
+            break;
+    }
+}
+
+/**
+ * Start or stop Timer0 depending on the channel states.
+ * Must be called with interrupts disabled.
+ *
+ * @param none
+ * @return none
+ */
+static void
+pwm_update_timer(void)
+{
+    uint8_t ramping = 0;
+    uint8_t on = 0;
+    uint8_t i;
+
+    for (i = 0; i < PWM_CHANNELS; i++) {
+        if (pwm_channels[i].steps) {
+            ramping = 1;
+        }
+        if (pwm_channels[i].duty) {
+            on = 1;
+        }
+    }
+
+    if (ramping) {
+        TIMSK0 |= (1 << TOIE0);
+    } else {
+        TIMSK0 &= ~(1 << TOIE0);
+    }
+
+    if (ramping || on) {
+        TCCR0B = (1 << CS02);   /* clk/256 */
+    } else {
+        TCCR0B = 0;
+        TCNT0 = 0;
+    }
+}
+
+/**
+ * Set the target duty cycle of several channels.
+ *
+ * @param mask Channels to set, channel 0 is bit 0
+ * @param targets Target duty cycles, one per channel in the mask
+ * @param count Number of targets, the last one is used for the rest
+ * @param ramp_ms Ramp duration in ms, 0 to set the targets immediately
+ * @return none
+ */
+void
+pwm_set(uint8_t mask, const uint8_t *targets, uint8_t count, uint16_t ramp_ms)
+{
+    uint16_t steps = (uint32_t) ramp_ms * PWM_OVF_HZ / 1000;
+    volatile struct pwm_channel *channel;
+    uint8_t target = 0;
+    uint8_t i;
+
+    mask &= PWM_CHANNEL_MASK;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (i = 0; i < PWM_CHANNELS; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            if (count > 0) {
+                target = *targets++;
+                count--;
+            }
+
+            channel = &pwm_channels[i];
+            channel->target = target;
+            if (steps == 0) {
+                channel->duty = (uint16_t) target << 8;
+                channel->steps = 0;
+                pwm_output(i, target);
+            } else {
+                channel->step = ((int32_t) ((uint16_t) target << 8) -
+                        channel->duty) / steps;
+                channel->steps = steps;
+            }
+            pwm_stats.updates++;
+        }
+        pwm_update_timer();
+    }
+}
+
+/**
+ * Handle a PWM command received via BLE.
+ *
+ * @param data Command data
+ * @param length Command length
+ * @return 0 on success, -1 if the command is malformed
+ */
+int8_t
+pwm_command(const uint8_t *data, uint8_t length)
+{
+    if (length == 1) {
+        pwm_stats.commands++;
+        pwm_set(0x01, data, 1, 0);
+        return 0;
+    }
+
+    if (length <= PWM_CMD_HEADER_LEN) {
+        pwm_stats.invalid++;
+        return -1;
+    }
+
+    pwm_stats.commands++;
+    pwm_set(data[0], data + PWM_CMD_HEADER_LEN, length - PWM_CMD_HEADER_LEN,
+            data[1] | (data[2] << 8));
+    return 0;
+}
+
+/**
+ * Check if any channel is on or ramping.
+ *
+ * Power-down is not possible then, it stops both timers.
+ *
+ * @param none
+ * @return 1 if PWM is active, 0 otherwise
+ */
+uint8_t
+pwm_active(void)
+{
+    return (TCCR0B & ((1 << CS02) | (1 << CS01) | (1 << CS00))) != 0;
+}
+
+/**
+ * Print PWM statistics and the current duty cycles.
+ *
+ * @param none
+ * @return none
+ */
+void
+pwm_print_stats(void)
+{
+    uint8_t i;
+
+    uart_print_pgm(string_pwm);
+    uart_putint(pwm_stats.commands, 1);
+    uart_print_pgm(string_commands);
+    uart_putint(pwm_stats.updates, 1);
+    uart_print_pgm(string_updates);
+    uart_putint(pwm_stats.ramps, 1);
+    uart_print_pgm(string_ramps);
+    uart_putint(pwm_stats.invalid, 1);
+    uart_print_pgm(string_invalid);
+
+    for (i = 0; i < PWM_CHANNELS; i++) {
+        if (i > 0) {
+            uart_putchar('/');
+        }
+        uart_putint(pwm_channels[i].duty >> 8, 1);
+    }
+    uart_newline();
+}
+
+/**
+ * Timer0 overflow interrupt handler, only enabled while ramping.
+ * Advance all ramping channels by one step.
+ */
+SIGNAL(TIMER0_OVF_vect)
+{
+    volatile struct pwm_channel *channel;
+    uint8_t i;
+
+    for (i = 0; i < PWM_CHANNELS; i++) {
+        channel = &pwm_channels[i];
+        if (channel->steps == 0) {
+            continue;
+        }
+
+        if (--channel->steps == 0) {
+            channel->duty = (uint16_t) channel->target << 8;
+            pwm_stats.ramps++;
+        } else {
+            channel->duty += channel->step;
+        }
+        pwm_output(i, channel->duty >> 8);
+    }
+
+    pwm_update_timer();
+}
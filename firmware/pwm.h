@@ -0,0 +1,56 @@
+/*
+ * Multi-channel PWM with ramps
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _PWM_H_
+#define _PWM_H_
+
+#include <stdint.h>
+
+/*
+ * PWM channels and their output compare units:
+ *   0  OC0A PD6
+ *   1  OC0B PD5
+ *   2  OC2B PD3, shares Timer2 with the scheduler tick, so its resolution
+ *      is limited to the tick timer's TOP value
+ */
+#define PWM_CHANNELS        3
+
+/* Channels to enable, channel 0 is bit 0 */
+#ifndef PWM_CHANNEL_MASK
+#define PWM_CHANNEL_MASK    0x07
+#endif
+
+/* Timer0 runs in fast PWM mode with clk/256, ramps advance on overflow */
+#define PWM_OVF_HZ          (F_CPU / 256 / 256)
+
+/*
+ * Command layout: channel mask, ramp duration in ms (16 bit, LSB first),
+ * followed by a target duty cycle per channel set in the mask, in channel
+ * order. Channels without a target byte of their own use the last one, so
+ * a single target byte sets all channels in the mask. A single byte alone
+ * sets channel 0 immediately.
+ */
+#define PWM_CMD_HEADER_LEN  3
+
+struct pwm_stats {
+    uint16_t commands;  /* commands received */
+    uint16_t updates;   /* channels changed by commands */
+    uint16_t ramps;     /* ramps completed */
+    uint16_t invalid;   /* malformed commands */
+};
+
+void pwm_init(void);
+void pwm_set(uint8_t mask, const uint8_t *targets, uint8_t count,
+        uint16_t ramp_ms);
+int8_t pwm_command(const uint8_t *data, uint8_t length);
+uint8_t pwm_active(void);
+void pwm_print_stats(void);
+
+extern struct pwm_stats pwm_stats;
+
+#endif /* _PWM_H_ */
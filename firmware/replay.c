@@ -0,0 +1,219 @@
+/*
+ * ACI event trace replay
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Feeds recorded ACI events, as printed by nrf_print_rx(), through the
+ * regular event parser, see tools/replay.py for the host side.
+ *
+ * While replaying, the nRF8001 is cut off: nrf_transmit() neither sends
+ * nor receives, so everything the event handlers send in response is
+ * dropped. The UART takes one event per line, as hex bytes starting with
+ * the opcode, separated by spaces or not at all. A leading "[NN]" length
+ * is skipped, so lines of a dump can be sent as they are. Each event is
+ * answered with whatever the handlers print, followed by a line
+ *
+ *   = <seq> <cycles> <state>
+ *
+ * with the event's sequence number, the CPU cycles spent in nrf_parse(),
+ * and the resulting link state from nrf_print_state(). The host sends the
+ * next event only after that line, so there is no need for buffering. An
+ * empty line ends the replay with a summary, and the module is reset, as
+ * its actual state has nothing to do with the replayed one anymore.
+ */
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "replay.h"
+#include "nrf.h"
+#include "power.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_ready[] PROGMEM    = "Replay ready\r\n";
+static const char string_summary[] PROGMEM  = "Replay: events ";
+static const char string_cycles[] PROGMEM   = ", cycles mean ";
+static const char string_max[] PROGMEM      = ", max ";
+static const char string_dropped[] PROGMEM  = ", dropped ";
+
+static struct {
+    struct nrf_rx frame;    /* event being received */
+    uint8_t nibble;         /* high nibble received, waiting for the low one */
+    uint8_t skip;           /* inside brackets */
+    volatile uint8_t ready; /* frame complete, 2 to end the replay */
+    uint16_t seq;
+    uint16_t dropped;       /* overlong or odd lines */
+    uint32_t cycles_total;
+    uint32_t cycles_max;
+} replay;
+
+static void (*replay_done)(void);
+
+
+/**
+ * Convert a hex digit.
+ *
+ * @param c Character
+ * @return value 0..15, or 0xff if c is no hex digit
+ */
+static uint8_t
+replay_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return 0xff;
+}
+
+/**
+ * UART RX callback while replaying, runs in interrupt context.
+ *
+ * Collects the hex bytes of one line, and posts the replay task once the
+ * line is complete. Characters arriving while the previous event is still
+ * handled are dropped, as are lines that don't fit the receive buffer.
+ *
+ * @param none
+ * @return none
+ */
+static void
+replay_rx(void)
+{
+    char c = uart_get_inbuf();
+    uint8_t value;
+
+    if (replay.ready) {
+        return;
+    }
+
+    if (c == '\n') {
+        if (replay.nibble || replay.frame.length > sizeof(replay.frame.data)) {
+            replay.dropped++;
+            replay.frame.length = 0;
+            replay.nibble = 0;
+            replay.skip = 0;
+            return;
+        }
+        replay.ready = (replay.frame.length > 0) ? 1 : 2;
+        replay.skip = 0;
+        sched_post(SCHED_TASK_REPLAY);
+        return;
+    }
+
+    if (c == '[' || c == ']') {
+        replay.skip = (c == '[');
+        return;
+    }
+
+    value = replay_hex(c);
+    if (replay.skip || value == 0xff) {
+        /* length prefix, separators and carriage returns */
+        return;
+    }
+
+    if (!replay.nibble) {
+        replay.nibble = 0x10 | value;
+    } else {
+        if (replay.frame.length < sizeof(replay.frame.data)) {
+            replay.frame.data[replay.frame.length] =
+                    (replay.nibble << 4) | value;
+        }
+        /* one past the buffer marks the line as overlong */
+        if (replay.frame.length <= sizeof(replay.frame.data)) {
+            replay.frame.length++;
+        }
+        replay.nibble = 0;
+    }
+}
+
+/**
+ * Replay task, parse the received event and report its cost and outcome.
+ *
+ * @param none
+ * @return none
+ */
+static void
+replay_task(void)
+{
+    uint32_t cycles;
+
+    power_console_activity();
+
+    if (replay.ready == 2) {
+        nrf_set_replay(0);
+
+        uart_print_pgm(string_summary);
+        uart_putint(replay.seq, 1);
+        uart_print_pgm(string_cycles);
+        uart_putint(replay.seq ? replay.cycles_total / replay.seq : 0, 1);
+        uart_print_pgm(string_max);
+        uart_putint(replay.cycles_max, 1);
+        uart_print_pgm(string_dropped);
+        uart_putint(replay.dropped, 1);
+        uart_newline();
+
+        replay.ready = 0;
+        replay_done();
+        return;
+    }
+
+    if (replay.ready != 1) {
+        return;
+    }
+
+    cycles = sched_cycles();
+    nrf_parse(&replay.frame);
+    cycles = sched_cycles() - cycles;
+
+    replay.seq++;
+    replay.cycles_total += cycles;
+    if (cycles > replay.cycles_max) {
+        replay.cycles_max = cycles;
+    }
+
+    uart_putchar('=');
+    uart_putchar(' ');
+    uart_putint(replay.seq, 1);
+    uart_putchar(' ');
+    uart_putint(cycles, 1);
+    uart_putchar(' ');
+    nrf_print_state();
+
+    memset(&replay.frame, 0, sizeof(replay.frame));
+    replay.ready = 0;
+}
+
+/**
+ * Initialize the replay.
+ *
+ * @param done Function called after the replay ended, restoring the
+ *             console and the nRF8001
+ * @return none
+ */
+void
+replay_init(void (*done)(void))
+{
+    replay_done = done;
+    sched_task_register(SCHED_TASK_REPLAY, replay_task);
+}
+
+/**
+ * Cut off the nRF8001 and take events from the UART until an empty line.
+ *
+ * @param none
+ * @return none
+ */
+void
+replay_start(void)
+{
+    memset(&replay, 0, sizeof(replay));
+    nrf_set_replay(1);
+    uart_set_rx_callback(replay_rx);
+    uart_print_pgm(string_ready);
+}
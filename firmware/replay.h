@@ -0,0 +1,17 @@
+/*
+ * ACI event trace replay
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdint.h>
+
+void replay_init(void (*done)(void));
+void replay_start(void);
+
+#endif /* _REPLAY_H_ */
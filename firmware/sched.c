@@ -0,0 +1,375 @@
+/*
+ * Cooperative scheduler
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * A single hardware timer (Timer2) generates the scheduler tick.
+ * Everything else runs from the main context in sched_run():
+ *
+ *  - tasks are posted as bits in a pending mask, usually from an interrupt
+ *    handler, and are run to completion in priority order
+ *  - software timers (one-shot or periodic) are hashed into a timer wheel
+ *    by their expiry tick, so processing a tick only walks a single slot
+ *
+ * When no task is pending and no tick is left to process, the CPU is put
+ * to sleep by the power manager until the next interrupt arrives.
+ */
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+#include "sched.h"
+#include "clock.h"
+#include "power.h"
+
+/* Timer2 compare value for one tick with a clk/64 prescaler */
+#define SCHED_OCR2A \
+    ((F_CPU / SCHED_CYCLES_RESOLUTION / 1000) * SCHED_TICK_MS - 1)
+
+/* Tick counter, incremented in the Timer2 compare match interrupt */
+static volatile uint32_t sched_ticks;
+/* Last tick processed by the timer wheel */
+static uint16_t sched_last;
+/* Pending task bitmask */
+static volatile uint8_t sched_pending;
+
+static sched_func_t sched_tasks[SCHED_TASK_MAX];
+static struct sched_timer *sched_wheel[SCHED_WHEEL_SIZE];
+/* Number of armed timers */
+static uint8_t sched_armed;
+
+
+/**
+ * Initialize the scheduler and start the tick timer.
+ *
+ * Timer2 is set up in fast PWM mode with TOP = OCR2A and a clk/64
+ * prescaler, generating a compare match interrupt every SCHED_TICK_MS
+ * milliseconds. The counter runs the same as in CTC mode, but leaves
+ * OC2B available as PWM channel, see pwm.c.
+ *
+ * @param none
+ * @return none
+ */
+void
+sched_init(void)
+{
+    PRR &= ~(1 << PRTIM2);
+
+    TCCR2A = (1 << WGM21) | (1 << WGM20);   /* fast PWM, TOP = OCR2A */
+    TCCR2B = (1 << WGM22) | (1 << CS22);    /* clk/64 */
+    OCR2A = SCHED_OCR2A;
+    TCNT2 = 0;
+    TIMSK2 = (1 << OCIE2A);
+}
+
+/**
+ * Register a task function for the given task number.
+ *
+ * @param task Task number, one of the SCHED_TASK_* values
+ * @param func Function to call when the task is run
+ * @return none
+ */
+void
+sched_task_register(uint8_t task, sched_func_t func)
+{
+    sched_tasks[task] = func;
+}
+
+/**
+ * Post a task to be run from the main context.
+ *
+ * Posting an already pending task has no further effect, the task is run
+ * only once. Safe to call from interrupt handlers.
+ *
+ * @param task Task number, one of the SCHED_TASK_* values
+ * @return none
+ */
+void
+sched_post(uint8_t task)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sched_pending |= (1 << task);
+    }
+}
+
+/**
+ * Remove the given timer from its timer wheel slot.
+ *
+ * @param timer Timer to remove
+ * @return none
+ */
+static void
+sched_wheel_remove(struct sched_timer *timer)
+{
+    uint8_t slot = timer->expires & SCHED_WHEEL_MASK;
+    struct sched_timer *prev;
+
+    if (sched_wheel[slot] == timer) {
+        sched_wheel[slot] = timer->next;
+    } else {
+        for (prev = sched_wheel[slot]; prev != NULL; prev = prev->next) {
+            if (prev->next == timer) {
+                prev->next = timer->next;
+                break;
+            }
+        }
+    }
+
+    timer->armed = 0;
+    sched_armed--;
+}
+
+/**
+ * Insert the given timer into the timer wheel slot of its expiry tick.
+ *
+ * @param timer Timer to insert
+ * @return none
+ */
+static void
+sched_wheel_insert(struct sched_timer *timer)
+{
+    uint8_t slot = timer->expires & SCHED_WHEEL_MASK;
+
+    timer->next = sched_wheel[slot];
+    sched_wheel[slot] = timer;
+    timer->armed = 1;
+    sched_armed++;
+}
+
+/**
+ * Start a software timer.
+ *
+ * The timer function is called from the main context after the given delay
+ * has passed. If a period is given, the timer is rearmed with that period
+ * each time it fires, otherwise it is a one-shot timer. Starting an already
+ * armed timer restarts it with the new values.
+ *
+ * The delay counts from the current tick, not from the last one processed,
+ * so a timer started while tick processing lags behind doesn't fire early.
+ * Periodic timers are rearmed relative to their expiry tick instead, so
+ * they don't drift.
+ *
+ * @param timer Timer to start
+ * @param func Function to call once the timer expires
+ * @param delay Delay in ticks until the first expiry, 1..SCHED_DELAY_MAX
+ * @param period Period in ticks for periodic timers, 0 for one-shot timers
+ * @return none
+ */
+void
+sched_timer_start(struct sched_timer *timer, sched_func_t func,
+        uint16_t delay, uint16_t period)
+{
+    if (timer->armed) {
+        sched_wheel_remove(timer);
+    }
+
+    if (delay == 0) {
+        delay = 1;
+    } else if (delay > SCHED_DELAY_MAX) {
+        delay = SCHED_DELAY_MAX;
+    }
+
+    timer->func = func;
+    timer->period = (period > SCHED_DELAY_MAX) ? SCHED_DELAY_MAX : period;
+    timer->expires = (uint16_t) sched_now() + delay;
+    sched_wheel_insert(timer);
+}
+
+/**
+ * Stop a software timer.
+ *
+ * Stopping a timer that is not armed has no effect.
+ *
+ * @param timer Timer to stop
+ * @return none
+ */
+void
+sched_timer_stop(struct sched_timer *timer)
+{
+    if (timer->armed) {
+        sched_wheel_remove(timer);
+    }
+}
+
+/**
+ * Check if any software timer is armed.
+ *
+ * Without armed timers, the tick is not needed until the next interrupt
+ * posts a task, so the tick timer may be stopped by deeper sleep modes.
+ *
+ * @param none
+ * @return 1 if no timer is armed, 0 otherwise
+ */
+uint8_t
+sched_timers_idle(void)
+{
+    return sched_armed == 0;
+}
+
+/**
+ * Return the current scheduler tick count.
+ *
+ * @param none
+ * @return number of ticks since sched_init()
+ */
+uint32_t
+sched_now(void)
+{
+    uint32_t now;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = sched_ticks;
+    }
+
+    return now;
+}
+
+/**
+ * Return a free-running CPU cycle counter.
+ *
+ * Combines the tick count with the Timer2 counter value, so the resolution
+ * is SCHED_CYCLES_RESOLUTION cycles. Only meant for measuring durations,
+ * the counter wraps around about every nine minutes at 8MHz, and it does
+ * not advance in power-down, unlike sched_now(), see sched_advance().
+ *
+ * @param none
+ * @return CPU cycles since sched_init()
+ */
+uint32_t
+sched_cycles(void)
+{
+    uint32_t ticks;
+    uint8_t count;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = sched_ticks;
+        count = TCNT2;
+        /* compare match happened, but the tick isn't counted yet */
+        if (TIFR2 & (1 << OCF2A)) {
+            ticks++;
+            count = TCNT2;
+        }
+    }
+
+    return (ticks * (SCHED_OCR2A + 1) + count) * SCHED_CYCLES_RESOLUTION;
+}
+
+/**
+ * Account ticks that passed while the tick timer was stopped.
+ *
+ * Called by the power manager after power-down with the time measured by
+ * the watchdog, so sched_now() keeps following the wall clock. Power-down
+ * only happens without armed timers and with all ticks processed, so the
+ * ticks are skipped without walking the timer wheel.
+ *
+ * @param ticks Number of ticks spent with the tick timer stopped
+ * @return none
+ */
+void
+sched_advance(uint16_t ticks)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sched_ticks += ticks;
+    }
+    sched_last += ticks;
+}
+
+/**
+ * Process all timers expiring at the given tick.
+ *
+ * The slot is rescanned from the start after every expired timer, as the
+ * timer function itself may start or stop any timer. Rearmed periodic
+ * timers always expire in the future, so each timer fires at most once.
+ *
+ * @param tick Tick to process
+ * @return none
+ */
+static void
+sched_process_tick(uint16_t tick)
+{
+    struct sched_timer *timer;
+
+    do {
+        for (timer = sched_wheel[tick & SCHED_WHEEL_MASK];
+                timer != NULL; timer = timer->next)
+        {
+            if (timer->expires == tick) {
+                break;
+            }
+        }
+
+        if (timer != NULL) {
+            sched_wheel_remove(timer);
+            if (timer->period) {
+                timer->expires = tick + timer->period;
+                sched_wheel_insert(timer);
+            }
+            timer->func();
+        }
+    } while (timer != NULL);
+}
+
+/**
+ * Run the scheduler main loop.
+ *
+ * Pending tasks are run in priority order, followed by all timer ticks
+ * that elapsed since the last iteration. The watchdog is reset once per
+ * iteration, so no task or timer may block for longer than its timeout.
+ * If there is nothing left to do, the CPU sleeps until the next interrupt.
+ * Note that an interrupt between checking the work state and going to
+ * sleep is handled correctly, since power_sleep() executes the sleep
+ * instruction right after sei(), and the instruction following sei() is
+ * always executed before any pending interrupt.
+ *
+ * @param none
+ * @return never
+ */
+void
+sched_run(void)
+{
+    uint8_t pending;
+    uint8_t task;
+
+    while (1) {
+        wdt_reset();
+
+        ATOMIC_BLOCK(ATOMIC_FORCEON) {
+            pending = sched_pending;
+            sched_pending = 0;
+        }
+
+        if (pending) {
+            /* tasks run at full speed, timer ticks may stay slow */
+            clock_full();
+        }
+
+        for (task = 0; task < SCHED_TASK_MAX; task++) {
+            if ((pending & (1 << task)) && sched_tasks[task] != NULL) {
+                sched_tasks[task]();
+            }
+        }
+
+        while (sched_last != (uint16_t) sched_now()) {
+            sched_process_tick(++sched_last);
+        }
+
+        cli();
+        if (sched_pending == 0 && sched_last == (uint16_t) sched_ticks) {
+            power_sleep();
+        }
+        sei();
+    }
+}
+
+/**
+ * Timer2 compare match interrupt handler.
+ * Advance the scheduler tick.
+ */
+SIGNAL(TIMER2_COMPA_vect)
+{
+    sched_ticks++;
+}
@@ -0,0 +1,65 @@
+/*
+ * Cooperative scheduler
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+
+/* Scheduler tick length in milliseconds, driven by Timer2 compare match */
+#define SCHED_TICK_MS       1
+#define SCHED_MS(ms)        ((ms) / SCHED_TICK_MS)
+
+/* Resolution of sched_cycles(), the Timer2 prescaler */
+#define SCHED_CYCLES_RESOLUTION 64
+
+/* Number of timer wheel slots, must be a power of two */
+#define SCHED_WHEEL_SIZE    16
+#define SCHED_WHEEL_MASK    (SCHED_WHEEL_SIZE - 1)
+
+/* Longest possible timer delay / period in ticks */
+#define SCHED_DELAY_MAX     0x7fff
+
+/*
+ * Run-to-completion tasks, posted from interrupt handlers or other tasks.
+ * Lower numbers run first.
+ */
+#define SCHED_TASK_NRF      0
+#define SCHED_TASK_ADC      1
+#define SCHED_TASK_INPUT    2
+#define SCHED_TASK_REPLAY   3
+#define SCHED_TASK_CONSOLE  4
+#define SCHED_TASK_MAX      5
+
+typedef void (*sched_func_t)(void);
+
+struct sched_timer {
+    struct sched_timer *next;
+    sched_func_t func;
+    uint16_t expires;
+    uint16_t period;
+    uint8_t armed;
+};
+
+void sched_init(void);
+void sched_run(void);
+
+void sched_task_register(uint8_t task, sched_func_t func);
+void sched_post(uint8_t task);
+
+void sched_timer_start(struct sched_timer *timer, sched_func_t func,
+        uint16_t delay, uint16_t period);
+void sched_timer_stop(struct sched_timer *timer);
+#define sched_timer_armed(timer) ((timer)->armed)
+uint8_t sched_timers_idle(void);
+
+uint32_t sched_now(void);
+uint32_t sched_cycles(void);
+void sched_advance(uint16_t ticks);
+
+#endif /* _SCHED_H_ */
@@ -0,0 +1,91 @@
+/*
+ * Stack usage monitoring
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * All RAM between the end of the static data and the top of the stack is
+ * painted with STACK_CANARY before the C runtime initializes the static
+ * data. As the stack grows down, the number of canary bytes left above
+ * the static data is the lowest the stack headroom has been since reset.
+ * There is no heap, so nothing else uses that area.
+ *
+ * A value pushed to the stack may happen to equal the canary, which makes
+ * the result slightly optimistic, by a few bytes at most.
+ *
+ * The worst-case stack depth as calculated from the call graph is part of
+ * the Makefile's size-report target.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "stack.h"
+#include "uart.h"
+
+static const char string_ram[] PROGMEM      = "RAM: static ";
+static const char string_stack[] PROGMEM    = ", stack max ";
+static const char string_free[] PROGMEM     = ", free ";
+static const char string_bytes[] PROGMEM    = " bytes\r\n";
+
+/* Provided by the linker script */
+extern uint8_t _end;
+extern uint8_t __stack;
+
+void stack_paint(void) __attribute__((naked, used, section(".init3")));
+
+/**
+ * Early startup code, run before main().
+ *
+ * Nothing is on the stack yet, so everything up to its top is painted.
+ */
+void
+stack_paint(void)
+{
+    uint8_t *p = &_end;
+
+    while (p <= &__stack) {
+        *p++ = STACK_CANARY;
+    }
+}
+
+/**
+ * Return the lowest stack headroom since reset.
+ *
+ * @param none
+ * @return number of bytes the stack never used
+ */
+uint16_t
+stack_unused(void)
+{
+    const uint8_t *p = &_end;
+    uint16_t count = 0;
+
+    while (p <= &__stack && *p == STACK_CANARY) {
+        p++;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Print static RAM usage and the stack high-water mark.
+ *
+ * @param none
+ * @return none
+ */
+void
+stack_print_stats(void)
+{
+    uint16_t size = &__stack - &_end + 1;
+    uint16_t unused = stack_unused();
+
+    uart_print_pgm(string_ram);
+    uart_putint((uint16_t) &_end - RAMSTART, 1);
+    uart_print_pgm(string_stack);
+    uart_putint(size - unused, 1);
+    uart_print_pgm(string_free);
+    uart_putint(unused, 1);
+    uart_print_pgm(string_bytes);
+}
@@ -0,0 +1,20 @@
+/*
+ * Stack usage monitoring
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _STACK_H_
+#define _STACK_H_
+
+#include <stdint.h>
+
+/* Value the free RAM is filled with at startup */
+#define STACK_CANARY        0xc5
+
+uint16_t stack_unused(void);
+void stack_print_stats(void);
+
+#endif /* _STACK_H_ */
@@ -0,0 +1,237 @@
+/*
+ * nRF8001 link supervisor and watchdog
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Every wait on the nRF8001 is bounded, so a module that stops responding
+ * makes nrf_transmit() fail and flag a link fault, just like a received
+ * HwErrorEvent does. The nRF task hands pending faults to supervisor_check(),
+ * which resets the module and restores its state. Failed resets are retried
+ * every SUPERVISOR_RETRY_MS, after SUPERVISOR_RETRY_MAX failures in a row
+ * the whole AVR is reset by the watchdog.
+ *
+ * The watchdog itself runs in system reset mode and is reset once per
+ * scheduler loop, catching anything that blocks the main loop for longer
+ * than SUPERVISOR_WDT. During power-down, the power manager switches it to
+ * interrupt mode for time keeping, and back with supervisor_wdt_enable().
+ *
+ * Recovery times are measured by fault injection on the actual hardware:
+ * supervisor_inject() holds the module in reset like a brown-out would and
+ * probes the link, so the fault goes through the regular detection path.
+ * The time from detecting a fault to having the module set up again is
+ * accumulated over all recoveries.
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include "supervisor.h"
+#include "nrf.h"
+#include "attr.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_fault[] PROGMEM        = "Link fault ";
+static const char string_recovered[] PROGMEM    = "Link recovered in ";
+static const char string_reset_failed[] PROGMEM = "Module reset failed: ";
+static const char string_wdt_reset[] PROGMEM    = "Watchdog reset\r\n";
+static const char string_faults[] PROGMEM       = "Faults: ";
+static const char string_recoveries[] PROGMEM   = ", recoveries ";
+static const char string_failed[] PROGMEM       = ", failed ";
+static const char string_last[] PROGMEM         = ", last ";
+static const char string_mean[] PROGMEM         = " ms, mean ";
+static const char string_wdt_resets[] PROGMEM   = " ms, watchdog resets ";
+static const char string_ms[] PROGMEM           = " ms\r\n";
+
+struct supervisor_stats supervisor_stats;
+
+/* Reset cause and number of watchdog resets, both kept over resets */
+static uint8_t supervisor_mcusr __attribute__((section(".noinit")));
+static uint8_t supervisor_wdt_resets __attribute__((section(".noinit")));
+
+static struct sched_timer retry_timer;
+static uint32_t fault_start;
+static uint8_t fault_active;
+static uint8_t retries;
+
+void supervisor_early_init(void)
+    __attribute__((naked, used, section(".init3")));
+
+/**
+ * Early startup code, run before main().
+ *
+ * After a watchdog reset, the watchdog stays enabled with the shortest
+ * timeout, so it has to be disabled before the C runtime initialization
+ * takes too long. WDRF has to be cleared first, otherwise WDE can't be.
+ */
+void
+supervisor_early_init(void)
+{
+    supervisor_mcusr = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+
+/**
+ * Initialize the supervisor.
+ *
+ * Reports a previous watchdog reset and starts the watchdog.
+ *
+ * @param none
+ * @return none
+ */
+void
+supervisor_init(void)
+{
+    if (supervisor_mcusr & ((1 << PORF) | (1 << BORF))) {
+        supervisor_wdt_resets = 0;
+    }
+
+    if (supervisor_mcusr & (1 << WDRF)) {
+        supervisor_wdt_resets++;
+        uart_print_pgm(string_wdt_reset);
+    }
+
+    supervisor_wdt_enable();
+}
+
+/**
+ * Enable the watchdog in system reset mode.
+ *
+ * @param none
+ * @return none
+ */
+void
+supervisor_wdt_enable(void)
+{
+    wdt_reset();
+    wdt_enable(SUPERVISOR_WDT);
+}
+
+/**
+ * Retry timer, have the nRF task call supervisor_check() again.
+ */
+static void
+supervisor_retry(void)
+{
+    sched_post(SCHED_TASK_NRF);
+}
+
+/**
+ * Handle a pending link fault.
+ *
+ * Called from the nRF task before anything else is done with the module.
+ * Resets the module and resyncs the local attributes, or schedules
+ * another attempt if that fails.
+ *
+ * @param none
+ * @return 0 if the link is usable, 1 if a fault is still pending
+ */
+uint8_t
+supervisor_check(void)
+{
+    int8_t ret;
+
+    if (nrf_fault == NRF_FAULT_NONE) {
+        return 0;
+    }
+
+    if (sched_timer_armed(&retry_timer)) {
+        return 1;
+    }
+
+    if (!fault_active) {
+        fault_active = 1;
+        fault_start = sched_now();
+        supervisor_stats.faults++;
+        uart_print_pgm(string_fault);
+        uart_putint(nrf_fault, 1);
+        uart_newline();
+    }
+
+    nrf_fault = NRF_FAULT_NONE;
+    ret = nrf_reset_module();
+
+    if (ret == 0 && nrf_fault == NRF_FAULT_NONE) {
+        attr_resync();
+
+        supervisor_stats.last_ms = (sched_now() - fault_start) * SCHED_TICK_MS;
+        supervisor_stats.recover_ms += supervisor_stats.last_ms;
+        supervisor_stats.recoveries++;
+        fault_active = 0;
+        retries = 0;
+
+        uart_print_pgm(string_recovered);
+        uart_putint(supervisor_stats.last_ms, 1);
+        uart_print_pgm(string_ms);
+        return 0;
+    }
+
+    supervisor_stats.failed++;
+    uart_print_pgm(string_reset_failed);
+    uart_putint(ret, 1);
+    uart_newline();
+
+    if (++retries >= SUPERVISOR_RETRY_MAX) {
+        /* leave it to the watchdog */
+        while (1) {
+            /* wait */
+        }
+    }
+
+    if (nrf_fault == NRF_FAULT_NONE) {
+        nrf_fault = NRF_FAULT_SETUP;
+    }
+    sched_timer_start(&retry_timer, supervisor_retry,
+            SCHED_MS(SUPERVISOR_RETRY_MS), 0);
+
+    return 1;
+}
+
+/**
+ * Inject a link fault.
+ *
+ * Holds the module in reset, as if it had browned out, and probes the
+ * link with a temperature request, which is bound to time out. The
+ * supervisor then takes over as with any other fault.
+ *
+ * @param none
+ * @return none
+ */
+void
+supervisor_inject(void)
+{
+    ble_reset_low();
+    nrf_print_temperature();
+}
+
+/**
+ * Print fault and recovery statistics.
+ *
+ * @param none
+ * @return none
+ */
+void
+supervisor_print_stats(void)
+{
+    uart_print_pgm(string_faults);
+    uart_putint(supervisor_stats.faults, 1);
+    uart_print_pgm(string_recoveries);
+    uart_putint(supervisor_stats.recoveries, 1);
+    uart_print_pgm(string_failed);
+    uart_putint(supervisor_stats.failed, 1);
+    uart_print_pgm(string_last);
+    uart_putint(supervisor_stats.last_ms, 1);
+    uart_print_pgm(string_mean);
+    if (supervisor_stats.recoveries > 0) {
+        uart_putint(supervisor_stats.recover_ms /
+                supervisor_stats.recoveries, 1);
+    } else {
+        uart_putchar('0');
+    }
+    uart_print_pgm(string_wdt_resets);
+    uart_putint(supervisor_wdt_resets, 1);
+    uart_newline();
+}
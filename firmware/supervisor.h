@@ -0,0 +1,44 @@
+/*
+ * nRF8001 link supervisor and watchdog
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _SUPERVISOR_H_
+#define _SUPERVISOR_H_
+
+#include <stdint.h>
+#include <avr/wdt.h>
+
+/* Watchdog reset timeout while the scheduler is running */
+#define SUPERVISOR_WDT          WDTO_2S
+
+/* Delay between failed module reset attempts */
+#ifndef SUPERVISOR_RETRY_MS
+#define SUPERVISOR_RETRY_MS     1000
+#endif
+
+/* Failed module resets in a row before the watchdog resets the AVR */
+#ifndef SUPERVISOR_RETRY_MAX
+#define SUPERVISOR_RETRY_MAX    5
+#endif
+
+struct supervisor_stats {
+    uint16_t faults;        /* detected link faults */
+    uint16_t recoveries;    /* faults recovered by a module reset */
+    uint16_t failed;        /* failed module reset attempts */
+    uint32_t recover_ms;    /* total fault to recovery time */
+    uint32_t last_ms;       /* last fault to recovery time */
+};
+
+void supervisor_init(void);
+void supervisor_wdt_enable(void);
+uint8_t supervisor_check(void);
+void supervisor_inject(void);
+void supervisor_print_stats(void);
+
+extern struct supervisor_stats supervisor_stats;
+
+#endif /* _SUPERVISOR_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Connection parameter profiles
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * The setup data requests a 7.5ms connection interval without slave
+ * latency, which is the best case for latency but the worst for power.
+ * While connected, the link state is evaluated periodically and a new set
+ * of connection parameters is requested via ChangeTimingRequest:
+ *
+ *  - values waiting in the send cache switch to the low latency profile
+ *  - an idle link steps down to the balanced, and later to the low power
+ *    profile, but never back up unless there is a backlog again
+ *
+ * The central has the final word on the parameters, the actually used
+ * ones are reported by the TimingEvent and shown with timing_print().
+ */
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "timing.h"
+#include "nrf.h"
+#include "connevt.h"
+#include "sched.h"
+#include "uart.h"
+
+static const char string_profile[] PROGMEM  = "Profile: ";
+static const char string_auto[] PROGMEM     = " auto";
+static const char string_requests[] PROGMEM = ", requests ";
+
+struct timing_profile {
+    uint16_t min_interval;  /* 1.25ms units */
+    uint16_t max_interval;  /* 1.25ms units */
+    uint16_t latency;       /* connection events */
+    uint16_t timeout;       /* 10ms units */
+};
+
+/*
+ * Profile table. The supervision timeout has to be larger than
+ * (1 + latency) * max_interval * 2.
+ */
+static const struct timing_profile profiles[TIMING_PROFILE_COUNT] PROGMEM = {
+    /* low latency: 7.5-15ms, no latency, 2s timeout */
+    {    6,   12, 0, 200 },
+    /* balanced: 50-100ms, no latency, 4s timeout */
+    {   40,   80, 0, 400 },
+    /* low power: 400-500ms, 2 skipped events, 6s timeout */
+    {  320,  400, 2, 600 },
+};
+
+static struct sched_timer timing_timer;
+static uint8_t timing_auto = 1;
+static uint8_t timing_profile;
+static uint16_t timing_requests;
+static uint32_t timing_last_request;
+
+
+/**
+ * Request the given profile's connection parameters.
+ *
+ * @param profile Profile number
+ * @return 0 on success, -1 on error
+ */
+static int8_t
+timing_request(uint8_t profile)
+{
+    struct timing_profile p;
+
+    memcpy_P(&p, &profiles[profile], sizeof(p));
+
+    if (nrf_change_timing(p.min_interval, p.max_interval,
+                p.latency, p.timeout) < 0)
+    {
+        return -1;
+    }
+
+    timing_profile = profile;
+    timing_requests++;
+    timing_last_request = sched_now();
+
+    return 0;
+}
+
+/**
+ * Profile evaluation timer.
+ * Pick a profile based on the send backlog and link idle time.
+ *
+ * @param none
+ * @return none
+ */
+static void
+timing_eval(void)
+{
+    uint32_t now = sched_now();
+    uint32_t idle = now - nrf_last_activity;
+    uint8_t profile = timing_profile;
+
+    if (nrf_connect_state != NRF_STATE_CONNECTED) {
+        sched_timer_stop(&timing_timer);
+        return;
+    }
+
+    if (now - timing_last_request < SCHED_MS(TIMING_HOLDOFF_MS)) {
+        return;
+    }
+
+    /* values held for the next connection event are no backlog */
+    if (nrf_tx_pending() > 0 && !connevt_holding()) {
+        profile = TIMING_PROFILE_LOW_LATENCY;
+    } else if (idle >= SCHED_MS(TIMING_IDLE_LOW_POWER_MS)) {
+        profile = TIMING_PROFILE_LOW_POWER;
+    } else if (idle >= SCHED_MS(TIMING_IDLE_BALANCED_MS) &&
+               timing_profile == TIMING_PROFILE_LOW_LATENCY)
+    {
+        profile = TIMING_PROFILE_BALANCED;
+    }
+
+    if (profile != timing_profile) {
+        timing_request(profile);
+    }
+}
+
+/**
+ * Handle connection state changes.
+ *
+ * The setup's preferred parameters match the low latency profile, which
+ * is therefore assumed at the start of each connection.
+ *
+ * @param connected 1 on a new connection, 0 on disconnect
+ * @return none
+ */
+void
+timing_connection(uint8_t connected)
+{
+    if (connected) {
+        timing_profile = TIMING_PROFILE_LOW_LATENCY;
+        timing_last_request = sched_now();
+        if (timing_auto) {
+            sched_timer_start(&timing_timer, timing_eval,
+                    SCHED_MS(TIMING_EVAL_MS), SCHED_MS(TIMING_EVAL_MS));
+        }
+    } else {
+        sched_timer_stop(&timing_timer);
+    }
+}
+
+/**
+ * Switch to the given profile and disable automatic switching.
+ *
+ * @param profile Profile number, one of the TIMING_PROFILE_* values
+ * @return 0 on success, -1 if not connected or invalid profile
+ */
+int8_t
+timing_set_profile(uint8_t profile)
+{
+    if (profile >= TIMING_PROFILE_COUNT) {
+        return -1;
+    }
+
+    timing_set_auto(0);
+    return timing_request(profile);
+}
+
+/**
+ * Enable or disable automatic profile switching.
+ *
+ * @param enable 1 to enable, 0 to disable
+ * @return none
+ */
+void
+timing_set_auto(uint8_t enable)
+{
+    timing_auto = enable;
+
+    if (!enable) {
+        sched_timer_stop(&timing_timer);
+    } else if (nrf_connect_state == NRF_STATE_CONNECTED) {
+        sched_timer_start(&timing_timer, timing_eval,
+                SCHED_MS(TIMING_EVAL_MS), SCHED_MS(TIMING_EVAL_MS));
+    }
+}
+
+/**
+ * Print the current profile and the negotiated connection parameters.
+ *
+ * @param none
+ * @return none
+ */
+void
+timing_print(void)
+{
+    uart_print_pgm(string_profile);
+    uart_putint(timing_profile, 1);
+    if (timing_auto) {
+        uart_print_pgm(string_auto);
+    }
+    uart_print_pgm(string_requests);
+    uart_putint(timing_requests, 1);
+    uart_newline();
+    nrf_print_timing();
+}
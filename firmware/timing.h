@@ -0,0 +1,44 @@
+/*
+ * Connection parameter profiles
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ */
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+#include <stdint.h>
+
+#define TIMING_PROFILE_LOW_LATENCY  0
+#define TIMING_PROFILE_BALANCED     1
+#define TIMING_PROFILE_LOW_POWER    2
+#define TIMING_PROFILE_COUNT        3
+
+/* Interval to re-evaluate the profile while connected */
+#ifndef TIMING_EVAL_MS
+#define TIMING_EVAL_MS              500
+#endif
+
+/* Link idle time to step down to the balanced profile */
+#ifndef TIMING_IDLE_BALANCED_MS
+#define TIMING_IDLE_BALANCED_MS     2000
+#endif
+
+/* Link idle time to step down to the low power profile */
+#ifndef TIMING_IDLE_LOW_POWER_MS
+#define TIMING_IDLE_LOW_POWER_MS    30000
+#endif
+
+/* Minimum time between two automatic change requests */
+#ifndef TIMING_HOLDOFF_MS
+#define TIMING_HOLDOFF_MS           5000
+#endif
+
+void timing_connection(uint8_t connected);
+int8_t timing_set_profile(uint8_t profile);
+void timing_set_auto(uint8_t enable);
+void timing_print(void);
+
+#endif /* _TIMING_H_ */
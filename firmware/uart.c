@@ -7,6 +7,7 @@
 #include "uart.h"
 
 static volatile char uart_inbuf;
+static void (*uart_rx_callback)(void);
 
 
 SIGNAL(USART_RX_vect)
@@ -15,6 +16,10 @@ SIGNAL(USART_RX_vect)
 
     c = uart_getchar();
     uart_inbuf = c;
+
+    if (uart_rx_callback) {
+        uart_rx_callback();
+    }
 }
 
 
@@ -49,9 +54,20 @@ uart_putchar(char d)
     while (!(UCSR0A & (1 << UDRE0))) {
         /* wait for empty tx buffer */
     }
+    /* clear TX complete flag, keeping U2X0 and the error flags zero */
+    UCSR0A = (UCSR0A & (1 << U2X0)) | (1 << TXC0);
     UDR0 = d;
 }
 
+/**
+ * Check if all data has been shifted out.
+ */
+uint8_t
+uart_tx_idle(void)
+{
+    return (UCSR0A & (1 << TXC0)) || !(UCSR0B & (1 << TXEN0));
+}
+
 
 char
 uart_getchar(void)
@@ -191,3 +207,13 @@ uart_reset_inbuf(void)
     uart_inbuf = 0;
 }
 
+/**
+ * Set function to call from the RX interrupt after a character arrived.
+ * The callback runs in interrupt context, keep it short.
+ */
+void
+uart_set_rx_callback(void (*callback)(void))
+{
+    uart_rx_callback = callback;
+}
+
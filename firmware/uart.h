@@ -10,6 +10,7 @@
 void uart_init(int16_t brate);
 
 void uart_putchar(char d);
+uint8_t uart_tx_idle(void);
 char uart_getchar(void);
 void uart_newline(void);
 void uart_print(char *data);
@@ -19,5 +20,6 @@ void uart_putint(int32_t number, int8_t digits);
 
 char uart_get_inbuf(void);
 void uart_reset_inbuf(void);
+void uart_set_rx_callback(void (*callback)(void));
 #endif /* _AVRLIB_UART_H_ */
 
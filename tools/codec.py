@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+#
+# Host side counterpart of firmware/codec.c
+# Part of the Bluetooth LE example system
+#
+# Copyright 2017 Sven Gregori
+# Released under MIT License
+#
+#
+# Decodes codec packets, and encodes recorded samples in every mode to
+# compare the compression ratio against 16 bit raw values.
+#
+#   codec.py decode [--adc]      hex packets from stdin, one per line,
+#                                --adc for ADC packets with their own
+#                                sequence number and channel header
+#   codec.py bench FILE [BITS]   one sample per line, or comma separated
+#                                with the sample in the last column, BITS
+#                                is the sample width, 10 by default. The
+#                                delta width is picked as the best one.
+#
+import sys
+
+PACKET_MAX = 20
+HEADER_LEN = 2
+
+RAW = 0
+PACK = 1
+VARINT = 2
+DELTA_PACK = 3
+MODES = {RAW: 'raw', PACK: 'pack', VARINT: 'varint', DELTA_PACK: 'delta-pack'}
+
+
+def zigzag(delta):
+    delta = ((delta + 0x8000) & 0xffff) - 0x8000
+    return ((delta << 1) ^ (delta >> 15)) & 0xffff
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+class BitWriter:
+    def __init__(self):
+        self.data = bytearray()
+        self.acc = 0
+        self.bits = 0
+
+    def size(self, bits):
+        return len(self.data) + (self.bits + bits + 7) // 8
+
+    def put(self, value, bits):
+        self.acc |= value << self.bits
+        self.bits += bits
+        while self.bits >= 8:
+            self.data.append(self.acc & 0xff)
+            self.acc >>= 8
+            self.bits -= 8
+
+    def end(self):
+        if self.bits:
+            self.data.append(self.acc & 0xff)
+        return self.data
+
+
+class BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+        self.acc = 0
+        self.bits = 0
+
+    def get(self, bits):
+        while self.bits < bits:
+            self.acc |= self.data[self.pos] << self.bits
+            self.pos += 1
+            self.bits += 8
+        value = self.acc & ((1 << bits) - 1)
+        self.acc >>= bits
+        self.bits -= bits
+        return value
+
+
+def varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append((value & 0x7f) | 0x80)
+        value >>= 7
+    out.append(value)
+    return out
+
+
+def encode_packet(values, mode, bits, size=PACKET_MAX):
+    """Encode values into one packet, return (packet, values consumed)"""
+    if mode == RAW:
+        bits = 16
+    max_len = size - HEADER_LEN
+    writer = BitWriter()
+    count = 0
+    last = 0
+
+    for value in values:
+        z = zigzag(value - last)
+        if mode in (RAW, PACK):
+            if value >> bits:
+                raise ValueError('value %d too wide for %d bits' % (value, bits))
+            if writer.size(bits) > max_len:
+                break
+            writer.put(value, bits)
+        elif mode == VARINT:
+            v = varint(z)
+            if len(writer.data) + len(v) > max_len:
+                break
+            writer.data += v
+        else:
+            width = 16 if count == 0 else bits
+            if count > 0 and z >> bits:
+                break
+            if writer.size(width) > max_len:
+                break
+            writer.put(value if count == 0 else z, width)
+        last = value
+        count += 1
+
+    header = bytes([(mode << 5) | ((bits - 1) & 0x1f), count])
+    return header + bytes(writer.end()), count
+
+
+def encode(values, mode, bits, size=PACKET_MAX):
+    packets = []
+    while values:
+        packet, count = encode_packet(values, mode, bits, size)
+        packets.append(packet)
+        values = values[count:]
+    return packets
+
+
+def decode(packet):
+    mode = packet[0] >> 5
+    bits = (packet[0] & 0x1f) + 1
+    count = packet[1]
+    data = packet[HEADER_LEN:]
+    values = []
+
+    if mode == VARINT:
+        last = 0
+        pos = 0
+        for _ in range(count):
+            value = shift = 0
+            while True:
+                byte = data[pos]
+                pos += 1
+                value |= (byte & 0x7f) << shift
+                shift += 7
+                if not byte & 0x80:
+                    break
+            last = (last + unzigzag(value)) & 0xffff
+            values.append(last)
+        return values
+
+    reader = BitReader(data)
+    for i in range(count):
+        if mode == DELTA_PACK:
+            if i == 0:
+                values.append(reader.get(16))
+            else:
+                values.append((values[-1] + unzigzag(reader.get(bits))) & 0xffff)
+        else:
+            values.append(reader.get(bits))
+    return values
+
+
+def cmd_decode(args):
+    adc = '--adc' in args
+    for line in sys.stdin:
+        line = line.strip().replace(' ', '')
+        if not line:
+            continue
+        packet = bytes.fromhex(line)
+        if adc:
+            print('seq %d channel %d: %s' % (packet[0], packet[1],
+                  ' '.join(str(v) for v in decode(packet[2:]))))
+        else:
+            print(' '.join(str(v) for v in decode(packet)))
+
+
+def cmd_bench(args):
+    bits = int(args[1]) if len(args) > 1 else 10
+    with open(args[0]) as f:
+        values = [int(line.split(',')[-1]) for line in f if line.strip()]
+    if not values:
+        sys.exit('no samples')
+
+    raw = len(values) * 2
+    print('%d samples, %d bytes raw, %d bit values' % (len(values), raw, bits))
+    for mode, name in MODES.items():
+        widths = range(1, 17) if mode == DELTA_PACK else [bits]
+        best = None
+        for width in widths:
+            packets = encode(values, mode, width)
+            size = sum(len(p) for p in packets)
+            if best is None or size < best[1]:
+                best = (packets, size, width)
+        packets, size, width = best
+        assert [v for p in packets for v in decode(p)] == values
+        if mode == DELTA_PACK:
+            name += '/%d' % width
+        print('%-13s %5d packets %7d bytes %5.1f%% %5.1f samples/packet' %
+              (name, len(packets), size, 100.0 * size / raw,
+               float(len(values)) / len(packets)))
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2 or sys.argv[1] not in ('decode', 'bench'):
+        sys.exit('usage: codec.py decode [--adc] | bench FILE [BITS]')
+    if sys.argv[1] == 'decode':
+        cmd_decode(sys.argv[2:])
+    else:
+        cmd_bench(sys.argv[2:])
@@ -0,0 +1,251 @@
+#!/usr/bin/env python3
+#
+# Connection event alignment simulation, see firmware/connevt.c
+# Part of the Bluetooth LE example system
+#
+# Copyright 2017 Sven Gregori
+# Released under MIT License
+#
+#
+# Runs the send cache of a single TX pipe against a scripted nRF8001 with a
+# known connection interval, once sending right away, and once holding
+# values until just before the expected connection event, using the same
+# integer math as firmware/connevt.c. Reports the latency from writing a
+# value until a packet with that value, or a newer one, went on air.
+#
+#   connevt_sim.py [INTERVAL_MS [WRITE_MS [SECONDS]]]
+#
+# INTERVAL_MS is the connection interval, 30 by default. WRITE_MS is the
+# mean time between writes, with random spacing, 10 by default. Without
+# arguments, a set of typical intervals and write rates is run.
+#
+import heapq
+import random
+import sys
+
+F_CPU = 8000000
+CYCLES_RESOLUTION = 64
+TICK_MS = 1
+
+# connevt.h defaults
+GUARD_MS = 3
+LOCK_COUNT = 4
+HOLDOVER = 64
+
+# Simulated link, times in microseconds
+CREDITS = 2
+CLOCK_OFFSET = 0.008        # AVR RC oscillator runs 0.8% fast
+CREDIT_DELAY = 1000         # credit return behind the event anchor
+CREDIT_JITTER = 400
+TASK_DELAY = 200            # RDYN edge until the event is handled
+SEND_TIME = 1500            # SendData transaction incl. REQN inactive time
+EVENT_SETUP = 300           # latest SendData arrival before the anchor
+
+U32 = 0xffffffff
+
+
+def c_div(a, b):
+    """C integer division, truncating towards zero."""
+    q = abs(a) // abs(b)
+    return q if (a < 0) == (b < 0) else -q
+
+
+class Connevt:
+    """firmware/connevt.c, with uint32_t / int32_t wrapping."""
+
+    def __init__(self, interval_units):
+        self.nominal = interval_units * (F_CPU // 1000) * 5 // 4
+        self.period = self.nominal
+        self.anchor = 0
+        self.count = 0
+        self.timer = None
+
+    def observe(self, cycles):
+        if self.count == 0:
+            self.anchor = cycles
+            self.count = 1
+            return
+        elapsed = (cycles - self.anchor) & U32
+        events = (elapsed + self.period // 2) // self.period
+        if events == 0:
+            return
+        error = (elapsed - events * self.period) & U32
+        if error & 0x80000000:
+            error -= 1 << 32
+        if events > HOLDOVER or abs(error) > self.period // 4:
+            self.anchor = cycles
+            self.count = 1
+            return
+        self.anchor = (self.anchor + events * self.period + c_div(error, 4)) & U32
+        self.period += c_div(error, events * 16)
+        self.count = min(self.count + 1, LOCK_COUNT)
+
+    def locked(self, now):
+        if self.count < LOCK_COUNT:
+            return False
+        if ((now - self.anchor) & U32) > HOLDOVER * self.period:
+            self.count = 0
+            return False
+        return True
+
+    def hold_ticks(self, now):
+        """Ticks to hold the cache, 0 to send now."""
+        guard = (F_CPU // 1000) * GUARD_MS
+        tick = (F_CPU // 1000) * TICK_MS
+        if not self.locked(now):
+            return 0
+        nxt = self.period - ((now - self.anchor) & U32) % self.period
+        if nxt <= guard + tick:
+            return 0
+        return (nxt - guard) // tick
+
+
+class Sim:
+    def __init__(self, interval_ms, write_ms, seconds, align, seed):
+        self.rng = random.Random(seed)
+        self.interval_units = max(6, round(interval_ms / 1.25))
+        self.interval = self.interval_units * 1250
+        self.align = align
+        self.connevt = Connevt(self.interval_units)
+        self.queue = []
+        self.seq = 0
+        self.end = seconds * 1000000
+        self.write_ms = write_ms
+
+        self.credits = CREDITS
+        self.version = 0            # latest written value
+        self.dirty = False
+        self.busy_until = 0         # SPI bus and main context
+        self.nrf_queue = []         # versions queued on the nRF8001
+        self.timer_armed = False
+        self.releasing = False
+
+        self.writes = {}            # version -> write time, not yet on air
+        self.latency = []
+        self.packets = 0
+
+    def push(self, t, what, arg=None):
+        self.seq += 1
+        heapq.heappush(self.queue, (t, self.seq, what, arg))
+
+    def cycles(self, t):
+        """sched_cycles() of the AVR at simulated time t."""
+        c = int(t * (1 + CLOCK_OFFSET) * F_CPU / 1000000)
+        return (c // CYCLES_RESOLUTION * CYCLES_RESOLUTION) & U32
+
+    def avr_tick(self, t):
+        return int(t * (1 + CLOCK_OFFSET) / 1000 / TICK_MS)
+
+    def tick_time(self, tick):
+        return tick * TICK_MS * 1000 / (1 + CLOCK_OFFSET)
+
+    def flush(self, t):
+        if not self.dirty:
+            return
+        if self.align and not self.releasing:
+            if self.timer_armed:
+                return
+            ticks = self.connevt.hold_ticks(self.cycles(t))
+            if ticks > 0:
+                self.timer_armed = True
+                self.push(self.tick_time(self.avr_tick(t) + ticks), 'release')
+                return
+        if self.credits == 0:
+            return
+        start = max(t, self.busy_until)
+        self.busy_until = start + SEND_TIME
+        self.credits -= 1
+        self.dirty = False
+        self.packets += 1
+        self.push(self.busy_until, 'queued', self.version)
+
+    def run(self):
+        t = self.rng.uniform(0, self.interval)
+        while t < self.end:
+            self.push(t, 'event')
+            t += self.interval
+        t = 0
+        while t < self.end:
+            t += self.rng.expovariate(1 / (self.write_ms * 1000))
+            self.push(t, 'write')
+
+        while self.queue:
+            t, _, what, arg = heapq.heappop(self.queue)
+            if what == 'write':
+                self.version += 1
+                self.writes[self.version] = t
+                self.dirty = True
+                self.flush(t)
+            elif what == 'queued':
+                self.nrf_queue.append((t, arg))
+            elif what == 'event':
+                sent = [v for (q, v) in self.nrf_queue if q <= t - EVENT_SETUP]
+                self.nrf_queue = [(q, v) for (q, v) in self.nrf_queue
+                                  if q > t - EVENT_SETUP]
+                if sent:
+                    self.on_air(t, max(sent))
+                    rdyn = t + CREDIT_DELAY + self.rng.uniform(0, CREDIT_JITTER)
+                    self.push(rdyn, 'credit', (len(sent), rdyn))
+            elif what == 'credit':
+                count, rdyn = arg
+                t = max(t + TASK_DELAY, self.busy_until)
+                self.credits += count
+                self.connevt.observe(self.cycles(rdyn))
+                self.flush(t)
+            elif what == 'release':
+                self.timer_armed = False
+                self.releasing = True
+                self.flush(max(t, self.busy_until))
+                self.releasing = False
+
+        return self
+
+    def on_air(self, t, version):
+        for v in [v for v in self.writes if v <= version]:
+            self.latency.append(t - self.writes.pop(v))
+
+    def report(self):
+        lat = sorted(self.latency)
+        n = len(lat)
+        return {
+            'mean': sum(lat) / n / 1000,
+            'p50': lat[n // 2] / 1000,
+            'p95': lat[n * 95 // 100] / 1000,
+            'max': lat[-1] / 1000,
+            'packets': self.packets / max(1, n),
+            'stale': len(self.writes),
+        }
+
+
+def compare(interval_ms, write_ms, seconds):
+    print('interval %5.1f ms, write every %5.1f ms' % (interval_ms, write_ms))
+    result = {}
+    for align in (False, True):
+        r = Sim(interval_ms, write_ms, seconds, align, 1).run().report()
+        result[align] = r
+        print('  %-9s latency mean %6.2f  p50 %6.2f  p95 %6.2f  max %6.2f ms'
+              '  packets/write %.2f' % ('aligned' if align else 'immediate',
+                                       r['mean'], r['p50'], r['p95'], r['max'],
+                                       r['packets']))
+    gain = result[False]['mean'] - result[True]['mean']
+    print('  gain     %6.2f ms mean (%.0f%%), %.0f%% fewer packets' % (
+        gain, 100 * gain / result[False]['mean'],
+        100 * (1 - result[True]['packets'] / result[False]['packets'])))
+    return result
+
+
+def main(argv):
+    if len(argv) > 1:
+        interval = float(argv[1])
+        write = float(argv[2]) if len(argv) > 2 else 10
+        seconds = int(argv[3]) if len(argv) > 3 else 60
+        compare(interval, write, seconds)
+        return 0
+
+    for interval, write in ((7.5, 20), (30, 100), (30, 10), (50, 10), (100, 20)):
+        compare(interval, write, 60)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,166 @@
+/*
+ * ACI receive and parse fuzz harness
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Host build of firmware/nrf.c, with the fuzz input standing in for the
+ * nRF8001's side of the SPI bus. Every byte clocked in by spi_transmit()
+ * is the next input byte, so the input is a sequence of raw ACI transfers
+ * as the module would send them: debug byte, length, opcode and data.
+ * The simulated module answers REQN with RDYN as long as input is left,
+ * and stops answering once it's used up, which ends the run through the
+ * regular RDYN timeout.
+ *
+ * Each run receives and parses packets until the input is used up,
+ * including events queued during send-only transfers, so the length
+ * handling of nrf_transmit() and every event handler in nrf_parse() is
+ * reached. Event handlers that send commands or data, e.g. on a returned
+ * data credit, take their responses from the input as well.
+ *
+ * The other firmware modules are replaced by the stubs in stubs.c. State
+ * kept in nrf.c carries over from one run to the next, as it would on
+ * the device.
+ *
+ * Built with clang's libFuzzer, see the Makefile. With FUZZ_STANDALONE,
+ * main() runs the files given on the command line instead, to reproduce
+ * a crash or to run a corpus with any compiler.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "nrf.h"
+#include "spi.h"
+
+volatile uint8_t avr_io[0x100];
+
+static const uint8_t *fuzz_data;
+static size_t fuzz_length;
+static size_t fuzz_pos;
+
+/**
+ * Clock a byte out to the simulated module and the next input byte in.
+ *
+ * @param data Byte sent to the module, ignored
+ * @return next input byte, 0 once the input is used up
+ */
+uint8_t
+spi_transmit(uint8_t data)
+{
+    (void) data;
+
+    if (fuzz_pos < fuzz_length) {
+        return fuzz_data[fuzz_pos++];
+    }
+    return 0;
+}
+
+/**
+ * Let the simulated module react to REQN: RDYN goes low while REQN is
+ * low and there is input left, and high otherwise. Called from the
+ * nrf_wait_rdyn() polling loop.
+ *
+ * @param us Delay, ignored
+ * @return none
+ */
+void
+_delay_us(double us)
+{
+    (void) us;
+
+    if (!(PORTB & (1 << PB2)) && fuzz_pos < fuzz_length) {
+        PINB &= ~(1 << PB1);
+    } else {
+        PINB |= (1 << PB1);
+    }
+}
+
+/**
+ * Millisecond delay, see _delay_us().
+ *
+ * @param ms Delay, ignored
+ * @return none
+ */
+void
+_delay_ms(double ms)
+{
+    _delay_us(ms * 1000);
+}
+
+/**
+ * libFuzzer entry point, receive and parse all packets in the input.
+ *
+ * @param data Fuzz input, raw ACI transfers from the module
+ * @param size Input length
+ * @return 0
+ */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fuzz_data = data;
+    fuzz_length = size;
+    fuzz_pos = 0;
+
+    nrf_drop_queued();
+
+    while (fuzz_pos < fuzz_length) {
+        memset(&rx, 0, sizeof(rx));
+        if (nrf_receive(&rx) < 0) {
+            break;
+        }
+        nrf_parse(&rx);
+        nrf_parse_queued();
+    }
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/**
+ * Run each file given on the command line once.
+ *
+ * @param argc Argument count
+ * @param argv Input files
+ * Each input gets a buffer of its exact size, so the sanitizers catch
+ * reads past its end.
+ *
+ * @return 0 on success, 1 if a file couldn't be read
+ */
+int
+main(int argc, char **argv)
+{
+    FILE *file;
+    uint8_t *buf;
+    long length;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        fseek(file, 0, SEEK_END);
+        length = ftell(file);
+        rewind(file);
+
+        buf = malloc(length > 0 ? length : 1);
+        if (buf == NULL || fread(buf, 1, length, file) != (size_t) length) {
+            perror(argv[i]);
+            fclose(file);
+            free(buf);
+            return 1;
+        }
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(buf, length);
+        free(buf);
+    }
+
+    return 0;
+}
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Host shim of <avr/io.h> for the fuzz harness
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Only the registers the nRF8001 code uses, at their ATmega328P data
+ * space addresses, so the PINx register is found two bytes below PORTx.
+ */
+#ifndef _SHIM_AVR_IO_H_
+#define _SHIM_AVR_IO_H_
+
+#include <stdint.h>
+
+extern volatile uint8_t avr_io[0x100];
+
+#define _SFR_MEM8(addr) (avr_io[(addr)])
+
+#define PINB    _SFR_MEM8(0x23)
+#define DDRB    _SFR_MEM8(0x24)
+#define PORTB   _SFR_MEM8(0x25)
+#define PINC    _SFR_MEM8(0x26)
+#define DDRC    _SFR_MEM8(0x27)
+#define PORTC   _SFR_MEM8(0x28)
+#define PIND    _SFR_MEM8(0x29)
+#define DDRD    _SFR_MEM8(0x2a)
+#define PORTD   _SFR_MEM8(0x2b)
+#define PCICR   _SFR_MEM8(0x68)
+#define PCMSK0  _SFR_MEM8(0x6b)
+#define PCMSK1  _SFR_MEM8(0x6c)
+#define PCMSK2  _SFR_MEM8(0x6d)
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PD2 2
+#define PD4 4
+#define PD7 7
+
+#define PCIE0   0
+#define PCIE1   1
+#define PCIE2   2
+#define PCINT0  0
+#define PCINT1  1
+#define PCINT2  2
+
+#endif /* _SHIM_AVR_IO_H_ */
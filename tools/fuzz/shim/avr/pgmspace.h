@@ -0,0 +1,53 @@
+/*
+ * Host shim of <avr/pgmspace.h> for the fuzz harness
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Flash and RAM share one address space on the host. With -fpack-struct,
+ * table entries aren't aligned, so multi-byte reads go through memcpy().
+ */
+#ifndef _SHIM_AVR_PGMSPACE_H_
+#define _SHIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)             (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) pgm_read_word_shim((const void *) (addr))
+#define pgm_read_dword(addr) pgm_read_dword_shim((const void *) (addr))
+#define pgm_read_ptr(addr)  pgm_read_ptr_shim((const void *) (addr))
+
+static inline uint16_t
+pgm_read_word_shim(const void *addr)
+{
+    uint16_t value;
+    memcpy(&value, addr, sizeof(value));
+    return value;
+}
+
+static inline uint32_t
+pgm_read_dword_shim(const void *addr)
+{
+    uint32_t value;
+    memcpy(&value, addr, sizeof(value));
+    return value;
+}
+
+static inline void *
+pgm_read_ptr_shim(const void *addr)
+{
+    void *value;
+    memcpy(&value, addr, sizeof(value));
+    return value;
+}
+
+#define memcpy_P            memcpy
+#define strlen_P            strlen
+
+#endif /* _SHIM_AVR_PGMSPACE_H_ */
@@ -0,0 +1,19 @@
+/*
+ * Host shim of <util/atomic.h> for the fuzz harness
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * The harness has no interrupts, blocks simply run once.
+ */
+#ifndef _SHIM_UTIL_ATOMIC_H_
+#define _SHIM_UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) \
+    for (uint8_t _atomic_once = 1; _atomic_once; _atomic_once = 0)
+
+#endif /* _SHIM_UTIL_ATOMIC_H_ */
@@ -0,0 +1,18 @@
+/*
+ * Host shim of <util/delay.h> for the fuzz harness
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Delays take no time, the harness uses them to let the simulated
+ * module answer REQN, see fuzz_nrf.c.
+ */
+#ifndef _SHIM_UTIL_DELAY_H_
+#define _SHIM_UTIL_DELAY_H_
+
+void _delay_ms(double ms);
+void _delay_us(double us);
+
+#endif /* _SHIM_UTIL_DELAY_H_ */
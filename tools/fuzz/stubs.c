@@ -0,0 +1,91 @@
+/*
+ * Firmware module stubs for the fuzz harness
+ * Part of the Bluetooth LE example system
+ *
+ * Copyright 2017 Sven Gregori
+ * Released under MIT License
+ *
+ *
+ * Everything nrf.c calls outside of itself. Console output is dropped,
+ * the scheduler clock advances with every call, and the services take
+ * whatever they are given.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "ack.h"
+#include "bond.h"
+#include "clock.h"
+#include "connevt.h"
+#include "input.h"
+#include "pwm.h"
+#include "sched.h"
+#include "uart.h"
+
+struct input_stats input_stats;
+
+static uint32_t stub_ticks;
+static uint8_t stub_bond[BOND_MSG_MAX][BOND_MSG_LEN];
+static uint8_t stub_bond_length[BOND_MSG_MAX];
+static uint8_t stub_bond_count;
+
+void ack_flush(void) { }
+void ack_received(uint8_t pipe) { (void) pipe; }
+void ack_error(uint8_t pipe, uint8_t error) { (void) pipe; (void) error; }
+void ack_disconnected(void) { }
+
+int8_t
+ack_rx_received(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    (void) pipe;
+    (void) data;
+    (void) length;
+    return 0;
+}
+
+uint8_t
+bond_count(void)
+{
+    return stub_bond_count;
+}
+
+uint8_t
+bond_read(uint8_t index, uint8_t *data)
+{
+    memcpy(data, stub_bond[index], stub_bond_length[index]);
+    return stub_bond_length[index];
+}
+
+void
+bond_write(uint8_t index, const uint8_t *data, uint8_t length)
+{
+    memcpy(stub_bond[index], data, length);
+    stub_bond_length[index] = length;
+}
+
+void bond_commit(uint8_t count) { stub_bond_count = count; }
+void bond_clear(void) { stub_bond_count = 0; }
+
+void clock_full(void) { }
+
+void connevt_start(uint16_t interval) { (void) interval; }
+void connevt_stop(void) { }
+void connevt_observe(uint32_t cycles) { (void) cycles; }
+uint8_t connevt_hold(void) { return 0; }
+
+int8_t
+pwm_command(const uint8_t *data, uint8_t length)
+{
+    (void) data;
+    (void) length;
+    return 0;
+}
+
+void sched_post(uint8_t task) { (void) task; }
+uint32_t sched_now(void) { return ++stub_ticks; }
+uint32_t sched_cycles(void) { return stub_ticks << 8; }
+
+void uart_putchar(char d) { (void) d; }
+void uart_newline(void) { }
+void uart_print_pgm(const char *data) { (void) data; }
+void uart_puthex(char c) { (void) c; }
+void uart_putint(int32_t number, int8_t digits) { (void) number; (void) digits; }
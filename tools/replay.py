@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+#
+# ACI event trace replay, host side of firmware/replay.c
+# Part of the Bluetooth LE example system
+#
+# Copyright 2017 Sven Gregori
+# Released under MIT License
+#
+#
+# Extracts the received ACI events from UART dumps, as printed by
+# nrf_print_rx() in "[NN] xx xx ..." lines, and replays them through the
+# firmware's event parser, either on the device or on simavr's UART pty.
+# Lines may start with a timestamp in seconds, as added by e.g.
+# "ts %.s", which is used to replay at the recorded timing. Binary
+# captures hold the raw ACI packets, each one a length byte followed by
+# that many bytes, opcode first.
+#
+#   replay.py stats FILE [--binary]
+#       event counts per opcode and malformed events, without a device
+#
+#   replay.py run FILE TTY [--binary] [--baud N] [--recorded]
+#                          [--save OUT] [--ref REF]
+#       replays all events, as fast as the UART allows or with --recorded
+#       at the recorded timing, and reports events per second and cycles
+#       per event. --save writes each event's state and output to OUT,
+#       --ref compares them to a previous --save, reporting divergences.
+#
+# The cycles are taken around nrf_parse() on the device, so they include
+# the time the event handlers spend printing at the console baud rate.
+#
+import json
+import os
+import re
+import select
+import sys
+import termios
+import time
+
+F_CPU = 8000000
+
+# Event names and minimum lengths including the opcode, see nrf_evt_table
+EVENTS = {
+    0x81: ('DeviceStarted', 4), 0x82: ('Echo', 1), 0x83: ('HwError', 3),
+    0x84: ('CommandResponse', 3), 0x85: ('Connected', 15),
+    0x86: ('Disconnected', 3), 0x87: ('BondStatus', 7),
+    0x88: ('PipeStatus', 17), 0x89: ('Timing', 7), 0x8a: ('DataCredit', 2),
+    0x8b: ('DataAck', 2), 0x8c: ('DataReceived', 2), 0x8d: ('PipeError', 3),
+    0x8e: ('DisplayKey', 7), 0x8f: ('KeyRequest', 2),
+}
+DATA_MAX = 30
+
+RX_LINE = re.compile(r'^\s*(?:(\d+(?:\.\d*)?)\s+)?\[\s*(\d+)\]((?:\s+[0-9a-fA-F]{2})*)\s*$')
+
+BAUDS = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+         57600: termios.B57600, 115200: termios.B115200}
+
+
+def read_text(path):
+    """Return (timestamp or None, event bytes) for all events, and the
+    number of lines that look like events but don't add up."""
+    events = []
+    bad = 0
+    with open(path, errors='replace') as f:
+        for line in f:
+            m = RX_LINE.match(line)
+            if not m:
+                continue
+            length = int(m.group(2))
+            data = bytes.fromhex(m.group(3).replace(' ', '').replace('\t', ''))
+            if length == 0:
+                continue
+            if length != len(data) or length > DATA_MAX:
+                bad += 1
+                continue
+            ts = float(m.group(1)) if m.group(1) else None
+            events.append((ts, data))
+    return events, bad
+
+
+def read_binary(path):
+    events = []
+    bad = 0
+    with open(path, 'rb') as f:
+        raw = f.read()
+    i = 0
+    while i < len(raw):
+        length = raw[i]
+        data = raw[i + 1:i + 1 + length]
+        i += 1 + length
+        if length == 0:
+            continue
+        if length != len(data) or length > DATA_MAX:
+            bad += 1
+            continue
+        events.append((None, data))
+    return events, bad
+
+
+def read_events(path, args):
+    if '--binary' in args:
+        return read_binary(path)
+    return read_text(path)
+
+
+def event_name(data):
+    return EVENTS.get(data[0], ('unknown %02x' % data[0], 0))[0]
+
+
+def cmd_stats(args):
+    events, bad = read_events(args[0], args)
+    counts = {}
+    short = 0
+    for _, data in events:
+        name, min_length = EVENTS.get(data[0], (None, 0))
+        if name is None or len(data) < min_length:
+            short += 1
+        counts[event_name(data)] = counts.get(event_name(data), 0) + 1
+    print('%d events, %d malformed, %d broken lines' % (len(events), short, bad))
+    for name, count in sorted(counts.items(), key=lambda x: -x[1]):
+        print('  %-16s %6d' % (name, count))
+    stamped = [ts for ts, _ in events if ts is not None]
+    if len(stamped) > 1:
+        span = stamped[-1] - stamped[0]
+        print('recorded over %.1f s, %.1f events/s' % (span, (len(stamped) - 1) / span
+                                                      if span > 0 else 0))
+
+
+class Tty:
+    """Raw serial port with line reads, stdlib only."""
+
+    def __init__(self, path, baud):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        attr = termios.tcgetattr(self.fd)
+        attr[0] = 0                                     # iflag
+        attr[1] = 0                                     # oflag
+        attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attr[3] = 0                                     # lflag
+        attr[4] = attr[5] = BAUDS[baud]
+        termios.tcsetattr(self.fd, termios.TCSANOW, attr)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.buf = b''
+
+    def write(self, data):
+        os.write(self.fd, data)
+
+    def readline(self, timeout):
+        end = time.time() + timeout
+        while b'\n' not in self.buf:
+            left = end - time.time()
+            if left <= 0 or not select.select([self.fd], [], [], left)[0]:
+                raise TimeoutError('no answer from the device')
+            self.buf += os.read(self.fd, 256)
+        line, self.buf = self.buf.split(b'\n', 1)
+        return line.decode(errors='replace').rstrip('\r')
+
+    def expect(self, prefix, timeout):
+        skipped = []
+        while True:
+            line = self.readline(timeout)
+            if line.startswith(prefix):
+                return line, skipped
+            skipped.append(line)
+
+
+def cmd_run(args):
+    path, tty_path = args[0], args[1]
+    baud = int(args[args.index('--baud') + 1]) if '--baud' in args else 9600
+    recorded = '--recorded' in args
+    save = args[args.index('--save') + 1] if '--save' in args else None
+    ref = args[args.index('--ref') + 1] if '--ref' in args else None
+
+    events, bad = read_events(path, args)
+    if not events:
+        sys.exit('no events in %s' % path)
+    if recorded and events[0][0] is None:
+        sys.exit('--recorded needs timestamps')
+
+    tty = Tty(tty_path, baud)
+    tty.write(b'u')
+    tty.expect('Replay ready', 5)
+
+    results = []
+    start = time.time()
+    for ts, data in events:
+        if recorded and ts is not None:
+            delay = (ts - events[0][0]) - (time.time() - start)
+            if delay > 0:
+                time.sleep(delay)
+        tty.write((' '.join('%02x' % b for b in data) + '\n').encode())
+        line, output = tty.expect('= ', 10)
+        _, seq, cycles, state = line.split(' ', 3)
+        results.append({'seq': int(seq), 'event': data.hex(), 'cycles': int(cycles),
+                        'state': state, 'output': output})
+    elapsed = time.time() - start
+
+    tty.write(b'\n')
+    summary, _ = tty.expect('Replay:', 10)
+
+    cycles = sorted(r['cycles'] for r in results)
+    mean = sum(cycles) / len(cycles)
+    print('%d events replayed, %d broken lines skipped' % (len(results), bad))
+    print('%.1f events/s over the UART, %.1f s' % (len(results) / elapsed, elapsed))
+    print('cycles per event: mean %.0f, median %d, max %d, %.0f events/s at %d MHz' %
+          (mean, cycles[len(cycles) // 2], cycles[-1], F_CPU / mean, F_CPU // 1000000))
+    per_event = {}
+    for r in results:
+        per_event.setdefault(event_name(bytes.fromhex(r['event'])), []).append(r['cycles'])
+    for name, c in sorted(per_event.items(), key=lambda x: -sum(x[1])):
+        print('  %-16s %6d events, cycles mean %7.0f, max %7d' %
+              (name, len(c), sum(c) / len(c), max(c)))
+    print(summary)
+
+    if save:
+        with open(save, 'w') as f:
+            for r in results:
+                f.write(json.dumps(r) + '\n')
+
+    if ref:
+        with open(ref) as f:
+            expected = [json.loads(line) for line in f if line.strip()]
+        diverged = 0
+        for r, e in zip(results, expected):
+            if r['event'] != e['event']:
+                sys.exit('%s was recorded from a different trace' % ref)
+            if r['state'] != e['state'] or r['output'] != e['output']:
+                diverged += 1
+                if diverged <= 10:
+                    print('divergence at event %d (%s):' % (r['seq'], event_name(
+                        bytes.fromhex(r['event']))))
+                    print('  expected %s %s' % (e['state'], e['output']))
+                    print('  got      %s %s' % (r['state'], r['output']))
+        if len(results) != len(expected):
+            print('%d events replayed, %d in %s' % (len(results), len(expected), ref))
+        print('%d of %d events diverged' % (diverged, min(len(results), len(expected))))
+        return 1 if diverged else 0
+
+    return 0
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3 or sys.argv[1] not in ('stats', 'run') or \
+            (sys.argv[1] == 'run' and len(sys.argv) < 4):
+        sys.exit('usage: replay.py stats FILE [--binary] | '
+                 'run FILE TTY [--binary] [--baud N] [--recorded] [--save OUT] [--ref REF]')
+    if sys.argv[1] == 'stats':
+        cmd_stats(sys.argv[2:])
+    else:
+        sys.exit(cmd_run(sys.argv[2:]))
@@ -0,0 +1,290 @@
+#!/usr/bin/env python3
+#
+# RAM, flash and stack budget report
+# Part of the Bluetooth LE example system
+#
+# Copyright 2017 Sven Gregori
+# Released under MIT License
+#
+#
+# usage: size_report.py MAP DISASSEMBLY [--nm NM_OUTPUT] [--top N] SU_FILES...
+#
+#   MAP           linker map file
+#   DISASSEMBLY   avr-objdump -d output of the ELF file
+#   NM_OUTPUT     avr-nm -S output, adds static symbols to the breakdown,
+#                 which the map file doesn't list
+#   SU_FILES      -fstack-usage output of all objects
+#
+# RAM and flash usage is broken down per object file from the map file's
+# input sections, and per symbol. The worst-case stack depth is the
+# deepest call path from main() plus the deepest interrupt handler, as
+# interrupts don't nest. Each call adds the frame size from the .su files
+# and two bytes of return address, entering an interrupt handler adds the
+# return address as well. Calls are taken from the disassembly. Indirect
+# calls are assumed to reach any function that is never called directly,
+# which is how tasks, timers and event handlers are called here.
+#
+import re
+import sys
+from collections import defaultdict
+
+RAM_SIZE = 2048
+FLASH_SIZE = 32768
+RETURN_ADDRESS = 2
+
+RAM_SECTIONS = ('.data', '.bss', '.noinit')
+FLASH_SECTIONS = ('.text', '.vectors', '.progmem', '.init', '.fini',
+                  '.trampolines', '.ctors', '.dtors', '.jumptables',
+                  '.lowtext', '.hightext', '.bootloader')
+
+section_re = re.compile(r'^ (\.\S+|COMMON)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*))?$')
+continuation_re = re.compile(r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$')
+symbol_re = re.compile(r'^\s+0x([0-9a-f]+)\s+([A-Za-z_.$][\w.$]*)$')
+call_re = re.compile(r'\b(r?call|r?jmp)\b.*<([^>+]+)>')
+indirect_re = re.compile(r'\b(e?icall|e?ijmp)\b|\bcall\s+\*')
+function_re = re.compile(r'^[0-9a-f]+ <([^>]+)>:$')
+
+
+def region(name):
+    """Return 'ram', 'data' (RAM and flash), 'flash' or None"""
+    if name.startswith('.data'):
+        return 'data'
+    if name == 'COMMON' or name.startswith(RAM_SECTIONS):
+        return 'ram'
+    if name.startswith(FLASH_SECTIONS):
+        return 'flash'
+    return None
+
+
+def short_name(path):
+    return re.sub(r'^.*/', '', path)
+
+
+def parse_map(filename):
+    """Return a list of input sections as (region, address, size, file, [(address, symbol)])"""
+    sections = []
+    pending = None
+    in_map = False
+
+    with open(filename) as f:
+        for line in f:
+            line = line.rstrip('\n')
+            if line.startswith('Linker script and memory map'):
+                in_map = True
+                continue
+            if not in_map:
+                continue
+
+            if pending is not None:
+                match = continuation_re.match(line)
+                pending_name = pending
+                pending = None
+                if match:
+                    sections.append([region(pending_name), int(match.group(1), 16),
+                                     int(match.group(2), 16), short_name(match.group(3)), []])
+                    continue
+
+            match = section_re.match(line)
+            if match:
+                if match.group(2) is None:
+                    pending = match.group(1)
+                else:
+                    sections.append([region(match.group(1)), int(match.group(2), 16),
+                                     int(match.group(3), 16), short_name(match.group(4)), []])
+                continue
+
+            match = symbol_re.match(line)
+            if match and sections:
+                sections[-1][4].append((int(match.group(1), 16), match.group(2)))
+
+    return [s for s in sections if s[0] is not None and s[2] > 0]
+
+
+def parse_nm(filename):
+    """Return a list of (region, address, size, symbol) from nm -S output"""
+    symbols = []
+    with open(filename) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) != 4:
+                continue
+            address, size, kind, name = fields
+            kind = kind.lower()
+            if kind in 'bd':
+                symbols.append(('data' if kind == 'd' else 'ram', int(address, 16),
+                                int(size, 16), name))
+            elif kind in 'tr':
+                symbols.append(('flash', int(address, 16), int(size, 16), name))
+    return symbols
+
+
+def symbols_from_map(sections):
+    """Derive symbol sizes from the addresses of the global symbols"""
+    symbols = []
+    for kind, address, size, obj, names in sections:
+        names = sorted(set(names))
+        end = address + size
+        if not names or names[0][0] > address:
+            first = names[0][0] if names else end
+            symbols.append((kind, address, first - address, '(local in %s)' % obj))
+        for i, (addr, name) in enumerate(names):
+            following = names[i + 1][0] if i + 1 < len(names) else end
+            symbols.append((kind, addr, following - addr, name))
+    return symbols
+
+
+def owner(sections, address):
+    for kind, start, size, obj, names in sections:
+        if start <= address < start + size:
+            return obj
+    return '?'
+
+
+def report_memory(sections, symbols, top):
+    ram = defaultdict(int)
+    flash = defaultdict(int)
+    for kind, address, size, obj, names in sections:
+        if kind in ('ram', 'data'):
+            ram[obj] += size
+        if kind in ('flash', 'data'):
+            flash[obj] += size
+
+    ram_total = sum(ram.values())
+    flash_total = sum(flash.values())
+    print('RAM:   %5d of %5d bytes (%.1f%%)' % (ram_total, RAM_SIZE, 100.0 * ram_total / RAM_SIZE))
+    print('Flash: %5d of %5d bytes (%.1f%%)' % (flash_total, FLASH_SIZE, 100.0 * flash_total / FLASH_SIZE))
+
+    for title, usage, kinds in (('RAM', ram, ('ram', 'data')), ('Flash', flash, ('flash', 'data'))):
+        print('\n%s per file:' % title)
+        for obj, size in sorted(usage.items(), key=lambda x: -x[1]):
+            print('  %6d  %s' % (size, obj))
+
+        print('\n%s per symbol, top %d:' % (title, top))
+        listed = sorted((s for s in symbols if s[0] in kinds and s[2] > 0), key=lambda x: -x[2])
+        for kind, address, size, name in listed[:top]:
+            print('  %6d  %-32s %s' % (size, name, owner(sections, address)))
+
+    return ram_total
+
+
+def parse_disassembly(filename):
+    """Return direct callees and the functions with indirect calls"""
+    calls = defaultdict(set)
+    indirect = set()
+    function = None
+
+    with open(filename) as f:
+        for line in f:
+            match = function_re.match(line.strip())
+            if match:
+                function = match.group(1)
+                calls[function]
+                continue
+            if function is None:
+                continue
+            if indirect_re.search(line):
+                indirect.add(function)
+                continue
+            match = call_re.search(line)
+            if match and match.group(2) != function:
+                calls[function].add((match.group(2), match.group(1).endswith('call')))
+
+    return calls, indirect
+
+
+def parse_su(filenames):
+    frames = {}
+    for filename in filenames:
+        with open(filename) as f:
+            for line in f:
+                fields = line.rstrip('\n').split('\t')
+                if len(fields) < 2:
+                    continue
+                name = fields[0].rsplit(':', 1)[-1]
+                frames[name] = max(frames.get(name, 0), int(fields[1]))
+    return frames
+
+
+def report_stack(calls, indirect, frames, ram_total):
+    called = set()
+    for callees in calls.values():
+        called.update(name for name, is_call in callees)
+    vectors = sorted(f for f in calls if re.match(r'^__vector_\d+$', f))
+    # never called directly, so only reachable through function pointers
+    targets = sorted(f for f in calls if f not in called and f in frames and
+                     f != 'main' and f not in vectors)
+
+    unknown = set()
+    recursive = set()
+    depth = {}
+
+    def worst(function, stack):
+        if function in depth:
+            return depth[function]
+        if function in stack:
+            recursive.add(function)
+            return (0, [function + ' (recursion)'])
+        if function not in frames:
+            unknown.add(function)
+        stack.add(function)
+
+        best = (0, [])
+        callees = set(calls.get(function, ()))
+        if function in indirect:
+            callees.update((t, True) for t in targets)
+        for callee, is_call in callees:
+            sub, path = worst(callee, stack)
+            sub += RETURN_ADDRESS if is_call else 0
+            if sub > best[0]:
+                best = (sub, path)
+
+        stack.discard(function)
+        result = (frames.get(function, 0) + best[0], [function] + best[1])
+        depth[function] = result
+        return result
+
+    main_depth, main_path = worst('main', set())
+    isr = (0, [])
+    for vector in vectors:
+        sub, path = worst(vector, set())
+        if sub > isr[0]:
+            isr = (sub, path)
+
+    total = main_depth + isr[0] + (RETURN_ADDRESS if isr[0] else 0)
+    print('\nStack, worst case: %d bytes' % total)
+    print('  main:      %4d  %s' % (main_depth, ' > '.join(main_path)))
+    print('  interrupt: %4d  %s' % (isr[0], ' > '.join(isr[1])))
+    print('  headroom:  %4d bytes of RAM left' % (RAM_SIZE - ram_total - total))
+    if indirect:
+        print('  indirect calls in: %s' % ', '.join(sorted(indirect)))
+        print('  assumed targets:   %s' % ', '.join(targets))
+    if recursive:
+        print('  recursion, not bounded: %s' % ', '.join(sorted(recursive)))
+    if unknown:
+        print('  no stack usage info, counted as 0: %s' % ', '.join(sorted(unknown)))
+
+
+def main(args):
+    nm = None
+    top = 15
+    if '--nm' in args:
+        i = args.index('--nm')
+        nm = args[i + 1]
+        del args[i:i + 2]
+    if '--top' in args:
+        i = args.index('--top')
+        top = int(args[i + 1])
+        del args[i:i + 2]
+    if len(args) < 2:
+        sys.exit('usage: size_report.py MAP DISASSEMBLY [--nm NM_OUTPUT] [--top N] SU_FILES...')
+
+    sections = parse_map(args[0])
+    symbols = parse_nm(nm) if nm else symbols_from_map(sections)
+    ram_total = report_memory(sections, symbols, top)
+
+    calls, indirect = parse_disassembly(args[1])
+    report_stack(calls, indirect, parse_su(args[2:]), ram_total)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])